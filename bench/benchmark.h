@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_BENCHMARK_H
+#define HSERV_BENCHMARK_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The measurement loop of the benchmark programs. A benchmark runs a batch
+// of iterations a few times after a warm-up, the median run is reported per
+// iteration: time, TSC cycles (x86 only), processed bytes per cycle and heap
+// allocations.
+//
+// Include it into one file of a program: it replaces operator new to count
+// the allocations.
+
+#if defined(__GNUC__) && __GNUC__ >= 11
+// The replacement delete is inlined and reported as a mismatched free().
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static size_t benchAllocations = 0;
+
+void *operator new(size_t size)
+{
+    ++benchAllocations;
+
+    if( void *ptr = malloc(size) )
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) throw()
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) throw()
+{
+    free(ptr);
+}
+
+namespace bench {
+
+struct Result
+{
+    Result() : ns(0), cycles(0), allocations(0) {}
+
+    double ns;
+    double cycles;
+    double allocations;
+};
+
+inline boost::uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+inline bool operator<(const Result &lhs, const Result &rhs)
+{
+    return lhs.ns < rhs.ns;
+}
+
+// The function is called as function(count) and performs count iterations.
+template<typename Function>
+Result measure(Function &function, size_t iterations)
+{
+    enum { runs = 5 };
+
+    std::vector<Result> results;
+
+    results.reserve(runs);
+
+    // caches, branch predictors and the buffers which grow on the first use
+    function(iterations / 10 + 1);
+
+    for(int run = 0; run < runs; ++run)
+    {
+        Result result;
+        size_t allocationsBefore = benchAllocations;
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        boost::uint64_t cyclesBefore = cycles();
+
+        function(iterations);
+
+        boost::uint64_t cyclesAfter = cycles();
+        boost::posix_time::time_duration elapsed =
+                boost::posix_time::microsec_clock::universal_time() - start;
+
+        result.ns = elapsed.total_microseconds() * 1000.0 / iterations;
+        result.cycles = static_cast<double>(cyclesAfter - cyclesBefore) / iterations;
+        result.allocations = static_cast<double>(benchAllocations - allocationsBefore) / iterations;
+        results.push_back(result);
+    }
+
+    std::sort(results.begin(), results.end());
+    return results[runs / 2];
+}
+
+inline void printHeader(const char *name, const char *variant, const char *unit)
+{
+    std::cout << std::left << std::setw(20) << name << std::setw(16) << variant
+              << std::right << std::setw(14) << (std::string("ns/") + unit)
+              << std::setw(14) << "bytes/cycle"
+              << std::setw(18) << (std::string("allocs/") + unit) << std::endl;
+}
+
+// `bytes` are processed by one iteration.
+inline void printRow(const char *name, const char *variant, const Result &result, size_t bytes)
+{
+    std::cout << std::left << std::setw(20) << name << std::setw(16) << variant
+              << std::right << std::fixed
+              << std::setw(14) << std::setprecision(1) << result.ns;
+
+    if( result.cycles > 0 )
+        std::cout << std::setw(14) << std::setprecision(2) << bytes / result.cycles;
+    else
+        std::cout << std::setw(14) << "-";
+
+    std::cout << std::setw(18) << std::setprecision(2) << result.allocations << std::endl;
+}
+
+inline size_t iterationsArgument(int argc, char **argv, size_t defaultValue)
+{
+    return argc > 1 ? static_cast<size_t>(atoi(argv[1])) : defaultValue;
+}
+
+} // namespace bench
+
+#endif // HSERV_BENCHMARK_H
@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+
+#include <hserv/context.h>
+#include <hserv/impl/fastcgiconnection.h>
+
+#include "benchmark.h"
+
+using namespace hserv;
+
+// A socket which reads the same request again and again, the written data
+// is counted only. Like a web server, the next request is sent when the
+// previous one is ended. When the requests are over, the read is never
+// completed and the connection is released.
+class MemorySocket
+{
+public:
+    typedef boost::asio::io_service::executor_type executor_type;
+
+    explicit MemorySocket(boost::asio::io_service &ioService)
+        : ioService(ioService), offset(0), remaining(0), readSize(0), written(0),
+          started(0), ended(0)
+    {
+    }
+
+    executor_type get_executor()
+    {
+        return ioService.get_executor();
+    }
+
+    void setInput(const std::string &data, size_t requests, size_t readSize)
+    {
+        input = data;
+        offset = 0;
+        remaining = requests;
+        started = 0;
+        ended = 0;
+        this->readSize = readSize ? readSize : data.size();
+    }
+
+    size_t bytesWritten() const
+    {
+        return written;
+    }
+
+    template<typename MutableBuffers, typename Handler>
+    void async_read_some(const MutableBuffers &buffers, Handler handler)
+    {
+        if( remaining == 0 )
+            return;
+
+        if( offset == 0 )
+        {
+            if( started != ended )
+            {
+                ioService.post(Retry<MutableBuffers, Handler>(*this, buffers, handler));
+                return;
+            }
+
+            ++started;
+        }
+
+        size_t size = std::min(boost::asio::buffer_size(buffers),
+                               std::min(readSize, input.size() - offset));
+
+        boost::asio::buffer_copy(buffers, boost::asio::buffer(&input[offset], size));
+        offset += size;
+
+        if( offset == input.size() )
+        {
+            offset = 0;
+            --remaining;
+        }
+
+        ioService.post(Completion<Handler>(handler, size));
+    }
+
+    template<typename ConstBuffers, typename Handler>
+    void async_write_some(const ConstBuffers &buffers, Handler handler)
+    {
+        size_t size = boost::asio::buffer_size(buffers);
+        typename ConstBuffers::const_iterator it = buffers.begin(), end = buffers.end();
+
+        // FCGI_END_REQUEST is a buffer of its own
+        for(; it != end; ++it)
+        {
+            if( boost::asio::buffer_size(*it) == 16 &&
+                    boost::asio::buffer_cast<const char *>(*it)[1] == 3 )
+                ++ended;
+        }
+
+        written += size;
+        ioService.post(Completion<Handler>(handler, size));
+    }
+
+    bool is_open() const
+    {
+        return true;
+    }
+
+    void close()
+    {
+    }
+
+    void close(boost::system::error_code &)
+    {
+    }
+
+private:
+    template<typename Handler>
+    struct Completion
+    {
+        Completion(const Handler &handler, size_t size)
+            : handler(handler), size(size)
+        {
+        }
+
+        void operator()()
+        {
+            handler(boost::system::error_code(), size);
+        }
+
+        // The socket is used by the handlers only, the memory of the
+        // operations is allocated the same way.
+        friend void *asio_handler_allocate(size_t size, Completion *self)
+        {
+            return boost_asio_handler_alloc_helpers::allocate(size, self->handler);
+        }
+
+        friend void asio_handler_deallocate(void *ptr, size_t size, Completion *self)
+        {
+            boost_asio_handler_alloc_helpers::deallocate(ptr, size, self->handler);
+        }
+
+        Handler handler;
+        size_t size;
+    };
+
+    template<typename MutableBuffers, typename Handler>
+    struct Retry
+    {
+        Retry(MemorySocket &socket, const MutableBuffers &buffers, const Handler &handler)
+            : socket(socket), buffers(buffers), handler(handler)
+        {
+        }
+
+        void operator()()
+        {
+            socket.async_read_some(buffers, handler);
+        }
+
+        friend void *asio_handler_allocate(size_t size, Retry *self)
+        {
+            return boost_asio_handler_alloc_helpers::allocate(size, self->handler);
+        }
+
+        friend void asio_handler_deallocate(void *ptr, size_t size, Retry *self)
+        {
+            boost_asio_handler_alloc_helpers::deallocate(ptr, size, self->handler);
+        }
+
+        MemorySocket &socket;
+        MutableBuffers buffers;
+        Handler handler;
+    };
+
+    boost::asio::io_service &ioService;
+    std::string input;
+    size_t offset;
+    size_t remaining;
+    size_t readSize;
+    size_t written;
+    size_t started;
+    size_t ended;
+};
+
+typedef FastCGIConnection<MemorySocket> MemoryConnection;
+
+enum { FcgiBeginRequest = 1, FcgiParams = 4, FcgiStdin = 5, MaxRecordLength = 0xffff };
+
+static void appendRecord(std::string &out, int type, const std::string &content)
+{
+    size_t offset = 0;
+
+    do
+    {
+        size_t size = std::min<size_t>(content.size() - offset, MaxRecordLength);
+        const char header[] = {
+            1, static_cast<char>(type), 0, 1,
+            static_cast<char>(size >> 8), static_cast<char>(size & 0xff), 0, 0
+        };
+
+        out.append(header, sizeof(header));
+        out.append(content, offset, size);
+        offset += size;
+    }
+    while( offset < content.size() );
+}
+
+static void appendLength(std::string &out, size_t size)
+{
+    if( size < 128 )
+    {
+        out += static_cast<char>(size);
+    }
+    else
+    {
+        out += static_cast<char>((size >> 24) | 0x80);
+        out += static_cast<char>(size >> 16);
+        out += static_cast<char>(size >> 8);
+        out += static_cast<char>(size);
+    }
+}
+
+static void appendParam(std::string &out, const std::string &name, const std::string &value)
+{
+    appendLength(out, name.size());
+    appendLength(out, value.size());
+    out += name;
+    out += value;
+}
+
+// The records of a keep-alive request from the web server.
+static std::string makeRequest(const char *const params[][2], size_t count,
+                               const std::string &body)
+{
+    static const char beginRequest[] = { 0, 1, 1, 0, 0, 0, 0, 0 };
+    std::string out;
+    std::string paramsData;
+
+    appendRecord(out, FcgiBeginRequest, std::string(beginRequest, sizeof(beginRequest)));
+
+    for(size_t i = 0; i < count; ++i)
+        appendParam(paramsData, params[i][0], params[i][1]);
+
+    appendRecord(out, FcgiParams, paramsData);
+    appendRecord(out, FcgiParams, std::string());
+
+    if( body.empty() == false )
+        appendRecord(out, FcgiStdin, body);
+
+    appendRecord(out, FcgiStdin, std::string());
+    return out;
+}
+
+struct Sample {
+    const char *name;
+    const char *variant;
+    std::string request;
+    size_t responseSize;
+    // The request arrives in reads of this size, zero means at once.
+    size_t readSize;
+};
+
+static std::vector<Sample> makeCorpus()
+{
+    static const char *const tinyParams[][2] = {
+        { "REQUEST_METHOD", "GET" },
+        { "REQUEST_URI", "/" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "HTTP_HOST", "localhost" }
+    };
+
+    // 15 headers
+    static const char *const browserParams[][2] = {
+        { "REQUEST_METHOD", "GET" },
+        { "REQUEST_URI", "/wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "GATEWAY_INTERFACE", "CGI/1.1" },
+        { "REMOTE_ADDR", "192.168.1.10" },
+        { "REMOTE_PORT", "51234" },
+        { "SERVER_NAME", "www.kittyhell.com" },
+        { "SERVER_PORT", "80" },
+        { "HTTP_HOST", "www.kittyhell.com" },
+        { "HTTP_USER_AGENT", "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10.6; ja-JP-mac; rv:1.9.2.3) "
+                             "Gecko/20100401 Firefox/3.6.3 Pathtraq/0.9" },
+        { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+        { "HTTP_ACCEPT_LANGUAGE", "ja,en-us;q=0.7,en;q=0.3" },
+        { "HTTP_ACCEPT_ENCODING", "gzip,deflate" },
+        { "HTTP_ACCEPT_CHARSET", "Shift_JIS,utf-8;q=0.7,*;q=0.7" },
+        { "HTTP_KEEP_ALIVE", "115" },
+        { "HTTP_CONNECTION", "keep-alive" },
+        { "HTTP_REFERER", "http://www.kittyhell.com/2010/03/hello-kitty-darth-vader/" },
+        { "HTTP_CACHE_CONTROL", "max-age=0" },
+        { "HTTP_IF_MODIFIED_SINCE", "Sat, 17 Oct 2015 00:29:57 GMT" },
+        { "HTTP_IF_NONE_MATCH", "\"4d2a-5f7c1e3b\"" },
+        { "HTTP_DNT", "1" },
+        { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" },
+        { "HTTP_COOKIE", "wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; "
+                         "__utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; "
+                         "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|"
+                         "utmcct=/reader/|utmcmd=referral" }
+    };
+
+    static const char *const postParams[][2] = {
+        { "REQUEST_METHOD", "POST" },
+        { "REQUEST_URI", "/upload" },
+        { "SERVER_PROTOCOL", "HTTP/1.1" },
+        { "HTTP_HOST", "localhost" },
+        { "CONTENT_TYPE", "application/octet-stream" },
+        { "CONTENT_LENGTH", "65536" }
+    };
+
+    const size_t tinyCount = sizeof(tinyParams) / sizeof(tinyParams[0]);
+    const size_t browserCount = sizeof(browserParams) / sizeof(browserParams[0]);
+    const size_t postCount = sizeof(postParams) / sizeof(postParams[0]);
+
+    std::string tiny = makeRequest(tinyParams, tinyCount, std::string());
+    std::string browser = makeRequest(browserParams, browserCount, std::string());
+    std::string post = makeRequest(postParams, postCount, std::string(65536, 'x'));
+
+    std::vector<Sample> corpus;
+
+    Sample s1 = { "tiny GET", "13 B", tiny, 13, 0 };
+    corpus.push_back(s1);
+
+    Sample s2 = { "browser GET", "13 B", browser, 13, 0 };
+    corpus.push_back(s2);
+
+    Sample s3 = { "large POST", "13 B", post, 13, 0 };
+    corpus.push_back(s3);
+
+    // The connection reads the header of a record, then its content.
+    Sample s4 = { "split GET", "13 B", browser, 13, 16 };
+    corpus.push_back(s4);
+
+    Sample s5 = { "tiny GET", "16 KB", tiny, 16 * 1024, 0 };
+    corpus.push_back(s5);
+
+    Sample s6 = { "tiny GET", "256 KB", tiny, 256 * 1024, 0 };
+    corpus.push_back(s6);
+
+    return corpus;
+}
+
+// Requests through a keep-alive connection: the records are parsed, the
+// handler answers, the response is framed to STDOUT records.
+struct FastCgiLoop
+{
+    FastCgiLoop(const Sample &sample)
+        : sample(sample), content(sample.responseSize, 'x'), requests(0), written(0)
+    {
+    }
+
+    void operator()(size_t iterations)
+    {
+        boost::shared_ptr<MemoryConnection> connection = boost::make_shared<MemoryConnection>(
+                    boost::ref(ioService), boost::bind(&FastCgiLoop::handle, this, _1));
+
+        connection->getSocket().setInput(sample.request, iterations, sample.readSize);
+        connection->start();
+
+        ioService.run();
+        ioService.reset();
+
+        written += connection->getSocket().bytesWritten();
+    }
+
+    void handle(const boost::shared_ptr<Context> &context)
+    {
+        Response &response = context->response();
+
+        response.setStatus(Response::Ok);
+        response.addHeader("Content-Type", "text/plain");
+        response.setContent(&content[0], content.size());
+        context->asyncDone();
+
+        ++requests;
+    }
+
+    const Sample &sample;
+    boost::asio::io_service ioService;
+    std::string content;
+    size_t requests;
+    size_t written;
+};
+
+int main(int argc, char **argv)
+{
+    size_t iterations = bench::iterationsArgument(argc, argv, 200000);
+    std::vector<Sample> corpus = makeCorpus();
+
+    bench::printHeader("request", "response", "request");
+
+    for(size_t i = 0; i < corpus.size(); ++i)
+    {
+        const Sample &sample = corpus[i];
+        size_t bytes = sample.request.size() + sample.responseSize;
+        size_t count = std::max<size_t>(1000, iterations * 256 / bytes);
+
+        count = std::min(count, iterations);
+
+        FastCgiLoop loop(sample);
+        bench::Result result = bench::measure(loop, count);
+
+        if( loop.requests == 0 )
+        {
+            std::cerr << "no requests handled for " << sample.name << std::endl;
+            return 1;
+        }
+
+        bench::printRow(sample.name, sample.variant, result,
+                        sample.request.size() + loop.written / loop.requests);
+    }
+
+    return 0;
+}
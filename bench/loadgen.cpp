@@ -0,0 +1,688 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+// HTTP load generator. Keep-alive connections send GET requests, up to
+// the pipelining depth at once, and the latency of every response is
+// recorded to a histogram:
+//
+//  - closed loop (default): the next request is sent when a response
+//    arrives. A stalled server also stalls the client, so the raw
+//    latencies miss the requests which would have been sent meanwhile;
+//    the corrected percentiles add them back (coordinated omission).
+//  - open loop (-r rate): the requests are scheduled at the fixed rate and
+//    the latency is counted from the scheduled time, even if the request
+//    is sent later because the connection is busy.
+//
+// With -s the program serves "Hello world" itself on the port of the URL,
+// so it is a self-contained end-to-end benchmark.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+#include <hserv/httpserver.h>
+#include <hserv/metrics.h>
+
+using namespace hserv;
+
+typedef boost::asio::steady_timer::clock_type Clock;
+
+struct Options
+{
+    Options()
+        : connections(16), threads(1), seconds(10), warmup(1), depth(1), rate(0),
+          keepAlive(true), serve(false), port(80), path("/")
+    {
+    }
+
+    size_t connections;
+    size_t threads;
+    unsigned int seconds;
+    unsigned int warmup;
+    size_t depth;
+    // Requests per second of all connections, zero is the closed loop.
+    double rate;
+    bool keepAlive;
+    bool serve;
+
+    std::string host;
+    int port;
+    std::string path;
+};
+
+struct Stats
+{
+    Stats() : responses(0), errors(0), non2xx(0) {}
+
+    void add(const Stats &other)
+    {
+        latency.add(other.latency);
+        responses += other.responses;
+        errors += other.errors;
+        non2xx += other.non2xx;
+    }
+
+    LatencyHistogram latency;
+    size_t responses;
+    size_t errors;
+    size_t non2xx;
+};
+
+static boost::uint64_t nanoseconds(Clock::duration duration)
+{
+    return boost::asio::chrono::duration_cast<boost::asio::chrono::nanoseconds>(duration).count();
+}
+
+static bool startsWithIgnoreCase(const char *begin, const char *end, const char *prefix)
+{
+    for(; *prefix != '\0'; ++begin, ++prefix)
+    {
+        if( begin == end || tolower(static_cast<unsigned char>(*begin)) != *prefix )
+            return false;
+    }
+
+    return true;
+}
+
+// The size of the response at the beginning of the buffer, zero if it is
+// not complete. Only responses with Content-Length are supported.
+static size_t parseResponse(const char *data, size_t size, int &status, bool &close, bool &error)
+{
+    static const char separator[] = "\r\n\r\n";
+    const char *end = data + size;
+    const char *headersEnd = std::search(data, end, separator, separator + 4);
+
+    error = false;
+
+    if( headersEnd == end )
+        return 0;
+
+    if( size < 12 || std::memcmp(data, "HTTP/1.", 7) != 0 )
+    {
+        error = true;
+        return 0;
+    }
+
+    status = atoi(data + 9);
+    close = data[7] == '0';
+
+    size_t contentLength = 0;
+    bool hasLength = false;
+
+    for(const char *line = std::find(data, headersEnd, '\n') + 1; line < headersEnd; )
+    {
+        const char *lineEnd = std::find(line, headersEnd, '\r');
+
+        if( startsWithIgnoreCase(line, lineEnd, "content-length:") )
+        {
+            contentLength = strtoul(line + 15, NULL, 10);
+            hasLength = true;
+        }
+        else if( startsWithIgnoreCase(line, lineEnd, "connection:") )
+        {
+            std::string value(line + 11, lineEnd);
+
+            close = value.find("close") != std::string::npos ||
+                    (close && value.find("eep-") == std::string::npos);
+        }
+
+        line = lineEnd + 2;
+    }
+
+    if( hasLength == false )
+    {
+        error = true;
+        return 0;
+    }
+
+    size_t total = headersEnd + 4 - data + contentLength;
+
+    return total <= size ? total : 0;
+}
+
+class Client : private boost::noncopyable
+{
+public:
+    Client(boost::asio::io_service &ioService, const Options &options,
+           const boost::asio::ip::tcp::endpoint &endpoint, const std::string &request,
+           Clock::time_point recordFrom, Stats &stats)
+        : options(options), endpoint(endpoint), socket(ioService), timer(ioService),
+          sendTimes(options.depth), buffer(65536), bufferSize(0), head(0), outstanding(0),
+          writing(false), connected(false), timerArmed(false), recordFrom(recordFrom), stats(stats)
+    {
+        for(size_t i = 0; i < options.depth; ++i)
+            requests += request;
+
+        requestSize = request.size();
+
+        if( options.rate > 0 )
+            interval = boost::asio::chrono::nanoseconds(
+                        static_cast<boost::int64_t>(1e9 * options.connections / options.rate));
+    }
+
+    // The first request is scheduled at the start time, the connections of
+    // the open loop start at different offsets.
+    void start(Clock::time_point startTime)
+    {
+        nextSend = startTime;
+        connect();
+    }
+
+private:
+    void connect()
+    {
+        boost::system::error_code ignored_ec;
+
+        // the pending operations are aborted
+        socket.close(ignored_ec);
+        connected = false;
+        bufferSize = 0;
+        head = 0;
+        outstanding = 0;
+        socket.async_connect(endpoint, boost::bind(&Client::handleConnect, this,
+                                                   boost::asio::placeholders::error));
+    }
+
+    void handleConnect(const boost::system::error_code &ec)
+    {
+        if( ec )
+        {
+            ++stats.errors;
+            timer.expires_after(boost::asio::chrono::milliseconds(10));
+            timer.async_wait(boost::bind(&Client::handleReconnect, this,
+                                         boost::asio::placeholders::error));
+            return;
+        }
+
+        boost::system::error_code ignored_ec;
+        socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored_ec);
+        connected = true;
+
+        read();
+        send();
+    }
+
+    void handleReconnect(const boost::system::error_code &ec)
+    {
+        if( !ec )
+            connect();
+    }
+
+    // Send the requests which are due, as many as the pipelining allows.
+    void send()
+    {
+        if( writing || connected == false )
+            return;
+
+        Clock::time_point now = Clock::now();
+        size_t count = 0;
+
+        while( outstanding + count < options.depth )
+        {
+            if( options.rate > 0 )
+            {
+                if( nextSend > now )
+                {
+                    if( timerArmed == false )
+                    {
+                        timerArmed = true;
+                        timer.expires_at(nextSend);
+                        timer.async_wait(boost::bind(&Client::handleTimer, this,
+                                                     boost::asio::placeholders::error));
+                    }
+
+                    break;
+                }
+
+                // the latency counts from the scheduled time
+                sendTimes[(head + outstanding + count) % options.depth] = nextSend;
+                nextSend += interval;
+            }
+            else
+            {
+                sendTimes[(head + outstanding + count) % options.depth] = now;
+            }
+
+            ++count;
+        }
+
+        if( count == 0 )
+            return;
+
+        outstanding += count;
+        writing = true;
+        boost::asio::async_write(socket,
+                                 boost::asio::buffer(requests.data(), count * requestSize),
+                                 boost::bind(&Client::handleWrite, this,
+                                             boost::asio::placeholders::error));
+    }
+
+    void handleTimer(const boost::system::error_code &ec)
+    {
+        timerArmed = false;
+
+        if( !ec )
+            send();
+    }
+
+    void handleWrite(const boost::system::error_code &ec)
+    {
+        writing = false;
+
+        if( ec == boost::asio::error::operation_aborted )
+            return;
+        else if( ec )
+            failed();
+        else
+            send();
+    }
+
+    void read()
+    {
+        if( bufferSize == buffer.size() )
+            buffer.resize(buffer.size() * 2);
+
+        socket.async_read_some(boost::asio::buffer(&buffer[bufferSize], buffer.size() - bufferSize),
+                               boost::bind(&Client::handleRead, this,
+                                           boost::asio::placeholders::error,
+                                           boost::asio::placeholders::bytes_transferred));
+    }
+
+    void handleRead(const boost::system::error_code &ec, size_t bytes)
+    {
+        if( ec == boost::asio::error::operation_aborted )
+            return;
+
+        if( ec )
+        {
+            failed();
+            return;
+        }
+
+        bufferSize += bytes;
+
+        Clock::time_point now = Clock::now();
+        size_t offset = 0;
+        bool close = false;
+
+        while( outstanding > 0 && close == false )
+        {
+            int status = 0;
+            bool error = false;
+            size_t size = parseResponse(&buffer[offset], bufferSize - offset, status, close, error);
+
+            if( error )
+            {
+                std::cerr << "unsupported response" << std::endl;
+                failed();
+                return;
+            }
+
+            if( size == 0 )
+                break;
+
+            if( now >= recordFrom )
+            {
+                stats.latency.counts[LatencyHistogram::bucketIndex(
+                            nanoseconds(now - sendTimes[head]))]++;
+                stats.latency.count++;
+                ++stats.responses;
+
+                if( status < 200 || status > 299 )
+                    ++stats.non2xx;
+            }
+
+            head = (head + 1) % options.depth;
+            --outstanding;
+            offset += size;
+        }
+
+        std::copy(buffer.begin() + offset, buffer.begin() + bufferSize, buffer.begin());
+        bufferSize -= offset;
+
+        if( close || options.keepAlive == false )
+        {
+            // the pipelined requests are lost
+            stats.errors += outstanding;
+            connect();
+            return;
+        }
+
+        read();
+        send();
+    }
+
+    void failed()
+    {
+        ++stats.errors;
+        connect();
+    }
+
+    const Options &options;
+    boost::asio::ip::tcp::endpoint endpoint;
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::steady_timer timer;
+
+    // `depth` copies of the request
+    std::string requests;
+    size_t requestSize;
+
+    // The send times of the outstanding requests, a ring.
+    std::vector<Clock::time_point> sendTimes;
+    std::vector<char> buffer;
+    size_t bufferSize;
+    size_t head;
+    size_t outstanding;
+    bool writing;
+    bool connected;
+
+    // Open loop
+    Clock::duration interval;
+    Clock::time_point nextSend;
+    bool timerArmed;
+
+    // The end of the warm-up
+    Clock::time_point recordFrom;
+    Stats &stats;
+};
+
+class Worker : private boost::noncopyable
+{
+public:
+    Worker(const Options &options, const boost::asio::ip::tcp::endpoint &endpoint,
+           const std::string &request, size_t connections, size_t firstIndex,
+           Clock::time_point start)
+        : options(options), stopTimer(ioService)
+    {
+        Clock::time_point recordFrom = start + boost::asio::chrono::seconds(options.warmup);
+
+        for(size_t i = 0; i < connections; ++i)
+        {
+            clients.push_back(boost::shared_ptr<Client>(
+                                  new Client(ioService, options, endpoint, request,
+                                             recordFrom, stats)));
+
+            // spread the schedules of the open loop over the interval
+            Clock::duration offset(0);
+
+            if( options.rate > 0 )
+                offset = boost::asio::chrono::nanoseconds(
+                            static_cast<boost::int64_t>(1e9 * (firstIndex + i) / options.rate));
+
+            clients.back()->start(start + offset);
+        }
+
+        stopTimer.expires_at(recordFrom + boost::asio::chrono::seconds(options.seconds));
+        stopTimer.async_wait(boost::bind(&boost::asio::io_service::stop, &ioService));
+    }
+
+    void run()
+    {
+        ioService.run();
+    }
+
+    Stats stats;
+
+private:
+    const Options &options;
+    boost::asio::io_service ioService;
+    boost::asio::steady_timer stopTimer;
+    std::vector< boost::shared_ptr<Client> > clients;
+};
+
+// HdrHistogram's correction: a response slower than the interval of the
+// requests stalled the requests which were due meanwhile, they are added
+// with the latencies they would have had.
+static LatencyHistogram correctCoordinatedOmission(const LatencyHistogram &raw,
+                                                   boost::uint64_t interval)
+{
+    LatencyHistogram corrected = raw;
+
+    if( interval == 0 )
+        return corrected;
+
+    for(size_t i = 0; i < raw.counts.size(); ++i)
+    {
+        if( raw.counts[i] == 0 )
+            continue;
+
+        boost::uint64_t value = LatencyHistogram::bucketUpperBound(i);
+
+        for(boost::uint64_t missed = value > interval ? value - interval : 0;
+            missed >= interval; missed -= interval)
+        {
+            corrected.counts[LatencyHistogram::bucketIndex(missed)] += raw.counts[i];
+            corrected.count += raw.counts[i];
+        }
+    }
+
+    return corrected;
+}
+
+static void printLatency(const char *name, const LatencyHistogram &histogram)
+{
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+    printf("  %-10s", name);
+
+    for(size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); ++i)
+        printf("%12.1f", histogram.percentile(fractions[i]) / 1000.0);
+
+    printf("\n");
+}
+
+static void helloWorld(const boost::shared_ptr<Context> &context)
+{
+    static const char content[] = "Hello world!\n";
+
+    context->response().setStatus(Response::Ok);
+    context->response().addHeader("Content-Type", "text/plain");
+    context->response().setContent(content, sizeof(content) - 1);
+    context->asyncDone();
+}
+
+static bool parseUrl(const std::string &url, Options &options)
+{
+    static const std::string scheme = "http://";
+
+    if( url.compare(0, scheme.size(), scheme) != 0 )
+        return false;
+
+    std::string rest = url.substr(scheme.size());
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+
+    options.path = slash == std::string::npos ? "/" : rest.substr(slash);
+
+    size_t colon = authority.rfind(':');
+
+    if( colon != std::string::npos )
+    {
+        options.host = authority.substr(0, colon);
+        options.port = atoi(authority.c_str() + colon + 1);
+    }
+    else
+    {
+        options.host = authority;
+    }
+
+    return options.host.empty() == false && options.port > 0;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: loadgen [options] http://host:port/path\n"
+                 "  -c N    connections (16)\n"
+                 "  -t N    threads (1)\n"
+                 "  -d N    duration in seconds (10)\n"
+                 "  -w N    warm-up in seconds, not recorded (1)\n"
+                 "  -p N    pipelined requests per connection (1)\n"
+                 "  -r N    open loop at N requests per second of all connections\n"
+                 "  -k 0|1  keep-alive (1), without it every request has its connection\n"
+                 "  -s      serve the URL by this program (hello world)\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-'; ++i)
+    {
+        char option = argv[i][1];
+
+        if( option == 's' )
+        {
+            options.serve = true;
+            continue;
+        }
+
+        if( i + 1 >= argc )
+        {
+            usage();
+            return 1;
+        }
+
+        const char *value = argv[++i];
+
+        switch( option )
+        {
+        case 'c': options.connections = std::max(1, atoi(value)); break;
+        case 't': options.threads = std::max(1, atoi(value)); break;
+        case 'd': options.seconds = std::max(1, atoi(value)); break;
+        case 'w': options.warmup = std::max(0, atoi(value)); break;
+        case 'p': options.depth = std::max(1, atoi(value)); break;
+        case 'r': options.rate = atof(value); break;
+        case 'k': options.keepAlive = atoi(value) != 0; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if( i + 1 != argc || parseUrl(argv[i], options) == false )
+    {
+        usage();
+        return 1;
+    }
+
+    if( options.keepAlive == false )
+        options.depth = 1;
+
+    options.threads = std::min(options.threads, options.connections);
+
+    try
+    {
+        boost::scoped_ptr<HttpServer> server;
+        boost::scoped_ptr<boost::thread> serverThread;
+
+        if( options.serve )
+        {
+            server.reset(new HttpServer(options.threads, options.host, options.port, helloWorld));
+            serverThread.reset(new boost::thread(boost::bind(&HttpServer::run, server.get())));
+
+            // wait for the listening socket
+            boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+        }
+
+        boost::asio::io_service ioService;
+        boost::asio::ip::tcp::resolver resolver(ioService);
+        boost::asio::ip::tcp::resolver::query query(options.host, std::string());
+        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+
+        endpoint.port(options.port);
+
+        std::string request = "GET " + options.path + " HTTP/1.1\r\n"
+                              "Host: " + options.host + "\r\n" +
+                              (options.keepAlive ? "" : "Connection: close\r\n") +
+                              "\r\n";
+
+        printf("%u s test of %s, %u s warm-up\n"
+               "  %u threads, %u connections, %u pipelined, %s, %s\n",
+               options.seconds, argv[i], options.warmup,
+               static_cast<unsigned>(options.threads),
+               static_cast<unsigned>(options.connections),
+               static_cast<unsigned>(options.depth),
+               options.keepAlive ? "keep-alive" : "connection per request",
+               options.rate > 0 ? "open loop" : "closed loop");
+
+        Clock::time_point start = Clock::now();
+        std::vector< boost::shared_ptr<Worker> > workers;
+        boost::thread_group threads;
+        size_t first = 0;
+
+        for(size_t t = 0; t < options.threads; ++t)
+        {
+            size_t count = options.connections / options.threads +
+                    (t < options.connections % options.threads ? 1 : 0);
+
+            workers.push_back(boost::shared_ptr<Worker>(
+                                  new Worker(options, endpoint, request, count, first, start)));
+            first += count;
+        }
+
+        for(size_t t = 0; t < workers.size(); ++t)
+            threads.create_thread(boost::bind(&Worker::run, workers[t].get()));
+
+        threads.join_all();
+
+        if( server )
+        {
+            server->stop();
+            serverThread->join();
+        }
+
+        Stats total;
+
+        for(size_t t = 0; t < workers.size(); ++t)
+            total.add(workers[t]->stats);
+
+        printf("\n  %lu responses, %.1f requests/s, %lu errors, %lu non-2xx\n\n",
+               static_cast<unsigned long>(total.responses),
+               static_cast<double>(total.responses) / options.seconds,
+               static_cast<unsigned long>(total.errors),
+               static_cast<unsigned long>(total.non2xx));
+
+        printf("  %-10s%12s%12s%12s%12s%12s   (us)\n", "latency", "p50", "p90", "p99", "p99.9", "max");
+
+        if( options.rate > 0 )
+        {
+            printLatency("scheduled", total.latency);
+        }
+        else
+        {
+            // The interval a connection would send requests at without stalls.
+            boost::uint64_t interval = total.responses ?
+                        static_cast<boost::uint64_t>(1e9 * options.seconds *
+                                                     options.connections * options.depth /
+                                                     total.responses) : 0;
+
+            printLatency("raw", total.latency);
+            printLatency("corrected", correctCoordinatedOmission(total.latency, interval));
+        }
+    }
+    catch(std::exception &e)
+    {
+        std::cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
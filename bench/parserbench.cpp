@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <hserv/impl/requestparser.h>
+#include <hserv/request.h>
+
+#include "benchmark.h"
+
+using namespace hserv;
+
+struct Sample {
+    const char *name;
+    std::string data;
+    // The request arrives in reads of this size, zero means at once.
+    size_t readSize;
+};
+
+static std::vector<Sample> makeCorpus()
+{
+    std::vector<Sample> corpus;
+
+    Sample tiny = { "tiny GET",
+                    "GET / HTTP/1.1\r\n"
+                    "Host: localhost\r\n"
+                    "\r\n", 0 };
+    corpus.push_back(tiny);
+
+    // 15 headers
+    Sample browser = { "browser GET",
+                       "GET /wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg HTTP/1.1\r\n"
+                       "Host: www.kittyhell.com\r\n"
+                       "User-Agent: Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10.6; ja-JP-mac; rv:1.9.2.3) "
+                       "Gecko/20100401 Firefox/3.6.3 Pathtraq/0.9\r\n"
+                       "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                       "Accept-Language: ja,en-us;q=0.7,en;q=0.3\r\n"
+                       "Accept-Encoding: gzip,deflate\r\n"
+                       "Accept-Charset: Shift_JIS,utf-8;q=0.7,*;q=0.7\r\n"
+                       "Keep-Alive: 115\r\n"
+                       "Connection: keep-alive\r\n"
+                       "Referer: http://www.kittyhell.com/2010/03/hello-kitty-darth-vader/\r\n"
+                       "Cache-Control: max-age=0\r\n"
+                       "If-Modified-Since: Sat, 17 Oct 2015 00:29:57 GMT\r\n"
+                       "If-None-Match: \"4d2a-5f7c1e3b\"\r\n"
+                       "DNT: 1\r\n"
+                       "Upgrade-Insecure-Requests: 1\r\n"
+                       "Cookie: wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; "
+                       "__utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; "
+                       "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|"
+                       "utmcct=/reader/|utmcmd=referral\r\n"
+                       "\r\n", 0 };
+    corpus.push_back(browser);
+
+    Sample longUri = { "long URI",
+                       "GET /search?q=" + std::string(2000, 'x') + " HTTP/1.1\r\n"
+                       "Host: localhost\r\n"
+                       "\r\n", 0 };
+    corpus.push_back(longUri);
+
+    Sample post = { "large POST",
+                    "POST /upload HTTP/1.1\r\n"
+                    "Host: localhost\r\n"
+                    "Content-Type: application/octet-stream\r\n"
+                    "Content-Length: 65536\r\n"
+                    "\r\n" + std::string(65536, 'x'), 0 };
+    corpus.push_back(post);
+
+    // The connection parses the buffer again after every read.
+    Sample split = browser;
+    split.name = "split GET";
+    split.readSize = 64;
+    corpus.push_back(split);
+
+    return corpus;
+}
+
+// Parse the sample the way HttpConnection does.
+struct ParseLoop
+{
+    ParseLoop(const Sample &sample)
+        : sample(sample), buffer(sample.data.begin(), sample.data.end()), headers(0)
+    {
+    }
+
+    void operator()(size_t iterations)
+    {
+        size_t readSize = sample.readSize ? sample.readSize : buffer.size();
+
+        for(size_t i = 0; i < iterations; ++i)
+        {
+            RequestParser::ParseState state = RequestParser::IncompletedState;
+
+            parser.reset();
+            request.reset();
+
+            for(size_t size = 0; size < buffer.size() && state == RequestParser::IncompletedState; )
+            {
+                size = std::min(size + readSize, buffer.size());
+                state = parser.parse(request, &buffer[0], size);
+            }
+
+            if( state != RequestParser::CompletedState )
+            {
+                std::cerr << "failed to parse " << sample.name << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        headers = request.headers.size();
+    }
+
+    const Sample &sample;
+    std::vector<char> buffer;
+    RequestParser parser;
+    RequestImpl request;
+    size_t headers;
+};
+
+// Nanoseconds per lookup of the headers a handler typically asks for.
+static void runLookups(const Sample &sample, size_t iterations)
+{
+    static const KnownHeaders::Id ids[] = {
+        KnownHeaders::Host, KnownHeaders::AcceptEncoding,
+        KnownHeaders::Cookie, KnownHeaders::IfNoneMatch
+    };
+    static const size_t count = sizeof(ids) / sizeof(ids[0]);
+
+    std::vector<char> buffer(sample.data.begin(), sample.data.end());
+    RequestParser parser;
+    RequestImpl impl;
+
+    parser.parse(impl, &buffer[0], buffer.size());
+
+    Request request(impl);
+    size_t found = 0;
+
+    for(int byName = 1; byName >= 0; --byName)
+    {
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+        for(size_t i = 0; i < iterations; ++i)
+        {
+            for(size_t j = 0; j < count; ++j)
+            {
+                boost::string_ref value = byName ?
+                        request.headerValue(KnownHeaders::name(ids[j])) :
+                        request.headerValue(ids[j]);
+                found += value.size();
+            }
+        }
+
+        boost::posix_time::time_duration elapsed =
+                boost::posix_time::microsec_clock::universal_time() - start;
+
+        std::cout << std::setw(16) << (byName ? "by name" : "by id")
+                  << std::setw(16) << std::fixed << std::setprecision(1)
+                  << elapsed.total_microseconds() * 1000.0 / (iterations * count)
+                  << "   (ns/lookup)" << std::endl;
+    }
+
+    if( found == 0 )
+        std::cerr << "headers not found" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = bench::iterationsArgument(argc, argv, 1000000);
+    std::vector<Sample> corpus = makeCorpus();
+
+    static const char *isaNames[] = { "state machine", "scalar", "sse4.2", "avx2" };
+
+    bench::printHeader("request", "scanner", "request");
+
+    for(size_t i = 0; i < corpus.size(); ++i)
+    {
+        size_t expectedHeaders = 0;
+        // about the same amount of bytes for every sample
+        size_t count = std::max<size_t>(1000, iterations * 256 / corpus[i].data.size());
+
+        count = std::min(count, iterations);
+
+        for(int isa = CharScanner::IsaNone; isa <= CharScanner::IsaAvx2; ++isa)
+        {
+            CharScanner::setIsa(static_cast<CharScanner::Isa>(isa));
+
+            if( CharScanner::isa() != isa )
+                continue;
+
+            ParseLoop loop(corpus[i]);
+            bench::Result result = bench::measure(loop, count);
+
+            if( isa == CharScanner::IsaNone )
+                expectedHeaders = loop.headers;
+            else if( loop.headers != expectedHeaders )
+                std::cerr << "result mismatch for " << isaNames[isa] << std::endl;
+
+            bench::printRow(corpus[i].name, isaNames[isa], result, corpus[i].data.size());
+        }
+    }
+
+    std::cout << std::endl;
+    runLookups(corpus[1], iterations);
+
+    return 0;
+}
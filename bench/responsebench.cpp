@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#include <string>
+#include <vector>
+
+#include <hserv/response.h>
+
+#include "benchmark.h"
+
+using namespace hserv;
+
+struct Header {
+    const char *name;
+    const char *value;
+};
+
+struct Sample {
+    const char *name;
+    std::vector<Header> headers;
+};
+
+static std::vector<Sample> makeCorpus()
+{
+    std::vector<Sample> corpus;
+
+    Header hello[] = {
+        { "Content-type", "text/html" },
+        { "Content-Length", "13" }
+    };
+    Sample s1 = { "hello world", std::vector<Header>(hello, hello + 2) };
+    corpus.push_back(s1);
+
+    Header file[] = {
+        { "Content-Type", "image/png" },
+        { "Last-Modified", "Sat, 17 Oct 2015 00:29:57 GMT" },
+        { "Content-Length", "144217" }
+    };
+    Sample s2 = { "static file", std::vector<Header>(file, file + 3) };
+    corpus.push_back(s2);
+
+    Header api[] = {
+        { "Content-Type", "application/json; charset=utf-8" },
+        { "Cache-Control", "no-cache, no-store, must-revalidate" },
+        { "X-Request-Id", "f3b2a4c1-6d5e-4f70-8a9b-0c1d2e3f4a5b" },
+        { "Set-Cookie", "session=38afes7a8; HttpOnly; Path=/" },
+        { "Vary", "Accept-Encoding" },
+        { "Access-Control-Allow-Origin", "*" },
+        { "Content-Length", "1534" }
+    };
+    Sample s3 = { "api", std::vector<Header>(api, api + 7) };
+    corpus.push_back(s3);
+
+    return corpus;
+}
+
+// Build and serialize the response the way a handler and HttpConnection do.
+static void buildResponse(const Sample &sample, std::vector<char> &out)
+{
+    Response response;
+
+    response.setStatus(Response::Ok);
+
+    for(size_t i = 0; i < sample.headers.size(); ++i)
+        response.addHeader(sample.headers[i].name, sample.headers[i].value);
+
+    if( response.hasHeader("Content-Length") && response.header("Connection").empty() &&
+            response.hasHeader("Date") == false && response.hasHeader("Server") == false )
+    {
+        response.serializeStatus(1, 1, out);
+        response.serializeHeaders(out);
+    }
+}
+
+struct ResponseLoop
+{
+    ResponseLoop(const Sample &sample)
+        : sample(sample)
+    {
+        out.reserve(4096);
+    }
+
+    void operator()(size_t iterations)
+    {
+        for(size_t i = 0; i < iterations; ++i)
+        {
+            out.clear();
+            buildResponse(sample, out);
+        }
+    }
+
+    const Sample &sample;
+    std::vector<char> out;
+};
+
+int main(int argc, char **argv)
+{
+    size_t iterations = bench::iterationsArgument(argc, argv, 1000000);
+    std::vector<Sample> corpus = makeCorpus();
+
+    bench::printHeader("response", "", "response");
+
+    for(size_t i = 0; i < corpus.size(); ++i)
+    {
+        ResponseLoop loop(corpus[i]);
+        bench::Result result = bench::measure(loop, iterations);
+
+        bench::printRow(corpus[i].name, "", result, loop.out.size());
+    }
+
+    return 0;
+}
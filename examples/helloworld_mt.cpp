@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <hserv/httpserver.h>
+#include <hserv/metrics.h>
+
+using namespace hserv;
+
+void handler(const ServerMetrics &metrics, const boost::shared_ptr<Context> &context);
+
+int main(int argc, char** argv)
+{
+    int port = 3000;
+    std::string address = "0.0.0.0";
+    size_t threads = argc > 1 ? atoi(argv[1]) : 0;
+
+    std::cout << "--> Test HTTP Server started on "
+              << "http://" << address << ":" << port
+              << std::endl;
+
+    boost::shared_ptr<ServerMetrics> metrics(new ServerMetrics);
+    HttpServer server(threads, address, port,
+                      boost::bind(handler, boost::cref(*metrics), _1));
+
+    // Prometheus scrapes http://address:port/metrics
+    server.settings().metrics = metrics;
+
+    server.run();
+
+    return 0;
+}
+
+void handler(const ServerMetrics &metrics, const boost::shared_ptr<Context> &context)
+{
+    static const std::string response = "<h1>Hello world!</h1>";
+
+    if( context->request().uri() == "/metrics" )
+    {
+        metrics.serve(context->response());
+        context->asyncDone();
+        return;
+    }
+
+    context->response().setStatus( Response::Ok );
+    context->response().addHeader("Content-type", "text/html" );
+    context->response().setContent(response);
+    context->asyncDone();
+}
@@ -120,10 +120,7 @@ void ProxyPass::handleConnect(const boost::system::error_code &ec)
         if( verbose )
             std::cerr << std::endl;
 
-        const std::vector<char> &postData = context->request().postData();
-        std::copy(postData.begin(),
-                  postData.end(),
-                  std::ostream_iterator<unsigned char>(stream));
+        stream << context->request().postData();
 
         if( context->request().versionMajor() == 1 )
         {
@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_ACCESSLOG_H
+#define HSERV_ACCESSLOG_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <hserv/requestlog.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace hserv {
+
+// Access log of the servers, set it to ServerSettings::accessLog. A line per
+// response:
+//
+//   [Sun, 06 Nov 1994 08:49:37 GMT] "GET /index.html HTTP/1.1" 200 1234 0.000512
+//
+// with the size of the response body and the time since the first byte of
+// the request in seconds. The quotes, the backslashes and the control and
+// non-ASCII bytes of the request line are escaped as \xHH.
+//
+// The io threads format the line right into a slot of a bounded lock-free
+// ring, the slots are written to the file in batches by a background thread.
+// The idle writer sleeps until a line is logged.
+// When the ring is full the line is dropped and counted, or with dropWhenFull
+// set to false the io thread waits for the writer.
+//
+// The object is thread safe and may be shared by the servers. POSIX only.
+class AccessLog : public RequestLog, private boost::noncopyable
+{
+public:
+    enum {
+        // A longer uri is truncated.
+        lineSize = 512,
+        defaultCapacity = 8192
+    };
+
+    // Append to the file, it is created if it does not exist.
+    explicit AccessLog(const std::string &path, size_t capacity = defaultCapacity,
+                       bool dropWhenFull = true)
+        : fd(-1), ownFd(true), dropWhenFull(dropWhenFull), mask(0),
+          enqueuePos(0), dequeuePos(0), droppedLines(0), writerSleeping(false), stopping(false)
+    {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if( fd < 0 )
+            throw boost::system::system_error(errno, boost::system::system_category(), path);
+
+        init(capacity);
+    }
+
+    // Write to an open descriptor, for example STDOUT_FILENO. It is not closed.
+    explicit AccessLog(int fd, size_t capacity = defaultCapacity, bool dropWhenFull = true)
+        : fd(fd), ownFd(false), dropWhenFull(dropWhenFull), mask(0),
+          enqueuePos(0), dequeuePos(0), droppedLines(0), writerSleeping(false), stopping(false)
+    {
+        init(capacity);
+    }
+
+    // The lines in the ring are written before return.
+    ~AccessLog()
+    {
+        stopping.store(true, boost::memory_order_release);
+        wakeWriter();
+        writer->join();
+
+        ::close(wakeupPipe[0]);
+        ::close(wakeupPipe[1]);
+
+        if( ownFd )
+            ::close(fd);
+    }
+
+    // The strings of the entry are copied.
+    virtual void log(const Entry &entry)
+    {
+        Slot *slot = reserve();
+
+        if( slot == NULL )
+        {
+            droppedLines.fetch_add(1, boost::memory_order_relaxed);
+            return;
+        }
+
+        slot->size = format(entry, slot->data);
+        slot->sequence.store(slot->position + 1, boost::memory_order_release);
+
+        // Either the writer going to sleep sees the line or we see it sleeping,
+        // see run().
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+
+        if( writerSleeping.load(boost::memory_order_relaxed) &&
+                writerSleeping.exchange(false, boost::memory_order_relaxed) )
+            wakeWriter();
+    }
+
+    // Lines lost because the ring was full or the file could not be written.
+    boost::uint64_t dropped() const
+    {
+        return droppedLines.load(boost::memory_order_relaxed);
+    }
+
+private:
+    // The slot of position p is free for the producers when its sequence is p,
+    // it is filled when the sequence is p + 1.
+    struct Slot
+    {
+        boost::atomic<size_t> sequence;
+        size_t position;
+        size_t size;
+        char data[lineSize];
+    };
+
+    enum {
+        cacheLineSize = 64,
+        batchSize = 65536
+    };
+
+    void init(size_t capacity)
+    {
+        size_t size = 2;
+
+        while( size < capacity )
+            size *= 2;
+
+        mask = size - 1;
+        slots.reset(new Slot[size]);
+
+        for(size_t i = 0; i < size; ++i)
+            slots[i].sequence.store(i, boost::memory_order_relaxed);
+
+        if( ::pipe(wakeupPipe) != 0 )
+        {
+            int error = errno;
+
+            if( ownFd )
+                ::close(fd);
+
+            throw boost::system::system_error(error, boost::system::system_category(), "pipe");
+        }
+
+        writer.reset(new boost::thread(boost::bind(&AccessLog::run, this)));
+    }
+
+    // A free slot for the calling thread, NULL if the line must be dropped.
+    Slot *reserve()
+    {
+        size_t position = enqueuePos.load(boost::memory_order_relaxed);
+
+        for(;;)
+        {
+            Slot *slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(boost::memory_order_acquire);
+            ptrdiff_t diff = static_cast<ptrdiff_t>(sequence - position);
+
+            if( diff == 0 )
+            {
+                if( enqueuePos.compare_exchange_weak(position, position + 1,
+                                                     boost::memory_order_relaxed) )
+                {
+                    slot->position = position;
+                    return slot;
+                }
+            }
+            else if( diff < 0 )
+            {
+                // full, the slot is not written by the writer yet
+                if( dropWhenFull )
+                    return NULL;
+
+                boost::this_thread::yield();
+                position = enqueuePos.load(boost::memory_order_relaxed);
+            }
+            else
+            {
+                position = enqueuePos.load(boost::memory_order_relaxed);
+            }
+        }
+    }
+
+    static char *append(char *out, char *end, const char *data, size_t size)
+    {
+        size = std::min(size, static_cast<size_t>(end - out));
+        std::memcpy(out, data, size);
+        return out + size;
+    }
+
+    static char *append(char *out, char *end, const boost::string_ref &str)
+    {
+        return append(out, end, str.data(), str.size());
+    }
+
+    // Like nginx: '"', '\', the control and non-ASCII bytes are written as \xHH,
+    // so a request can not forge a field or a line of the log.
+    static char *appendEscaped(char *out, char *end, const boost::string_ref &str)
+    {
+        static const char hex[] = "0123456789ABCDEF";
+
+        for(size_t i = 0; i < str.size() && out != end; ++i)
+        {
+            unsigned char c = static_cast<unsigned char>(str[i]);
+
+            if( c >= 0x20 && c < 0x7f && c != '"' && c != '\\' )
+            {
+                *out++ = static_cast<char>(c);
+            }
+            else
+            {
+                // an escape is not split by the truncation
+                if( end - out < 4 )
+                    break;
+
+                *out++ = '\\';
+                *out++ = 'x';
+                *out++ = hex[c >> 4];
+                *out++ = hex[c & 0x0f];
+            }
+        }
+
+        return out;
+    }
+
+    // Decimal, zero-padded to the width.
+    static char *appendNumber(char *out, char *end, boost::uint64_t value, int width = 1)
+    {
+        char digits[20];
+        int count = 0;
+
+        do
+        {
+            digits[count++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+        while( value != 0 && count < static_cast<int>(sizeof(digits)) );
+
+        while( count < width && count < static_cast<int>(sizeof(digits)) )
+            digits[count++] = '0';
+
+        while( count > 0 && out != end )
+            *out++ = digits[--count];
+
+        return out;
+    }
+
+    // Render the line to the buffer of lineSize bytes, returns its size.
+    static size_t format(const Entry &entry, char *buffer)
+    {
+        // the fields after the uri always fit
+        char *out = buffer;
+        char *end = buffer + lineSize - 96;
+
+        out = append(out, end, "[", 1);
+
+        if( entry.date != NULL )
+            out = append(out, end, entry.date, dateSize);
+
+        out = append(out, end, "] \"", 3);
+        out = appendEscaped(out, out + 32, entry.method);
+        out = append(out, end, " ", 1);
+        out = appendEscaped(out, end, entry.uri);
+
+        end = buffer + lineSize;
+
+        if( entry.versionMajor != 0 )
+        {
+            out = append(out, end, " HTTP/", 6);
+            out = appendNumber(out, end, entry.versionMajor);
+            out = append(out, end, ".", 1);
+            out = appendNumber(out, end, entry.versionMinor);
+        }
+
+        out = append(out, end, "\" ", 2);
+        out = appendNumber(out, end, entry.status);
+        out = append(out, end, " ", 1);
+        out = appendNumber(out, end, entry.bytes);
+        out = append(out, end, " ", 1);
+        out = appendNumber(out, end, entry.latencyUs / 1000000);
+        out = append(out, end, ".", 1);
+        out = appendNumber(out, end, entry.latencyUs % 1000000, 6);
+        out = append(out, end, "\n", 1);
+
+        return out - buffer;
+    }
+
+    // Move the filled slots to the batch, returns the number of lines.
+    size_t collect(std::vector<char> &batch)
+    {
+        size_t count = 0;
+
+        while( batch.size() + lineSize <= batchSize )
+        {
+            Slot &slot = slots[dequeuePos & mask];
+
+            if( slot.sequence.load(boost::memory_order_acquire) != dequeuePos + 1 )
+                break;
+
+            batch.insert(batch.end(), slot.data, slot.data + slot.size);
+            slot.sequence.store(dequeuePos + mask + 1, boost::memory_order_release);
+            ++dequeuePos;
+            ++count;
+        }
+
+        return count;
+    }
+
+    // The next slot is filled.
+    bool pending() const
+    {
+        const Slot &slot = slots[dequeuePos & mask];
+
+        return slot.sequence.load(boost::memory_order_acquire) == dequeuePos + 1;
+    }
+
+    void wakeWriter()
+    {
+        char c = 0;
+
+        while( ::write(wakeupPipe[1], &c, 1) < 0 && errno == EINTR )
+            ;
+    }
+
+    void flush(const std::vector<char> &batch, size_t lines)
+    {
+        for(size_t offset = 0; offset < batch.size(); )
+        {
+            ssize_t result = ::write(fd, &batch[offset], batch.size() - offset);
+
+            if( result > 0 )
+            {
+                offset += result;
+            }
+            else if( result < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            else
+            {
+                if( droppedLines.fetch_add(lines, boost::memory_order_relaxed) == 0 )
+                    std::cerr << "AccessLog: " << std::strerror(errno) << std::endl;
+
+                return;
+            }
+        }
+    }
+
+    // The writer thread.
+    void run()
+    {
+        std::vector<char> batch;
+        pollfd wakeup;
+        char drain[64];
+
+        batch.reserve(batchSize);
+        wakeup.fd = wakeupPipe[0];
+        wakeup.events = POLLIN;
+
+        for(;;)
+        {
+            // The producers are gone when the destructor is called, the ring
+            // is emptied after that.
+            bool stop = stopping.load(boost::memory_order_acquire);
+            size_t lines = collect(batch);
+
+            if( lines > 0 )
+            {
+                flush(batch, lines);
+                batch.clear();
+                continue;
+            }
+
+            if( stop )
+                return;
+
+            writerSleeping.store(true, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+
+            if( pending() == false && stopping.load(boost::memory_order_acquire) == false )
+            {
+                while( ::poll(&wakeup, 1, -1) < 0 && errno == EINTR )
+                    ;
+
+                while( ::read(wakeupPipe[0], drain, sizeof(drain)) < 0 && errno == EINTR )
+                    ;
+            }
+
+            writerSleeping.store(false, boost::memory_order_relaxed);
+        }
+    }
+
+    int fd;
+    bool ownFd;
+    bool dropWhenFull;
+    size_t mask;
+    boost::scoped_array<Slot> slots;
+
+    // Written by the producers and by the writer, on their own cache lines.
+    char padding0[cacheLineSize];
+    boost::atomic<size_t> enqueuePos;
+    char padding1[cacheLineSize];
+    size_t dequeuePos;
+    char padding2[cacheLineSize];
+
+    boost::atomic<boost::uint64_t> droppedLines;
+    // Wakes up the sleeping writer thread.
+    boost::atomic<bool> writerSleeping;
+    boost::atomic<bool> stopping;
+    int wakeupPipe[2];
+    boost::scoped_ptr<boost::thread> writer;
+};
+
+} // namespace hserv
+
+#endif // HSERV_ACCESSLOG_H
@@ -39,7 +39,8 @@ public:
     }
 
     void asyncDone() {
-        resp.addHeader("Content-Length", boost::lexical_cast<std::string>(resp.contentSize()));
+        resp.addHeader("Content-Length",
+                       boost::lexical_cast<std::string>(resp.contentSize() + resp.fileLength()));
         conn.writeResponse();
     }
 
@@ -47,6 +48,17 @@ public:
         conn.writeResponsePartial(callback);
     }
 
+    // Read the next fragment of the request body. The fragment is valid until
+    // the next call, the end of the body is reported by an empty fragment.
+    // The body is read from the network only when it is requested, so a slow
+    // consumer slows down the client. Without ServerSettings::streamRequestBody
+    // the whole body is passed at once.
+    //
+    // A response sent before the end of the body closes the connection.
+    void asyncReadBody(const Connection::BodyHandler &handler) {
+        conn.readBody(handler);
+    }
+
 private:
     boost::asio::io_service &ioServ;
     Connection &conn;
@@ -36,6 +36,17 @@ public:
 
     }
 
+#ifndef WIN32
+    // Serve an open listening socket, TCP or Unix, the server owns it.
+    FastCgiServer(int listenFd,
+                  const boost::function<void(const boost::shared_ptr<Context> &)> &callback) {
+        if( Listeners::isUnixSocket(listenFd) )
+            pimpl.reset(new FastCgiStdioServerImpl(callback, listenFd));
+        else
+            pimpl.reset(new FastCgiNetworkServerImpl(listenFd, callback));
+    }
+#endif
+
     ~FastCgiServer() {};
 
     virtual void run() {
@@ -46,6 +57,11 @@ public:
         pimpl->stop();
     }
 
+    // Reuse of the connection objects.
+    ConnectionPoolStats connectionPoolStats() const {
+        return pimpl->connectionPoolStats();
+    }
+
 private:
     boost::scoped_ptr<FastCgiServerImpl> pimpl;
 };
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_FILEHANDLE_H
+#define HSERV_FILEHANDLE_H
+
+#include <string>
+#include <cerrno>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#include <winsock2.h>
+#include <windows.h>
+#ifdef _MSC_VER
+typedef SSIZE_T ssize_t;
+#endif
+#endif
+
+namespace hserv {
+
+// An open file to be sent as a response body. Responses share the handle,
+// the descriptor is closed with the last reference.
+class FileHandle : private boost::noncopyable
+{
+public:
+    // Takes the descriptor, closes it if `owner` is set.
+    explicit FileHandle(int fd, bool owner = true)
+        : descriptor(fd), owner(owner), fileSize(0)
+    {
+        Stat st;
+
+        if( statFile(fd, st) )
+            fileSize = static_cast<size_t>(st.st_size);
+    }
+
+    ~FileHandle()
+    {
+        if( owner )
+            closeFile(descriptor);
+    }
+
+    // Open a regular file for reading, returns an empty pointer on failure.
+    static boost::shared_ptr<FileHandle> open(const std::string &path)
+    {
+#ifndef WIN32
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#else
+        int fd = ::_open(path.c_str(), _O_RDONLY | _O_BINARY | _O_NOINHERIT);
+#endif
+
+        if( fd < 0 )
+            return boost::shared_ptr<FileHandle>();
+
+        Stat st;
+
+        if( statFile(fd, st) == false || (st.st_mode & S_IFMT) != S_IFREG )
+        {
+            closeFile(fd);
+            return boost::shared_ptr<FileHandle>();
+        }
+
+        return boost::shared_ptr<FileHandle>(new FileHandle(fd));
+    }
+
+    int fd() const
+    {
+        return descriptor;
+    }
+
+    // The size at the moment of opening.
+    size_t size() const
+    {
+        return fileSize;
+    }
+
+    // Read up to `size` bytes at `offset`, returns -1 on error and 0 at the end of the file.
+    ssize_t read(char *buffer, size_t size, off_t offset) const
+    {
+#ifndef WIN32
+        ssize_t result;
+
+        do
+        {
+            result = pread(descriptor, buffer, size, offset);
+        }
+        while( result < 0 && errno == EINTR );
+
+        return result;
+#else
+        // A positioned read, the handle may be shared by the threads.
+        HANDLE handle = reinterpret_cast<HANDLE>(::_get_osfhandle(descriptor));
+        OVERLAPPED overlapped = OVERLAPPED();
+        DWORD done = 0;
+
+        overlapped.Offset = static_cast<DWORD>(offset);
+
+        if( ::ReadFile(handle, buffer, static_cast<DWORD>(size), &done, &overlapped) == FALSE )
+            return ::GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+
+        return static_cast<ssize_t>(done);
+#endif
+    }
+
+private:
+#ifndef WIN32
+    typedef struct stat Stat;
+
+    static bool statFile(int fd, Stat &st)
+    {
+        return fstat(fd, &st) == 0;
+    }
+
+    static void closeFile(int fd)
+    {
+        ::close(fd);
+    }
+#else
+    typedef struct _stat Stat;
+
+    static bool statFile(int fd, Stat &st)
+    {
+        return ::_fstat(fd, &st) == 0;
+    }
+
+    static void closeFile(int fd)
+    {
+        ::_close(fd);
+    }
+#endif
+
+    int descriptor;
+    bool owner;
+    size_t fileSize;
+};
+
+} // namespace hserv
+
+#endif // HSERV_FILEHANDLE_H
@@ -6,16 +6,24 @@
 #ifndef HSERV_HEADER_H
 #define HSERV_HEADER_H
 
-#include <string>
+#include <strings.h>
+#include <boost/utility/string_ref.hpp>
 
 namespace hserv {
 
+// Non-owning name/value pair, points into the connection input buffer.
 struct HeaderItem
 {
-    std::string name;
-    std::string value;
+    boost::string_ref name;
+    boost::string_ref value;
 };
 
+inline bool equalsIgnoreCase(const boost::string_ref &left, const boost::string_ref &right)
+{
+    return left.size() == right.size() &&
+            strncasecmp(left.data(), right.data(), left.size()) == 0;
+}
+
 } // namespace hserv
 
 #endif // HSERV_HEADER_H
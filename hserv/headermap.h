@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_HEADERMAP_H
+#define HSERV_HEADERMAP_H
+
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <hserv/header.h>
+#include <hserv/impl/smallvector.h>
+
+namespace hserv {
+
+// Headers of a response in the order of addition, names are case insensitive.
+//
+// Up to 16 headers and 512 bytes of text are stored inline, without memory
+// allocation. Well known names are not copied, the canonical spelling is used
+// for them. Lookup compares hashes of the names first.
+class HeaderMap
+{
+public:
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    boost::string_ref name(size_t index) const
+    {
+        const Entry &e = entries[index];
+
+        if( e.known >= 0 )
+            return knownNames()[e.known];
+        else
+            return boost::string_ref(text.data() + e.nameOffset, e.nameSize);
+    }
+
+    boost::string_ref value(size_t index) const
+    {
+        const Entry &e = entries[index];
+        return boost::string_ref(text.data() + e.valueOffset, e.valueSize);
+    }
+
+    // Add the header or replace the value of the existing one.
+    void set(const boost::string_ref &name, const boost::string_ref &value)
+    {
+        boost::uint32_t h = hash(name);
+        int index = find(name, h);
+
+        if( index >= 0 )
+        {
+            Entry &e = entries[index];
+
+            // A value that fits the space of the old one is written over it,
+            // the value may refer to the text itself.
+            if( value.size() <= e.valueCapacity )
+            {
+                if( value.empty() == false )
+                    std::memmove(&text[e.valueOffset], value.data(), value.size());
+
+                e.valueSize = static_cast<boost::uint32_t>(value.size());
+                return;
+            }
+
+            // the old value is left unused until clear()
+            e.valueOffset = static_cast<boost::uint32_t>(text.size());
+            e.valueSize = static_cast<boost::uint32_t>(value.size());
+            e.valueCapacity = e.valueSize;
+            text.append(value.data(), value.size());
+            return;
+        }
+
+        Entry e;
+
+        e.hash = h;
+        e.known = findKnown(name, h);
+        e.nameOffset = static_cast<boost::uint32_t>(text.size());
+        e.nameSize = static_cast<boost::uint32_t>(name.size());
+
+        if( e.known < 0 )
+            text.append(name.data(), name.size());
+
+        e.valueOffset = static_cast<boost::uint32_t>(text.size());
+        e.valueSize = static_cast<boost::uint32_t>(value.size());
+        e.valueCapacity = e.valueSize;
+        text.append(value.data(), value.size());
+
+        entries.push_back(e);
+    }
+
+    bool contains(const boost::string_ref &name) const
+    {
+        return find(name, hash(name)) >= 0;
+    }
+
+    // The value of the header or an empty string.
+    boost::string_ref get(const boost::string_ref &name) const
+    {
+        int index = find(name, hash(name));
+
+        if( index >= 0 )
+            return value(index);
+        else
+            return boost::string_ref();
+    }
+
+    bool remove(const boost::string_ref &name)
+    {
+        int index = find(name, hash(name));
+
+        if( index < 0 )
+            return false;
+
+        entries.erase(index);
+        return true;
+    }
+
+    void clear()
+    {
+        entries.clear();
+        text.clear();
+    }
+
+    // Case insensitive FNV-1a, good enough for ASCII header names.
+    static boost::uint32_t hash(const boost::string_ref &name)
+    {
+        boost::uint32_t h = 2166136261u;
+
+        for(size_t i = 0; i < name.size(); ++i)
+        {
+            h ^= static_cast<unsigned char>(name[i]) | 0x20;
+            h *= 16777619u;
+        }
+
+        return h;
+    }
+
+private:
+    struct Entry {
+        boost::uint32_t hash;
+        // Index of the well known name or -1
+        int known;
+        boost::uint32_t nameOffset;
+        boost::uint32_t nameSize;
+        boost::uint32_t valueOffset;
+        boost::uint32_t valueSize;
+        // The space of the value in the text, a replaced value may be shorter
+        boost::uint32_t valueCapacity;
+    };
+
+    enum { knownNamesCount = 20 };
+
+    static const boost::string_ref *knownNames()
+    {
+        static const boost::string_ref names[knownNamesCount] = {
+            "Content-Length",
+            "Content-Type",
+            "Date",
+            "Server",
+            "Connection",
+            "Transfer-Encoding",
+            "Keep-Alive",
+            "Location",
+            "Cache-Control",
+            "Last-Modified",
+            "ETag",
+            "Expires",
+            "Set-Cookie",
+            "Content-Encoding",
+            "Vary",
+            "Accept-Ranges",
+            "Content-Range",
+            "Access-Control-Allow-Origin",
+            "WWW-Authenticate",
+            "Allow"
+        };
+
+        return names;
+    }
+
+    static const boost::uint32_t *knownHashes()
+    {
+        struct Hashes {
+            Hashes()
+            {
+                for(int i = 0; i < knownNamesCount; ++i)
+                    values[i] = hash(knownNames()[i]);
+            }
+
+            boost::uint32_t values[knownNamesCount];
+        };
+
+        static const Hashes hashes;
+        return hashes.values;
+    }
+
+    static int findKnown(const boost::string_ref &name, boost::uint32_t h)
+    {
+        const boost::uint32_t *hashes = knownHashes();
+
+        for(int i = 0; i < knownNamesCount; ++i)
+        {
+            if( hashes[i] == h && equalsIgnoreCase(knownNames()[i], name) )
+                return i;
+        }
+
+        return -1;
+    }
+
+    int find(const boost::string_ref &name, boost::uint32_t h) const
+    {
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            if( entries[i].hash == h && equalsIgnoreCase(this->name(i), name) )
+                return static_cast<int>(i);
+        }
+
+        return -1;
+    }
+
+    SmallVector<Entry, 16> entries;
+    SmallVector<char, 512> text;
+};
+
+} // namespace hserv
+
+#endif // HSERV_HEADERMAP_H
@@ -11,6 +11,7 @@
 
 #include <hserv/impl/httpserverimpl.h>
 #include <hserv/serverinterface.h>
+#include <hserv/serversettings.h>
 #include <hserv/context.h>
 
 namespace hserv {
@@ -22,6 +23,8 @@ class Connection;
 class HttpServer : public ServerInterface
 {
 public:
+    // The io_service must be run by one thread, the connections and their
+    // timeouts are not synchronized; use the thread pool mode for more threads.
     HttpServer(boost::asio::io_service &ioService,
                const std::string &address, int port,
                const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
@@ -29,6 +32,35 @@ public:
     {
     }
 
+#ifndef WIN32
+    // Serve an open listening socket (Listeners), the server owns it.
+    // The io_service must be run by one thread as above.
+    HttpServer(boost::asio::io_service &ioService, int listenFd,
+               const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : impl(ioService, listenFd, callback)
+    {
+    }
+#endif
+
+    // Thread pool mode: the server owns `threads` io_services (zero means one per
+    // core), each with its own acceptor, so run() blocks until stop() is called.
+    HttpServer(size_t threads,
+               const std::string &address, int port,
+               const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : impl(threads, address, port, callback)
+    {
+    }
+
+#ifndef WIN32
+    // Thread pool mode with an open listening socket, one acceptor spreads
+    // the connections over the threads.
+    HttpServer(size_t threads, int listenFd,
+               const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : impl(threads, listenFd, callback)
+    {
+    }
+#endif
+
     ~HttpServer() {
     }
 
@@ -40,6 +72,24 @@ public:
         impl.stop();
     }
 
+    // Graceful stop: no new connections, keep-alive connections are closed
+    // after their current responses. The server is stopped when no connection
+    // is left or after `timeoutSeconds` (zero means no limit), the handler is
+    // called right before that. Do not destroy the server in the handler.
+    void drain(unsigned int timeoutSeconds, const boost::function<void()> &handler) {
+        impl.drain(timeoutSeconds, handler);
+    }
+
+    // Settings of the new connections, change them before run().
+    ServerSettings &settings() {
+        return impl.serverSettings();
+    }
+
+    // Reuse of the connection objects.
+    ConnectionPoolStats connectionPoolStats() const {
+        return impl.connectionPoolStats();
+    }
+
 private:
     HttpServerImpl impl;
 };
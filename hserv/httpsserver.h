@@ -12,6 +12,7 @@
 
 #include <hserv/impl/httpsserverimpl.h>
 #include <hserv/serverinterface.h>
+#include <hserv/serversettings.h>
 #include <hserv/context.h>
 
 namespace hserv {
@@ -23,6 +24,8 @@ class Connection;
 class HttpsServer : public ServerInterface
 {
 public:
+    // The io_service must be run by one thread, the connections and their
+    // timeouts are not synchronized; use the thread pool mode for more threads.
     HttpsServer(boost::asio::io_service &ioService,
                 boost::asio::ssl::context &context,
                 const std::string &address, int port,
@@ -31,6 +34,17 @@ public:
     {
     }
 
+#ifndef WIN32
+    // Serve an open listening socket (Listeners), the server owns it.
+    // The io_service must be run by one thread as above.
+    HttpsServer(boost::asio::io_service &ioService,
+                boost::asio::ssl::context &context, int listenFd,
+                const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : impl(ioService, context, listenFd, callback)
+    {
+    }
+#endif
+
     ~HttpsServer() {
     }
 
@@ -42,6 +56,24 @@ public:
         impl.stop();
     }
 
+    // Graceful stop: no new connections, keep-alive connections are closed
+    // after their current responses. The server is stopped when no connection
+    // is left or after `timeoutSeconds` (zero means no limit), the handler is
+    // called right before that. Do not destroy the server in the handler.
+    void drain(unsigned int timeoutSeconds, const boost::function<void()> &handler) {
+        impl.drain(timeoutSeconds, handler);
+    }
+
+    // Settings of the new connections, change them before run().
+    ServerSettings &settings() {
+        return impl.serverSettings();
+    }
+
+    // Reuse of the connection objects.
+    ConnectionPoolStats connectionPoolStats() const {
+        return impl.connectionPoolStats();
+    }
+
 private:
     HttpsServerImpl impl;
 };
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_BUFFERLIST_H
+#define HSERV_BUFFERLIST_H
+
+#include <cassert>
+#include <cstddef>
+#include <boost/asio/buffer.hpp>
+
+namespace hserv {
+
+// A gather list of a fixed capacity for the write operations, it does not
+// allocate memory. Empty buffers are skipped.
+template<size_t Capacity>
+class BufferList
+{
+public:
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer *const_iterator;
+
+    BufferList()
+        : count(0)
+    {
+    }
+
+    void push_back(const boost::asio::const_buffer &buffer)
+    {
+        if( boost::asio::buffer_size(buffer) == 0 )
+            return;
+
+        assert( count < Capacity );
+        items[count++] = buffer;
+    }
+
+    const_iterator begin() const
+    {
+        return items;
+    }
+
+    const_iterator end() const
+    {
+        return items + count;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t capacity() const
+    {
+        return Capacity;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+private:
+    boost::asio::const_buffer items[Capacity];
+    size_t count;
+};
+
+} // namespace hserv
+
+#endif // HSERV_BUFFERLIST_H
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_CHARSCANNER_H
+#define HSERV_CHARSCANNER_H
+
+#include <cstddef>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HSERV_CHARSCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace hserv {
+
+// Skips runs of ordinary characters of the request line and headers, so the parser
+// state machine sees only the delimiters. The set of stop characters is given as
+// ranges of bytes (up to 8 pairs, the PCMPESTRI format). Stopping too early is
+// harmless, the state machine checks every byte it sees, so the ranges may cover
+// a few ordinary characters to fit into 8 pairs.
+//
+// The vector implementation is selected at runtime: AVX2, SSE4.2 or a lookup table.
+class CharScanner
+{
+public:
+    enum Isa {
+        IsaNone,    // do not skip anything, byte-at-a-time state machine only
+        IsaScalar,
+        IsaSse42,
+        IsaAvx2
+    };
+
+    enum CharClass {
+        // Stops on everything except token characters: method and header names.
+        TokenChars,
+        // Stops on SP and controls.
+        UriChars,
+        // Stops on controls, including CR and HT.
+        HeaderValueChars,
+        CharClassCount
+    };
+
+    // Returns a pointer to the first stop character in [begin, end) or end.
+    static const char *skip(CharClass cls, const char *begin, const char *end)
+    {
+        const Table &t = table(cls);
+
+        switch( currentIsa() )
+        {
+        case IsaNone:
+            return begin;
+#ifdef HSERV_CHARSCANNER_X86
+        case IsaAvx2:
+            begin = skipAvx2(t, begin, end);
+            break;
+        case IsaSse42:
+            begin = skipSse42(t, begin, end);
+            break;
+#endif
+        default:
+            break;
+        }
+
+        while( begin != end && t.stop[static_cast<unsigned char>(*begin)] == false )
+            ++begin;
+
+        return begin;
+    }
+
+    static Isa isa()
+    {
+        return currentIsa();
+    }
+
+    // Force the implementation, for benchmarks and tests. Setting an unsupported
+    // instruction set falls back to the best supported one.
+    static void setIsa(Isa isa)
+    {
+        Isa best = detectIsa();
+        currentIsa() = isa > best ? best : isa;
+    }
+
+private:
+    struct Table {
+        explicit Table(const char *r, size_t size)
+            : rangesSize(size)
+        {
+            for(size_t i = 0; i < sizeof(ranges); ++i)
+                ranges[i] = i < size ? r[i] : 0;
+
+            for(int c = 0; c < 256; ++c)
+            {
+                stop[c] = false;
+
+                for(size_t i = 0; i < size; i += 2)
+                {
+                    if( c >= static_cast<unsigned char>(r[i]) &&
+                            c <= static_cast<unsigned char>(r[i + 1]) )
+                    {
+                        stop[c] = true;
+                    }
+                }
+            }
+        }
+
+        char ranges[16];
+        size_t rangesSize;
+        bool stop[256];
+    };
+
+    static const Table &table(CharClass cls)
+    {
+        static const char token[] = "\x00\x20" "\"\"" "()" ",," "//" ":@" "[]" "{\xff";
+        static const char uri[] = "\x00\x20" "\x7f\x7f";
+        static const char headerValue[] = "\x00\x1f" "\x7f\x7f";
+
+        static const Table tables[CharClassCount] = {
+            Table(token, sizeof(token) - 1),
+            Table(uri, sizeof(uri) - 1),
+            Table(headerValue, sizeof(headerValue) - 1)
+        };
+
+        return tables[cls];
+    }
+
+    static Isa &currentIsa()
+    {
+        static Isa isa = detectIsa();
+        return isa;
+    }
+
+    static Isa detectIsa()
+    {
+#ifdef HSERV_CHARSCANNER_X86
+        __builtin_cpu_init();
+
+        if( __builtin_cpu_supports("avx2") )
+            return IsaAvx2;
+        else if( __builtin_cpu_supports("sse4.2") )
+            return IsaSse42;
+#endif
+        return IsaScalar;
+    }
+
+#ifdef HSERV_CHARSCANNER_X86
+    __attribute__((target("sse4.2")))
+    static const char *skipSse42(const Table &t, const char *begin, const char *end)
+    {
+        const __m128i ranges = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t.ranges));
+        const int rangesSize = static_cast<int>(t.rangesSize);
+
+        for(; end - begin >= 16; begin += 16)
+        {
+            const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+            int index = _mm_cmpestri(ranges, rangesSize, data, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+
+            if( index != 16 )
+                return begin + index;
+        }
+
+        return begin;
+    }
+
+    __attribute__((target("avx2")))
+    static const char *skipAvx2(const Table &t, const char *begin, const char *end)
+    {
+        // Most of the fields are short, check the first 16 bytes without AVX2 setup.
+        if( end - begin >= 16 )
+        {
+            const char *p = skipSse42(t, begin, begin + 16);
+
+            if( p != begin + 16 )
+                return p;
+
+            begin = p;
+        }
+
+        const size_t count = t.rangesSize / 2;
+        __m256i low[8];
+        __m256i width[8];
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            low[i] = _mm256_set1_epi8(t.ranges[2 * i]);
+            width[i] = _mm256_set1_epi8(static_cast<char>(t.ranges[2 * i + 1] - t.ranges[2 * i]));
+        }
+
+        for(; end - begin >= 32; begin += 32)
+        {
+            const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+            __m256i found = _mm256_setzero_si256();
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                // (c - low) <= (high - low) as unsigned bytes
+                const __m256i shifted = _mm256_sub_epi8(data, low[i]);
+                const __m256i inRange = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, width[i]), shifted);
+
+                found = _mm256_or_si256(found, inRange);
+            }
+
+            unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(found));
+
+            if( mask != 0 )
+                return begin + __builtin_ctz(mask);
+        }
+
+        // the tail is shorter than 32 bytes
+        return skipSse42(t, begin, end);
+    }
+#endif
+};
+
+} // namespace hserv
+
+#endif // HSERV_CHARSCANNER_H
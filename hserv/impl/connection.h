@@ -8,12 +8,18 @@
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/utility/string_ref.hpp>
 
 namespace hserv {
 
 class Connection : private boost::noncopyable
 {
 public:
+    // Receives the next fragment of the request body, the empty fragment is the last one.
+    typedef boost::function<void(const boost::system::error_code &,
+                                 const boost::string_ref &)> BodyHandler;
+
     virtual ~Connection() {}
 
     virtual void start() = 0;
@@ -24,6 +30,8 @@ public:
 
     virtual void writeResponsePartial(const boost::function<void()> &callback) = 0;
 
+    virtual void readBody(const BodyHandler &handler) = 0;
+
 protected:
     virtual void handleComplete(const boost::system::error_code &ec) = 0;
 };
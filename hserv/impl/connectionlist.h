@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_CONNECTIONLIST_H
+#define HSERV_CONNECTIONLIST_H
+
+#include <boost/noncopyable.hpp>
+
+namespace hserv {
+
+// Started connections of an io_service, an intrusive list: a connection
+// derives from ConnectionList::Hook and unlinks itself when it is closed.
+//
+// Not thread safe, the connections are linked and unlinked by the thread
+// running their io_service.
+template<typename Connection>
+class ConnectionList : private boost::noncopyable
+{
+public:
+    class Hook : private boost::noncopyable
+    {
+    public:
+        Hook() : prev(this), next(this) {}
+
+        ~Hook()
+        {
+            unlink();
+        }
+
+        bool linked() const
+        {
+            return next != this;
+        }
+
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+
+    private:
+        friend class ConnectionList;
+
+        Hook *prev;
+        Hook *next;
+    };
+
+    ~ConnectionList()
+    {
+        // the connections may outlive the list
+        while( head.linked() )
+            head.next->unlink();
+    }
+
+    void add(Connection &connection)
+    {
+        Hook *hook = &connection;
+
+        hook->unlink();
+        hook->prev = head.prev;
+        hook->next = &head;
+        head.prev->next = hook;
+        head.prev = hook;
+    }
+
+    bool empty() const
+    {
+        return head.linked() == false;
+    }
+
+    // The function may unlink the connection it gets.
+    template<typename Function>
+    void forEach(Function function)
+    {
+        for(Hook *hook = head.next; hook != &head; )
+        {
+            Hook *next = hook->next;
+
+            function(static_cast<Connection &>(*hook));
+            hook = next;
+        }
+    }
+
+private:
+    Hook head;
+};
+
+} // namespace hserv
+
+#endif // HSERV_CONNECTIONLIST_H
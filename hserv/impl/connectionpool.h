@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_CONNECTIONPOOL_H
+#define HSERV_CONNECTIONPOOL_H
+
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace hserv {
+
+struct ConnectionPoolStats
+{
+    ConnectionPoolStats()
+        : hits(0), misses(0), idle(0)
+    {
+    }
+
+    // Accepted connections served by a pooled object
+    size_t hits;
+    // Accepted connections which needed a new object
+    size_t misses;
+    // Objects waiting in the pool
+    size_t idle;
+};
+
+// A bounded freelist of closed connections. A connection comes back when the
+// last reference to it is released: Connection::recycle() closes its socket and
+// drops the request state, the buffers are kept for the next client.
+//
+// Connections may be released by any thread, the pool is locked.
+template<typename Connection>
+class ConnectionPool : public boost::enable_shared_from_this< ConnectionPool<Connection> >,
+        private boost::noncopyable
+{
+public:
+    explicit ConnectionPool(size_t capacity)
+        : capacity(capacity), closed(false)
+    {
+        idle.reserve(capacity);
+    }
+
+    ~ConnectionPool()
+    {
+        close();
+    }
+
+    // A connection of the pool or NULL, then the caller creates a new one.
+    Connection *take()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+
+        if( idle.empty() )
+        {
+            ++counters.misses;
+            return NULL;
+        }
+
+        Connection *connection = idle.back();
+
+        idle.pop_back();
+        ++counters.hits;
+
+        return connection;
+    }
+
+    // Own the connection, it returns to the pool instead of being deleted.
+    boost::shared_ptr<Connection> manage(Connection *connection)
+    {
+        Recycler recycler = { this->shared_from_this() };
+        return boost::shared_ptr<Connection>(connection, recycler);
+    }
+
+    // Delete the idle connections and stop pooling, must be called before
+    // the io_service of the connections is destroyed.
+    void close()
+    {
+        std::vector<Connection *> connections;
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+
+            closed = true;
+            connections.swap(idle);
+        }
+
+        for(size_t i = 0; i < connections.size(); ++i)
+            delete connections[i];
+    }
+
+    ConnectionPoolStats stats() const
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        ConnectionPoolStats result = counters;
+
+        result.idle = idle.size();
+        return result;
+    }
+
+private:
+    struct Recycler
+    {
+        boost::shared_ptr<ConnectionPool> pool;
+
+        void operator()(Connection *connection) const
+        {
+            pool->put(connection);
+        }
+    };
+
+    void put(Connection *connection)
+    {
+        connection->recycle();
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+
+            if( closed == false && idle.size() < capacity )
+            {
+                idle.push_back(connection);
+                return;
+            }
+        }
+
+        delete connection;
+    }
+
+    const size_t capacity;
+    bool closed;
+    std::vector<Connection *> idle;
+    ConnectionPoolStats counters;
+    mutable boost::mutex mutex;
+};
+
+} // namespace hserv
+
+#endif // HSERV_CONNECTIONPOOL_H
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_DATESERVICE_H
+#define HSERV_DATESERVICE_H
+
+#include <ctime>
+#include <cstring>
+#include <boost/atomic.hpp>
+#include <boost/asio/io_service.hpp>
+
+namespace hserv {
+
+// The default headers of responses, "Date" and "Server", formatted once per second
+// instead of once per response. The first response of a second formats the
+// date, there is no timer, so the service does not keep the io_service running.
+//
+// The text is double buffered: readers copy the current one while the other
+// one is written, so the service may be used by several threads.
+template<typename Tag>
+class BasicDateService : public boost::asio::io_service::service
+{
+public:
+    static boost::asio::io_service::id id;
+
+    enum {
+        // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", the length is fixed
+        dateHeaderSize = 37,
+        // "Sun, 06 Nov 1994 08:49:37 GMT"
+        dateSize = 29
+    };
+
+    explicit BasicDateService(boost::asio::io_service &ioService)
+        : boost::asio::io_service::service(ioService), current(0), second(0), updating(false)
+    {
+        time_t now = time(0);
+
+        format(now, dateHeaders[0]);
+        memcpy(dateHeaders[1], dateHeaders[0], dateHeaderSize);
+        second.store(now, boost::memory_order_release);
+    }
+
+    // Copy the "Date" header line to the buffer of dateHeaderSize bytes.
+    void copyDateHeader(char *buffer)
+    {
+        update();
+        memcpy(buffer, dateHeaders[current.load(boost::memory_order_acquire)], dateHeaderSize);
+    }
+
+    // Copy the date of the "Date" header to the buffer of dateSize bytes.
+    void copyDate(char *buffer)
+    {
+        update();
+        memcpy(buffer, dateHeaders[current.load(boost::memory_order_acquire)] + 6, dateSize);
+    }
+
+    static const char *serverHeader()
+    {
+        return "Server: hserv\r\n";
+    }
+
+    static size_t serverHeaderSize()
+    {
+        return sizeof("Server: hserv\r\n") - 1;
+    }
+
+private:
+    // Boost.Asio 1.66 and newer
+    virtual void shutdown()
+    {
+    }
+
+    // Older Boost.Asio
+    virtual void shutdown_service()
+    {
+    }
+
+    // One thread formats the new second, the others meanwhile copy the
+    // date of the previous one.
+    void update()
+    {
+        time_t now = time(0);
+
+        if( now == second.load(boost::memory_order_acquire) ||
+                updating.exchange(true, boost::memory_order_acquire) )
+            return;
+
+        if( now != second.load(boost::memory_order_relaxed) )
+        {
+            int next = 1 - current.load(boost::memory_order_relaxed);
+
+            format(now, dateHeaders[next]);
+            current.store(next, boost::memory_order_release);
+            second.store(now, boost::memory_order_release);
+        }
+
+        updating.store(false, boost::memory_order_release);
+    }
+
+    // RFC 1123 date, the names do not depend on the locale as with strftime().
+    static void format(time_t now, char *out)
+    {
+        static const char days[7][4] = {
+            "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+        };
+        static const char months[12][4] = {
+            "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+        };
+        struct tm tm;
+
+#ifdef _MSC_VER
+        gmtime_s( &tm, &now );
+#else
+        gmtime_r( &now, &tm );
+#endif
+        memcpy(out, "Date: ", 6);
+        memcpy(out + 6, days[tm.tm_wday], 3);
+        memcpy(out + 9, ", ", 2);
+        digits(out + 11, tm.tm_mday, 2);
+        out[13] = ' ';
+        memcpy(out + 14, months[tm.tm_mon], 3);
+        out[17] = ' ';
+        digits(out + 18, tm.tm_year + 1900, 4);
+        out[22] = ' ';
+        digits(out + 23, tm.tm_hour, 2);
+        out[25] = ':';
+        digits(out + 26, tm.tm_min, 2);
+        out[28] = ':';
+        digits(out + 29, tm.tm_sec, 2);
+        memcpy(out + 31, " GMT\r\n", 6);
+    }
+
+    static void digits(char *out, int value, int count)
+    {
+        for(int i = count - 1; i >= 0; --i)
+        {
+            out[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+    }
+
+    char dateHeaders[2][dateHeaderSize];
+    boost::atomic<int> current;
+    // The second of the current text
+    boost::atomic<time_t> second;
+    boost::atomic<bool> updating;
+};
+
+template<typename Tag>
+boost::asio::io_service::id BasicDateService<Tag>::id;
+
+typedef BasicDateService<void> DateService;
+
+} // namespace hserv
+
+#endif // HSERV_DATESERVICE_H
@@ -6,6 +6,7 @@
 #ifndef HSERV_FASTCGICONNECTION_H
 #define HSERV_FASTCGICONNECTION_H
 
+#include <algorithm>
 #include <vector>
 #include <iostream>
 
@@ -13,30 +14,49 @@
 #include <boost/noncopyable.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
+#include <hserv/context.h>
 #include <hserv/response.h>
 #include <hserv/request.h>
+#include <hserv/impl/bufferlist.h>
 #include <hserv/impl/connection.h>
+#include <hserv/impl/handlermemory.h>
 
 namespace hserv {
 
+// A connection of the web server. The requests are multiplexed: every one
+// has an own stream of records and an own context, the responses are sent
+// as interleaved STDOUT records.
 template<typename T>
-class FastCGIConnection : public Connection,
-        public boost::enable_shared_from_this< FastCGIConnection<T> >
+class FastCGIConnection : public boost::enable_shared_from_this< FastCGIConnection<T> >,
+        private boost::noncopyable
 {
 public:
+    enum {
+        // Advertised by FCGI_GET_VALUES_RESULT, the web server uses them
+        // to size its connection pool.
+        maxConnections = 1024,
+        // Concurrent requests of a connection, more are rejected as overloaded.
+        maxConnectionRequests = 64
+    };
+
     FastCGIConnection(boost::asio::io_service &io_service,
                       const boost::function<void(const boost::shared_ptr<Context> &)> &callback);
 
+    ~FastCGIConnection();
+
     void start();
 
     void stop();
 
     T& getSocket();
 
-    virtual void writeResponse();
-    virtual void writeResponsePartial(const boost::function<void()> &callback);
+    // Called by the connection pool: close the socket and drop the state
+    // of the last client.
+    void recycle();
 
 private:
     struct FcgiHeader {
@@ -57,15 +77,48 @@ private:
         unsigned char reserved[5];
     };
 
-    struct FcgiBeginRequestRecord {
+    struct FcgiEndRequestBody {
+        unsigned char appStatusB3;
+        unsigned char appStatusB2;
+        unsigned char appStatusB1;
+        unsigned char appStatusB0;
+        unsigned char protocolStatus;
+        unsigned char reserved[3];
+    };
+
+    struct FcgiEndRequestRecord {
         FcgiHeader header;
-        FcgiBeginRequestBody body;
+        FcgiEndRequestBody body;
+    };
+
+    struct FcgiUnknownTypeBody {
+        unsigned char type;
+        unsigned char reserved[7];
     };
 
     enum {
         FcgiVersion = 1,
         FcgiKeepConnection = 1,
-        MaxFcgiMessageLength = 0xffff
+        MaxFcgiMessageLength = 0xffff,
+        // The longest record without padding.
+        MaxAlignedMessageLength = 0xfff8
+    };
+
+    enum FcgiProtocolStatus {
+        FcgiRequestComplete = 0,
+        FcgiCantMultiplexConnections = 1,
+        FcgiOverloaded = 2,
+        FcgiUnknownRole = 3
+    };
+
+    enum {
+        // Records sent by one write.
+        maxWriteRecords = 16,
+        fileBufferSize = 65536,
+        // The read buffer grows up to the longest record.
+        initialBufferSize = 16384,
+        // Less free space at the end of the buffer is reclaimed before a read.
+        minReadSize = 4096
     };
 
     enum FcgiMessageType {
@@ -79,7 +132,8 @@ private:
         MessageData = 8,
         MessageGetValues = 9,
         MessageGetValuesResult = 10,
-        MessageMax = 11
+        MessageUnknownType = 11,
+        MessageMax = 12
     };
 
     enum FcgiRoleType {
@@ -88,496 +142,982 @@ private:
         RoleFilter = 3
     };
 
-    void handleBeginRequest(const boost::system::error_code &ec);
-    void handleNextHeader(const boost::system::error_code &ec);
-    void handleParams(uint16_t len, const boost::system::error_code &ec);
-    void handleMessageStdin(uint16_t len, const boost::system::error_code &ec);
-    void handleMessagesComplete(const boost::system::error_code &ec);
-    virtual void handleComplete(const boost::system::error_code &ec);
-    void handlePartialComplete(const boost::function<void()> &callback,
-                               const boost::system::error_code &ec);
-    void writeResponseInternal(const boost::function<void()> &callback);
-
+    // A request of the connection, the context of the handler refers to it.
+    struct Stream : public Connection
+    {
+        explicit Stream(FastCGIConnection &connection);
+
+        void reset(uint16_t requestId, bool keepConnection);
+
+        virtual void start();
+        virtual void stop();
+        virtual void writeResponse();
+        virtual void writeResponsePartial(const boost::function<void()> &callback);
+        virtual void readBody(const BodyHandler &handler);
+
+        bool parseParams();
+        void processCgiHeader(const boost::string_ref &name, const boost::string_ref &value);
+
+        FastCGIConnection &connection;
+
+        uint16_t requestId;
+        bool keepConnection;
+        bool paramsDone;
+        bool dispatched;
+        bool firstChunk;
+        bool bodyDelivered;
+
+        // Request storage, the request refers to it.
+        std::vector<char> paramsBuf;
+        std::vector<char> postDataBuf;
+
+        RequestImpl requestImpl;
+        Request request;
+        Response response;
+        Context context;
+
+        // The STDOUT stream: the status and the headers, the content and a chunk
+        // of the file. The records refer to them.
+        std::vector<char> output;
+        std::vector<char> fileBuffer;
+        boost::asio::const_buffer pending[3];
+        size_t pendingIndex;
+        size_t fileOffset;
+        size_t fileRemaining;
+
+        boost::array<FcgiHeader, maxWriteRecords + 1> recordHeaders;
+        FcgiEndRequestRecord endRequest;
+
+        boost::function<void()> writeCallback;
+        bool lastChunk;
+        bool writeDone;
+
+        // The next stream of the write queue.
+        Stream *nextWrite;
+
+    protected:
+        virtual void handleComplete(const boost::system::error_code &ec);
+    };
 
-    void processCgiHeader(const std::string &name, const std::string &value);
-    FcgiHeader makeHeader(FcgiMessageType type, uint16_t length) const;
+    // The completion condition of the reads: the buffer holds a whole record.
+    struct RecordReceived
+    {
+        size_t operator()(const boost::system::error_code &ec, size_t bytesTransferred) const
+        {
+            return ec ? 0 : connection->remainingBytes(bytesTransferred);
+        }
 
-    std::vector<char> msgBuf;
-    boost::asio::streambuf streamBuf;
-    uint16_t requestId;
-    bool keepConnection;
-    bool firstChunk;
+        const FastCGIConnection *connection;
+    };
 
+    // A header, the data and the padding of every record, the last records
+    // of the streams and the management records.
+    typedef BufferList<5 * maxWriteRecords + 1> Buffers;
+
+    void readRecords();
+    void handleRead(const boost::system::error_code &ec, size_t bytesTransferred);
+    size_t remainingBytes(size_t bytesTransferred) const;
+    bool processRecord(const char *data, size_t length);
+    bool processManagementRecord(const char *data, size_t length);
+    void beginRequest(uint16_t requestId, bool keepConnection);
+    void releaseStream(Stream &stream);
+    Stream *findStream(uint16_t requestId) const;
+
+    void writeResponse(Stream &stream, const boost::function<void()> &callback);
+    void queueWrite(Stream &stream);
+    void writeNext();
+    size_t writeRecords(Stream &stream, Buffers &buffers, size_t maxRecords);
+    bool readFile(Stream &stream);
+    void handleWrite(const boost::system::error_code &ec);
+    void completeRequest(Stream &stream);
+    void invokeBodyHandler(const Connection::BodyHandler &handler, const boost::string_ref &data);
+
+    void appendGetValuesResult(const char *data, size_t length);
+    void appendEndRequest(uint16_t requestId, FcgiProtocolStatus status);
+    void appendUnknownType(unsigned char type);
+    void appendRecord(FcgiMessageType type, uint16_t requestId, const char *data, size_t length);
+
+    static FcgiHeader makeHeader(FcgiMessageType type, uint16_t requestId, uint16_t length);
+    static const unsigned char *nextPair(const unsigned char *ptr, const unsigned char *end,
+                                         boost::string_ref &name, boost::string_ref &value);
+    static void appendPair(std::vector<char> &out, const boost::string_ref &name,
+                           const boost::string_ref &value);
+
+    boost::asio::io_service &ioService;
     T socket;
 
-    boost::function<void(boost::shared_ptr<Context> &)> callback;
+    boost::function<void(const boost::shared_ptr<Context> &)> callback;
 
-    boost::array<char, 8192> buffer;
+    // Received data, the records are parsed in place. The unparsed data is
+    // in [bufferBegin, bufferEnd).
+    std::vector<char> buffer;
+    size_t bufferBegin;
+    size_t bufferEnd;
+    HandlerMemory<512> readMemory;
 
-    RequestImpl requestImpl;
-    Request request;
+    // The record being processed.
+    FcgiHeader header;
 
-    Response response;
+    std::vector<Stream *> streams;
+    std::vector<Stream *> idleStreams;
 
-    boost::shared_ptr<Context> context;
+    // Streams with data to send, in the order of sending.
+    Stream *writeHead;
+    Stream *writeTail;
+
+    // The streams and the management records of the current write.
+    boost::array<Stream *, maxWriteRecords> writing;
+    size_t writingCount;
+    bool writeInProgress;
+    // A request without FCGI_KEEP_CONN is completed, the connection is closed
+    // when the last request is completed.
+    bool closeWhenIdle;
+
+    // Management records, sent with the next write.
+    std::vector<char> control;
+    std::vector<char> controlWriting;
+
+    // The write operation keeps two copies of the buffer list.
+    HandlerMemory<4096> writeMemory;
 };
 
+template<typename T>
+FastCGIConnection<T>::Stream::Stream(FastCGIConnection &connection)
+    : connection(connection), requestId(0), keepConnection(false), paramsDone(false),
+      dispatched(false), firstChunk(true), bodyDelivered(false),
+      request(requestImpl), context(connection.ioService, *this, request, response),
+      pendingIndex(0), fileOffset(0), fileRemaining(0), lastChunk(false), writeDone(false),
+      nextWrite(NULL)
+{
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::reset(uint16_t requestId, bool keepConnection)
+{
+    this->requestId = requestId;
+    this->keepConnection = keepConnection;
+
+    requestImpl.reset();
+    // FIXME!!
+    // requestImpl.endpoint = socket.remote_endpoint();
+    paramsBuf.clear();
+    postDataBuf.clear();
+    response.reset();
+    paramsDone = false;
+    dispatched = false;
+    firstChunk = true;
+    bodyDelivered = false;
+    fileRemaining = 0;
+    writeCallback.clear();
+    nextWrite = NULL;
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::start()
+{
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::stop()
+{
+    connection.stop();
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::writeResponse()
+{
+    connection.writeResponse(*this, boost::function<void()>());
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::writeResponsePartial(const boost::function<void()> &callback)
+{
+    connection.writeResponse(*this, callback);
+}
+
+// The web server sends the whole body before the handler is called,
+// so it is passed as one fragment.
+template<typename T>
+void FastCGIConnection<T>::Stream::readBody(const BodyHandler &handler)
+{
+    boost::string_ref data = bodyDelivered ? boost::string_ref() : requestImpl.postData;
+
+    bodyDelivered = true;
+    connection.ioService.post(boost::bind(&FastCGIConnection::invokeBodyHandler,
+                                          connection.shared_from_this(),
+                                          handler, data));
+}
+
+template<typename T>
+void FastCGIConnection<T>::Stream::handleComplete(const boost::system::error_code &)
+{
+}
+
 template<typename T>
 FastCGIConnection<T>::FastCGIConnection(
         boost::asio::io_service &io_service,
         const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-    : Connection(), requestId(0),
-      keepConnection(false), firstChunk(true),
-      socket(io_service), callback(callback), request(requestImpl)
+    : ioService(io_service), socket(io_service), callback(callback),
+      buffer(initialBufferSize), bufferBegin(0), bufferEnd(0),
+      writeHead(NULL), writeTail(NULL), writingCount(0), writeInProgress(false),
+      closeWhenIdle(false)
 {
-    context.reset(new Context(io_service, *this, request, response));
 }
 
 template<typename T>
-void FastCGIConnection<T>::start()
+FastCGIConnection<T>::~FastCGIConnection()
 {
-    try
-    {
-        requestImpl = RequestImpl();
-        // FIXME!!
-        // requestImpl.endpoint = socket.remote_endpoint();
-        response = Response();
-        firstChunk = true;
-
-        boost::asio::async_read(socket,
-                                boost::asio::buffer(&buffer[0],
-                                                    sizeof(FcgiBeginRequestRecord)),
-                                boost::bind(&FastCGIConnection::handleBeginRequest,
-                                            this->shared_from_this(),
-                                            boost::asio::placeholders::error));
-    }
-    catch(std::exception &e)
-    {
-        std::cerr << "exception: " << e.what() << std::endl;
-        stop();
-    }
+    for(size_t i = 0; i < streams.size(); ++i)
+        delete streams[i];
+
+    for(size_t i = 0; i < idleStreams.size(); ++i)
+        delete idleStreams[i];
 }
 
 template<typename T>
-void FastCGIConnection<T>::stop()
+void FastCGIConnection<T>::start()
 {
-    socket.close();
+    readRecords();
 }
 
 template<typename T>
-T& FastCGIConnection<T>::getSocket()
+void FastCGIConnection<T>::stop()
 {
-    return socket;
+    boost::system::error_code ignored_ec;
+    socket.close(ignored_ec);
 }
 
 template<typename T>
-void FastCGIConnection<T>::handleBeginRequest(const boost::system::error_code &ec)
+void FastCGIConnection<T>::recycle()
 {
-    if( !ec )
-    {
-        FcgiBeginRequestRecord *req = reinterpret_cast<FcgiBeginRequestRecord *>(&buffer[0]);
+    boost::system::error_code ignored_ec;
+    socket.close(ignored_ec);
 
-        if( req->header.version != 1 )
-        {
-            std::cerr << "Invalid protocol version " << req->header.version << std::endl;
-            stop();
-            return;
-        }
+    while( streams.empty() == false )
+        releaseStream(*streams.back());
 
-        requestId = (req->header.requestIdB1 << 8) + req->header.requestIdB0;
-        uint16_t len = (req->header.contentLengthB1 << 8) + req->header.contentLengthB0;
+    bufferBegin = 0;
+    bufferEnd = 0;
 
-        if( req->header.type != MessageBeginRequest
-                || len != sizeof(FcgiBeginRequestBody) )
-        {
+    if( buffer.size() > initialBufferSize )
+        std::vector<char>(initialBufferSize).swap(buffer);
 
-            std::cerr << "Protocol error: req->header.type != MessageBeginRequest || "
-                         "len != sizeof(FcgiBeginRequestBody)" << std::endl;
-            stop();
-            return;
-        }
+    writeHead = NULL;
+    writeTail = NULL;
+    writingCount = 0;
+    writeInProgress = false;
+    closeWhenIdle = false;
+    control.clear();
+    controlWriting.clear();
+}
+
+template<typename T>
+T& FastCGIConnection<T>::getSocket()
+{
+    return socket;
+}
 
-        this->keepConnection = req->body.flags & FcgiKeepConnection;
-        int role = (req->body.roleB1 << 8) + req->body.roleB0;
+template<typename T>
+void FastCGIConnection<T>::readRecords()
+{
+    RecordReceived condition = { this };
+
+    boost::asio::async_read(socket,
+                            boost::asio::buffer(&buffer[0] + bufferEnd, buffer.size() - bufferEnd),
+                            condition,
+                            makeMemoryHandler(readMemory,
+                                              boost::bind(&FastCGIConnection::handleRead,
+                                                          this->shared_from_this(),
+                                                          boost::asio::placeholders::error,
+                                                          boost::asio::placeholders::bytes_transferred)));
+}
 
-        if( role != RoleResponder )
-        {
-            std::cerr << "Invalid role " << role << std::endl;
-            stop();
-            return;
-        }
+// Bytes to read before the next record is complete, zero if it is complete
+// or does not fit to the rest of the buffer.
+template<typename T>
+size_t FastCGIConnection<T>::remainingBytes(size_t bytesTransferred) const
+{
+    size_t end = bufferEnd + bytesTransferred;
 
-        boost::asio::async_read(socket,
-                                boost::asio::buffer(&buffer[0],
-                                                    sizeof(FcgiHeader)),
-                                boost::bind(&FastCGIConnection::handleNextHeader,
-                                            this->shared_from_this(),
-                                            boost::asio::placeholders::error));
-    }
-    else
+    if( end - bufferBegin >= sizeof(FcgiHeader) )
     {
-        std::cerr << "FastCGIConnection<T>::handleBeginRequest: " << ec.message() << std::endl;
-        stop();
+        const FcgiHeader *next = reinterpret_cast<const FcgiHeader *>(&buffer[0] + bufferBegin);
+        size_t size = sizeof(FcgiHeader) + (next->contentLengthB1 << 8) + next->contentLengthB0
+                + next->paddingLength;
+
+        if( end - bufferBegin >= size || bufferBegin + size > buffer.size() )
+            return 0;
     }
+
+    return buffer.size() - end;
 }
 
+// Process all complete records of the buffer, the rest is kept for the next
+// read. Usually one read brings the whole request.
 template<typename T>
-void FastCGIConnection<T>::handleNextHeader(const boost::system::error_code &ec)
+void FastCGIConnection<T>::handleRead(const boost::system::error_code &ec, size_t bytesTransferred)
 {
-    if( !ec )
+    if( ec )
     {
-        FcgiHeader *HeaderItem = reinterpret_cast<FcgiHeader *>(&buffer[0]);
-
-        if( HeaderItem->version != FcgiVersion )
+        if( ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted )
         {
-            std::cerr << "Invalid protocol version " << HeaderItem->version << std::endl;
+            std::cerr << "FastCGIConnection<T>::handleRead: " << ec.message() << std::endl;
             stop();
-            return;
         }
 
-        uint16_t requestId = (HeaderItem->requestIdB1 << 8) + HeaderItem->requestIdB0;
-        uint16_t len = (HeaderItem->contentLengthB1 << 8) + HeaderItem->contentLengthB0;
+        return;
+    }
+
+    size_t needed = sizeof(FcgiHeader);
+
+    bufferEnd += bytesTransferred;
+
+    while( bufferEnd - bufferBegin >= sizeof(FcgiHeader) )
+    {
+        const char *record = &buffer[0] + bufferBegin;
 
-        if( this->requestId != requestId )
+        std::copy(record, record + sizeof(FcgiHeader), reinterpret_cast<char *>(&header));
+
+        if( header.version != FcgiVersion )
         {
+            std::cerr << "Invalid protocol version " << int(header.version) << std::endl;
             stop();
             return;
         }
 
-        switch(HeaderItem->type)
-        {
-        case MessageBeginRequest:
-            std::cerr << "Protocol error: MessageBeginRequest duplicate" << std::endl;
-            stop();
-            return;
-        case MessageAbortRequest:
-            stop();
-            return;
-        case MessageParams:
-            if( len == 0 )
-            {
-                boost::asio::async_read(socket,
-                                        boost::asio::buffer(&buffer[0],
-                                                            sizeof(FcgiHeader)),
-                                        boost::bind(&FastCGIConnection::handleNextHeader,
-                                                    this->shared_from_this(),
-                                                    boost::asio::placeholders::error));
-            }
-            else
-            {
-                msgBuf.resize(len + HeaderItem->paddingLength);
-                boost::asio::async_read(socket,
-                                        boost::asio::buffer(&msgBuf[0],
-                                                            len + HeaderItem->paddingLength),
-                                        boost::bind(&FastCGIConnection::handleParams,
-                                                    this->shared_from_this(), len,
-                                                    boost::asio::placeholders::error));
-            }
-            break;
-        case MessageStdin:
-            if( len == 0 )
-            {
-                // request done
-                callback(context);
-            }
-            else
-            {
-                msgBuf.resize(len + HeaderItem->paddingLength);
-                boost::asio::async_read(socket,
-                                        boost::asio::buffer(&msgBuf[0],
-                                                            len + HeaderItem->paddingLength),
-                                        boost::bind(&FastCGIConnection::handleMessageStdin,
-                                                    this->shared_from_this(), len,
-                                                    boost::asio::placeholders::error));
-            }
+        size_t length = (header.contentLengthB1 << 8) + header.contentLengthB0;
+
+        needed = sizeof(FcgiHeader) + length + header.paddingLength;
+
+        if( bufferEnd - bufferBegin < needed )
             break;
-        case MessageEndRequest:
-        case MessageStdout:
-        case MessageStderr:
-        case MessageData:
-        case MessageGetValues:
-        case MessageGetValuesResult:
-        default:
-            std::cerr << "Invalid message " << HeaderItem->type << std::endl;
+
+        if( processRecord(record + sizeof(FcgiHeader), length) == false )
+        {
             stop();
-            assert(false);
             return;
         }
+
+        bufferBegin += needed;
+        needed = sizeof(FcgiHeader);
     }
-    else
+
+    if( bufferBegin == bufferEnd )
     {
-        std::cerr << "exception: " << ec.message() << std::endl;
-        stop();
+        bufferBegin = 0;
+        bufferEnd = 0;
+    }
+    else if( buffer.size() - bufferBegin < std::max<size_t>(needed, minReadSize) )
+    {
+        // move the incomplete record to the beginning
+        std::copy(&buffer[0] + bufferBegin, &buffer[0] + bufferEnd, &buffer[0]);
+        bufferEnd -= bufferBegin;
+        bufferBegin = 0;
     }
+
+    if( buffer.size() < needed )
+        buffer.resize(needed);
+
+    writeNext();
+
+    if( socket.is_open() )
+        readRecords();
 }
 
+// Records of unknown requests are ignored, as the specification asks.
 template<typename T>
-void FastCGIConnection<T>::handleParams(uint16_t len, const boost::system::error_code &ec)
+bool FastCGIConnection<T>::processRecord(const char *data, size_t length)
 {
-    if( !ec )
-    {
-        const unsigned char *ptr = NULL;
+    uint16_t requestId = (header.requestIdB1 << 8) + header.requestIdB0;
+
+    if( requestId == 0 )
+        return processManagementRecord(data, length);
 
-        if( msgBuf.empty() == false )
+    Stream *stream = findStream(requestId);
+
+    switch(header.type)
+    {
+    case MessageBeginRequest:
+    {
+        if( stream != NULL )
         {
-            ptr = reinterpret_cast<const unsigned char *>(&msgBuf[0]);
+            std::cerr << "Protocol error: MessageBeginRequest duplicate" << std::endl;
+            return false;
         }
-        else
+
+        if( length != sizeof(FcgiBeginRequestBody) )
         {
-            stop();
-            return;
+            std::cerr << "Protocol error: len != sizeof(FcgiBeginRequestBody)" << std::endl;
+            return false;
         }
 
-        const unsigned char *end = ptr + len;
-        int nameLen = 0;
+        const FcgiBeginRequestBody *body = reinterpret_cast<const FcgiBeginRequestBody *>(data);
+        int role = (body->roleB1 << 8) + body->roleB0;
 
-        while( ptr != end )
-        {
-            nameLen = *ptr;
+        if( role != RoleResponder )
+            appendEndRequest(requestId, FcgiUnknownRole);
+        else if( streams.size() == maxConnectionRequests )
+            appendEndRequest(requestId, FcgiOverloaded);
+        else
+            beginRequest(requestId, body->flags & FcgiKeepConnection);
 
-            if( nameLen & 0x80 )
-            {
-                if( end - ptr < 3 ) {
-                    stop();
-                    return;
-                }
-                nameLen = ((nameLen & 0x7f) << 24) + (ptr[1] << 16)
-                        + (ptr[2] << 8) + ptr[3];
-                ptr += 3;
-            }
-            ++ptr;
+        return true;
+    }
+    case MessageAbortRequest:
+        // A running handler completes the request with its response.
+        if( stream != NULL && stream->dispatched == false )
+        {
+            releaseStream(*stream);
+            appendEndRequest(requestId, FcgiRequestComplete);
+        }
+        return true;
+    case MessageParams:
+        if( stream == NULL || stream->paramsDone )
+            return true;
 
-            int valueLen = *ptr;
+        if( length == 0 )
+        {
+            // all params received
+            stream->paramsDone = true;
 
-            if( valueLen & 0x80 )
+            if( stream->parseParams() == false )
             {
-                if( end - ptr < 3 ) {
-                    stop();
-                    return;
-                }
-                valueLen = ((valueLen & 0x7f) << 24) + (ptr[1] << 16)
-                        + (ptr[2] << 8) + ptr[3];
-                ptr += 3;
+                std::cerr << "Protocol error: invalid params" << std::endl;
+                return false;
             }
-            ++ptr;
+        }
+        else
+        {
+            // Params are parsed when the whole stream is received,
+            // a name-value pair may be split between records.
+            stream->paramsBuf.insert(stream->paramsBuf.end(), data, data + length);
+        }
+        return true;
+    case MessageStdin:
+        if( stream == NULL || stream->dispatched )
+            return true;
 
-            if( nameLen + valueLen > end - ptr ) {
-                stop();
-                return;
-            }
+        if( length == 0 )
+        {
+            // request done
+            if( stream->postDataBuf.empty() == false )
+                stream->requestImpl.postData = boost::string_ref(&stream->postDataBuf[0],
+                                                                 stream->postDataBuf.size());
 
-            std::string name(ptr, ptr + nameLen);
-            ptr += nameLen;
-            std::string value(ptr, ptr + valueLen);
-            ptr += valueLen;
+            stream->dispatched = true;
 
-            processCgiHeader(name, value);
+            // The handler keeps the connection while it holds the context.
+            callback(boost::shared_ptr<Context>(this->shared_from_this(), &stream->context));
         }
-
-        boost::asio::async_read(socket,
-                                boost::asio::buffer(&buffer[0],
-                                                    sizeof(FcgiHeader)),
-                                boost::bind(&FastCGIConnection::handleNextHeader,
-                                            this->shared_from_this(),
-                                            boost::asio::placeholders::error));
+        else
+        {
+            stream->postDataBuf.insert(stream->postDataBuf.end(), data, data + length);
+        }
+        return true;
+    case MessageData:
+        return true;
+    default:
+        std::cerr << "Invalid message " << int(header.type) << std::endl;
+        return false;
     }
+}
+
+template<typename T>
+bool FastCGIConnection<T>::processManagementRecord(const char *data, size_t length)
+{
+    if( header.type == MessageGetValues )
+        appendGetValuesResult(data, length);
     else
-    {
-        std::cerr << "exception: " << ec.message() << std::endl;
-        stop();
-    }
+        appendUnknownType(header.type);
+
+    return true;
 }
 
 template<typename T>
-void FastCGIConnection<T>::handleMessageStdin(uint16_t len, const boost::system::error_code &ec)
+void FastCGIConnection<T>::beginRequest(uint16_t requestId, bool keepConnection)
 {
-    if( !ec )
+    Stream *stream;
+
+    if( idleStreams.empty() )
     {
-        requestImpl.postData.reserve( requestImpl.postData.size() + len );
-        requestImpl.postData.insert( requestImpl.postData.end(),
-                                     &msgBuf[0], &msgBuf[0] + len);
-
-        boost::asio::async_read(socket,
-                                boost::asio::buffer(&buffer[0],
-                                                    sizeof(FcgiHeader)),
-                                boost::bind(&FastCGIConnection::handleNextHeader,
-                                            this->shared_from_this(),
-                                            boost::asio::placeholders::error));
+        stream = new Stream(*this);
     }
     else
     {
-        std::cerr << "exception: " << ec.message() << std::endl;
-        stop();
+        stream = idleStreams.back();
+        idleStreams.pop_back();
     }
+
+    stream->reset(requestId, keepConnection);
+    streams.push_back(stream);
 }
 
+// The buffers of the stream are kept for the next request.
 template<typename T>
-void FastCGIConnection<T>::writeResponse()
+void FastCGIConnection<T>::releaseStream(Stream &stream)
 {
-    writeResponseInternal( boost::function<void()>() );
+    typename std::vector<Stream *>::iterator it =
+            std::find(streams.begin(), streams.end(), &stream);
+
+    assert( it != streams.end() );
+    *it = streams.back();
+    streams.pop_back();
+
+    stream.requestId = 0;
+    stream.requestImpl.reset();
+    stream.response.reset();
+    stream.writeCallback.clear();
+    std::vector<char>().swap(stream.fileBuffer);
+    idleStreams.push_back(&stream);
 }
 
 template<typename T>
-void FastCGIConnection<T>::writeResponsePartial(const boost::function<void()> &callback)
+typename FastCGIConnection<T>::Stream *FastCGIConnection<T>::findStream(uint16_t requestId) const
 {
-    writeResponseInternal( callback );
+    for(size_t i = 0; i < streams.size(); ++i)
+    {
+        if( streams[i]->requestId == requestId )
+            return streams[i];
+    }
+
+    return NULL;
 }
 
+// The response is framed to STDOUT records without copying: the record
+// headers are kept in an array and one gather write sends them together with
+// the data. The final response ends the stream and the request.
 template<typename T>
-void FastCGIConnection<T>::writeResponseInternal(const boost::function<void()> &callback)
+void FastCGIConnection<T>::writeResponse(Stream &stream, const boost::function<void()> &callback)
 {
-    std::ostream stream(&streamBuf);
-    const std::vector<char> &content = response.content();
-    std::vector<char> data;
+    stream.output.clear();
 
-    data.reserve( content.size() );
-
-    if( firstChunk )
+    if( stream.firstChunk )
     {
         static const char status[] = {'S', 't', 'a', 't', 'u', 's', ':', ' '};
         static const char crlf[] = {'\r', '\n'};
-        boost::asio::const_buffer replyStatus = Response::statusBuffer(response.status());
+        boost::asio::const_buffer replyStatus = Response::statusBuffer(stream.response.status());
+        const char *ptr = boost::asio::buffer_cast<const char *>(replyStatus);
 
-        {
-            const char *ptr = boost::asio::buffer_cast<const char *>(replyStatus);
-            data.insert(data.end(), status, status + sizeof(status));
-            data.insert(data.end(), ptr, ptr + boost::asio::buffer_size(replyStatus));
-        }
+        stream.output.insert(stream.output.end(), status, status + sizeof(status));
+        stream.output.insert(stream.output.end(), ptr, ptr + boost::asio::buffer_size(replyStatus));
+        stream.response.serializeHeaders(stream.output);
+        stream.output.insert(stream.output.end(), crlf, crlf + sizeof(crlf));
 
-        const std::vector<boost::asio::const_buffer> &headers =
-                response.headerBuffers();
-        std::vector<boost::asio::const_buffer>::const_iterator it = headers.begin(),
-                end = headers.end();
-        for(; it != end; ++it) {
-            const char *ptr = boost::asio::buffer_cast<const char *>(*it);
-            data.insert(data.end(), ptr, ptr + boost::asio::buffer_size(*it));
-        }
+        stream.firstChunk = false;
+    }
 
-        data.insert(data.end(), crlf, crlf + sizeof(crlf));
+    stream.pending[0] = boost::asio::buffer(stream.output);
+    stream.pending[1] = boost::asio::buffer(stream.response.content());
+    stream.pending[2] = boost::asio::const_buffer();
+    stream.pendingIndex = 0;
 
-        firstChunk = false;
+    stream.writeCallback = callback;
+    stream.lastChunk = !callback;
+
+    // The file is sent with the final response only.
+    if( stream.lastChunk )
+    {
+        stream.fileOffset = stream.response.fileOffset();
+        stream.fileRemaining = stream.response.fileLength();
     }
 
-    data.insert( data.end(), content.begin(), content.end() );
+    queueWrite(stream);
+    writeNext();
+}
+
+template<typename T>
+void FastCGIConnection<T>::queueWrite(Stream &stream)
+{
+    stream.nextWrite = NULL;
+
+    if( writeTail != NULL )
+        writeTail->nextWrite = &stream;
+    else
+        writeHead = &stream;
+
+    writeTail = &stream;
+}
+
+// Send the management records and the records of the queued streams, a
+// stream which is not done goes to the end of the queue after the write.
+template<typename T>
+void FastCGIConnection<T>::writeNext()
+{
+    if( writeInProgress || (writeHead == NULL && control.empty()) || socket.is_open() == false )
+        return;
+
+    Buffers buffers;
+    size_t records = 0;
 
-    const size_t size = data.size();
-    const size_t max = MaxFcgiMessageLength;
+    controlWriting.clear();
+    controlWriting.swap(control);
+    buffers.push_back(boost::asio::buffer(controlWriting));
 
-    for(size_t i = 0; i < size;)
+    writingCount = 0;
+
+    // A stream may add no records, like an empty partial response, but it
+    // still takes a slot and the end of the request.
+    while( writeHead != NULL && records < maxWriteRecords && writingCount < maxWriteRecords &&
+           buffers.size() + 3 + 2 <= buffers.capacity() )
     {
-        size_t chunkSize = i + max > size ? size - i : max;
+        Stream &stream = *writeHead;
+
+        writeHead = stream.nextWrite;
 
-        FcgiHeader HeaderItem = makeHeader(MessageStdout, chunkSize);
+        if( writeHead == NULL )
+            writeTail = NULL;
 
-        stream << HeaderItem.version << HeaderItem.type
-               << HeaderItem.requestIdB1 << HeaderItem.requestIdB0
-               << HeaderItem.contentLengthB1 << HeaderItem.contentLengthB0
-               << HeaderItem.paddingLength << HeaderItem.reserved;
+        size_t maxRecords = std::min<size_t>(maxWriteRecords - records,
+                                             (buffers.capacity() - buffers.size() - 2) / 3);
+        size_t count = writeRecords(stream, buffers, maxRecords);
 
-        const char *ptr = &data[i];
-        std::copy(ptr, ptr + chunkSize, std::ostream_iterator<char>(stream));
+        if( count == static_cast<size_t>(-1) )
+        {
+            stop();
+            return;
+        }
 
-        i += chunkSize;
+        records += count;
+        writing[writingCount++] = &stream;
     }
 
-    if( callback )
+    if( writingCount == 0 && buffers.empty() )
+        return;
+
+    writeInProgress = true;
+    boost::asio::async_write(socket, buffers,
+                             makeMemoryHandler(writeMemory,
+                                               boost::bind(
+                                                   &FastCGIConnection::handleWrite,
+                                                   this->shared_from_this(),
+                                                   boost::asio::placeholders::error)));
+}
+
+// Add up to maxRecords records of the stream to the buffers, returns their
+// count or -1 if the file can not be read.
+template<typename T>
+size_t FastCGIConnection<T>::writeRecords(Stream &stream, Buffers &buffers, size_t maxRecords)
+{
+    static const char padding[8] = {0};
+    static const size_t pendingCount = sizeof(stream.pending) / sizeof(stream.pending[0]);
+
+    size_t records = 0;
+    bool fileRead = false;
+
+    while( records < maxRecords )
     {
-        boost::asio::async_write(socket, streamBuf,
-                                 boost::bind(
-                                     &FastCGIConnection::handlePartialComplete,
-                                     this->shared_from_this(),
-                                     callback,
-                                     boost::asio::placeholders::error) );
+        boost::asio::const_buffer &data = stream.pending[stream.pendingIndex];
+        size_t size = boost::asio::buffer_size(data);
+
+        if( size == 0 )
+        {
+            if( stream.pendingIndex + 1 < pendingCount )
+            {
+                ++stream.pendingIndex;
+                continue;
+            }
+
+            // The file buffer is free until the write is started.
+            if( stream.lastChunk && stream.fileRemaining != 0 && fileRead == false )
+            {
+                if( readFile(stream) == false )
+                    return static_cast<size_t>(-1);
+
+                fileRead = true;
+                continue;
+            }
+
+            break;
+        }
+
+        // An empty record ends the stream, so it is never sent with data.
+        size_t length = std::min<size_t>(size, MaxAlignedMessageLength);
+        size_t paddingLength = (8 - length % 8) % 8;
+        FcgiHeader &header = stream.recordHeaders[records++];
+
+        header = makeHeader(MessageStdout, stream.requestId, length);
+        header.paddingLength = paddingLength;
+
+        buffers.push_back(boost::asio::buffer(&header, sizeof(header)));
+        buffers.push_back(boost::asio::buffer(data, length));
+        buffers.push_back(boost::asio::buffer(padding, paddingLength));
+
+        data = data + length;
     }
-    else
+
+    stream.writeDone = boost::asio::buffer_size(stream.pending[stream.pendingIndex]) == 0 &&
+            stream.pendingIndex + 1 == pendingCount &&
+            (stream.lastChunk == false || stream.fileRemaining == 0);
+
+    if( stream.writeDone && stream.lastChunk )
     {
-        boost::asio::async_write(socket, streamBuf,
-                                 boost::bind(
-                                     &FastCGIConnection::handleMessagesComplete,
-                                     this->shared_from_this(),
-                                     boost::asio::placeholders::error) );
+        FcgiHeader &header = stream.recordHeaders[records];
+        FcgiEndRequestRecord &endRequest = stream.endRequest;
+
+        header = makeHeader(MessageStdout, stream.requestId, 0);
+        endRequest.header = makeHeader(MessageEndRequest, stream.requestId,
+                                       sizeof(FcgiEndRequestBody));
+        endRequest.body.appStatusB3 = 0;
+        endRequest.body.appStatusB2 = 0;
+        endRequest.body.appStatusB1 = 0;
+        endRequest.body.appStatusB0 = 0;
+        endRequest.body.protocolStatus = FcgiRequestComplete;
+        std::fill(endRequest.body.reserved, endRequest.body.reserved + 3, 0);
+
+        buffers.push_back(boost::asio::buffer(&header, sizeof(header)));
+        buffers.push_back(boost::asio::buffer(&endRequest, sizeof(endRequest)));
     }
+
+    return records;
 }
 
+// Read the next chunk of the response file to the file buffer.
 template<typename T>
-void FastCGIConnection<T>::handleMessagesComplete(const boost::system::error_code &ec)
+bool FastCGIConnection<T>::readFile(Stream &stream)
 {
-    if( !ec )
+    size_t size = std::min<size_t>(stream.fileRemaining, fileBufferSize);
+
+    stream.fileBuffer.resize(size);
+
+    for(size_t done = 0; done < size;)
     {
-        std::ostream stream(&streamBuf);
-        {
-            FcgiHeader HeaderItem = makeHeader(MessageStdout, 0);
+        ssize_t result = stream.response.file()->read(&stream.fileBuffer[done], size - done,
+                                                      stream.fileOffset + done);
 
-            stream << HeaderItem.version << HeaderItem.type
-                   << HeaderItem.requestIdB1 << HeaderItem.requestIdB0
-                   << HeaderItem.contentLengthB1 << HeaderItem.contentLengthB0
-                   << HeaderItem.paddingLength << HeaderItem.reserved;
+        if( result <= 0 )
+        {
+            std::cerr << "FastCGI: can't read the response file" << std::endl;
+            return false;
         }
 
-        {
-            FcgiHeader HeaderItem = makeHeader(MessageStdout, 0);
+        done += result;
+    }
+
+    stream.fileOffset += size;
+    stream.fileRemaining -= size;
+    stream.pending[2] = boost::asio::buffer(stream.fileBuffer);
+
+    return true;
+}
 
-            stream << HeaderItem.version << HeaderItem.type
-                   << HeaderItem.requestIdB1 << HeaderItem.requestIdB0
-                   << HeaderItem.contentLengthB1 << HeaderItem.contentLengthB0
-                   << HeaderItem.paddingLength << HeaderItem.reserved;
+template<typename T>
+void FastCGIConnection<T>::handleWrite(const boost::system::error_code &ec)
+{
+    writeInProgress = false;
+
+    if( ec )
+    {
+        if( ec != boost::asio::error::operation_aborted )
+        {
+            std::cerr << "FastCGIConnection<T>::handleWrite error: " << ec.message() << std::endl;
+            stop();
         }
 
-        boost::asio::async_write(socket, streamBuf,
-                                 boost::bind(
-                                     &FastCGIConnection::handleComplete,
-                                     this->shared_from_this(),
-                                     boost::asio::placeholders::error) );
+        return;
     }
-    else if(ec != boost::asio::error::operation_aborted)
+
+    // The callbacks may start the next write.
+    boost::array<Stream *, maxWriteRecords> written = writing;
+    size_t count = writingCount;
+
+    writingCount = 0;
+
+    for(size_t i = 0; i < count; ++i)
     {
-        std::cerr << "FastCGIConnection<T>::handleMessagesComplete error: " << ec.message() << std::endl;
-        stop();
+        Stream &stream = *written[i];
+
+        if( stream.writeDone == false )
+        {
+            queueWrite(stream);
+        }
+        else if( stream.lastChunk )
+        {
+            completeRequest(stream);
+        }
+        else
+        {
+            boost::function<void()> callback;
+
+            callback.swap(stream.writeCallback);
+            callback();
+        }
     }
+
+    writeNext();
 }
 
 template<typename T>
-void FastCGIConnection<T>::handlePartialComplete(const boost::function<void()> &callback,
-                                                 const boost::system::error_code &ec)
+void FastCGIConnection<T>::completeRequest(Stream &stream)
 {
-    if (!ec)
+    bool keepConnection = stream.keepConnection;
+
+    releaseStream(stream);
+
+    // The other multiplexed requests are completed before the close.
+    if( keepConnection == false )
+        closeWhenIdle = true;
+
+    if( closeWhenIdle && streams.empty() )
+        stop();
+}
+
+template<typename T>
+void FastCGIConnection<T>::invokeBodyHandler(const Connection::BodyHandler &handler,
+                                             const boost::string_ref &data)
+{
+    handler(boost::system::error_code(), data);
+}
+
+// Answer the known variables of FCGI_GET_VALUES, others are skipped.
+template<typename T>
+void FastCGIConnection<T>::appendGetValuesResult(const char *data, size_t length)
+{
+    static const char maxConnsName[] = "FCGI_MAX_CONNS";
+    static const char maxReqsName[] = "FCGI_MAX_REQS";
+    static const char mpxsConnsName[] = "FCGI_MPXS_CONNS";
+
+    const unsigned char *ptr = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = ptr + length;
+    std::vector<char> result;
+    boost::string_ref name;
+    boost::string_ref value;
+
+    while( ptr != end && (ptr = nextPair(ptr, end, name, value)) != NULL )
     {
-        if( callback )
-            callback();
+        if( name == maxConnsName )
+            appendPair(result, name, boost::lexical_cast<std::string>(maxConnections));
+        else if( name == maxReqsName )
+            appendPair(result, name, boost::lexical_cast<std::string>(
+                           maxConnections * maxConnectionRequests));
+        else if( name == mpxsConnsName )
+            appendPair(result, name, "1");
     }
-    else if (ec != boost::asio::error::operation_aborted)
+
+    appendRecord(MessageGetValuesResult, 0, result.empty() ? NULL : &result[0], result.size());
+}
+
+template<typename T>
+void FastCGIConnection<T>::appendEndRequest(uint16_t requestId, FcgiProtocolStatus status)
+{
+    FcgiEndRequestBody body = {0, 0, 0, 0, static_cast<unsigned char>(status), {0, 0, 0}};
+
+    appendRecord(MessageEndRequest, requestId, reinterpret_cast<const char *>(&body), sizeof(body));
+}
+
+template<typename T>
+void FastCGIConnection<T>::appendUnknownType(unsigned char type)
+{
+    FcgiUnknownTypeBody body = {type, {0, 0, 0, 0, 0, 0, 0}};
+
+    appendRecord(MessageUnknownType, 0, reinterpret_cast<const char *>(&body), sizeof(body));
+}
+
+template<typename T>
+void FastCGIConnection<T>::appendRecord(FcgiMessageType type, uint16_t requestId,
+                                        const char *data, size_t length)
+{
+    FcgiHeader header = makeHeader(type, requestId, length);
+    const char *ptr = reinterpret_cast<const char *>(&header);
+
+    header.paddingLength = (8 - length % 8) % 8;
+
+    control.insert(control.end(), ptr, ptr + sizeof(header));
+    control.insert(control.end(), data, data + length);
+    control.insert(control.end(), header.paddingLength, 0);
+}
+
+template<typename T>
+bool FastCGIConnection<T>::Stream::parseParams()
+{
+    if( paramsBuf.empty() )
+        return true;
+
+    const unsigned char *ptr = reinterpret_cast<const unsigned char *>(&paramsBuf[0]);
+    const unsigned char *end = ptr + paramsBuf.size();
+    boost::string_ref name;
+    boost::string_ref value;
+
+    while( ptr != end )
     {
-        stop();
+        ptr = nextPair(ptr, end, name, value);
+
+        if( ptr == NULL )
+            return false;
+
+        processCgiHeader(name, value);
     }
+
+    return true;
 }
 
+// Decode the name-value pair at ptr, returns the position after it or NULL
+// if the pair is malformed.
 template<typename T>
-void FastCGIConnection<T>::handleComplete(const boost::system::error_code &ec)
+const unsigned char *FastCGIConnection<T>::nextPair(const unsigned char *ptr,
+                                                    const unsigned char *end,
+                                                    boost::string_ref &name,
+                                                    boost::string_ref &value)
 {
-    if (!ec)
+    size_t length[2];
+
+    for(int i = 0; i < 2; ++i)
     {
-        if( keepConnection == true )
+        if( ptr == end )
+            return NULL;
+
+        if( *ptr & 0x80 )
         {
-            start();
-            return;
+            if( end - ptr < 4 )
+                return NULL;
+
+            length[i] = ((ptr[0] & 0x7f) << 24) + (ptr[1] << 16)
+                    + (ptr[2] << 8) + ptr[3];
+            ptr += 4;
         }
         else
         {
-            // FIXME
-            stop();
-            // Initiate graceful connection closure.
-//            boost::system::error_code ignored_ec;
-//            socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+            length[i] = *ptr++;
         }
     }
-    else if (ec != boost::asio::error::operation_aborted)
+
+    if( length[0] + length[1] > static_cast<size_t>(end - ptr) )
+        return NULL;
+
+    const char *data = reinterpret_cast<const char *>(ptr);
+
+    name = boost::string_ref(data, length[0]);
+    value = boost::string_ref(data + length[0], length[1]);
+
+    return ptr + length[0] + length[1];
+}
+
+template<typename T>
+void FastCGIConnection<T>::appendPair(std::vector<char> &out, const boost::string_ref &name,
+                                      const boost::string_ref &value)
+{
+    const size_t length[2] = { name.size(), value.size() };
+
+    for(int i = 0; i < 2; ++i)
     {
-        stop();
+        if( length[i] < 128 )
+        {
+            out.push_back(static_cast<char>(length[i]));
+        }
+        else
+        {
+            out.push_back(static_cast<char>((length[i] >> 24) | 0x80));
+            out.push_back(static_cast<char>(length[i] >> 16));
+            out.push_back(static_cast<char>(length[i] >> 8));
+            out.push_back(static_cast<char>(length[i]));
+        }
     }
+
+    out.insert(out.end(), name.begin(), name.end());
+    out.insert(out.end(), value.begin(), value.end());
 }
 
 template<typename T>
-void FastCGIConnection<T>::processCgiHeader(const std::string &name, const std::string &value)
+void FastCGIConnection<T>::Stream::processCgiHeader(const boost::string_ref &name, const boost::string_ref &value)
 {
     if( name.empty() )
         return;
@@ -585,107 +1125,93 @@ void FastCGIConnection<T>::processCgiHeader(const std::string &name, const std::
     switch(name[0])
     {
     case 'C':
-        if( strcmp(name.c_str(), "CONTENT_LENGTH") == 0 )
+        if( name == "CONTENT_LENGTH" )
         {
-            HeaderItem h = {"Content-length", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Content-length", value);
             return;
         }
-        else if( strcmp(name.c_str(), "CONTENT_TYPE") == 0 )
+        else if( name == "CONTENT_TYPE" )
         {
-            HeaderItem h = {"Content-type", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Content-type", value);
             return;
         }
         break;
     case 'H':
-        if( strcmp(name.c_str(), "HTTP_HOST") == 0 )
+        if( name == "HTTP_HOST" )
         {
-            HeaderItem h = {"Host", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Host", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_COOKIE") == 0 )
+        else if( name == "HTTP_COOKIE" )
         {
-            HeaderItem h = {"Cookie", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Cookie", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_USER_AGENT") == 0 )
+        else if( name == "HTTP_USER_AGENT" )
         {
-            HeaderItem h = {"User-Agent", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("User-Agent", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_IF_MODIFIED_SINCE") == 0 )
+        else if( name == "HTTP_IF_MODIFIED_SINCE" )
         {
-            HeaderItem h = {"If-Modified-Since", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("If-Modified-Since", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_IF_MATCH") == 0 )
+        else if( name == "HTTP_IF_MATCH" )
         {
-            HeaderItem h = {"If-Match", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("If-Match", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_IF_NONE_MATCH") == 0 )
+        else if( name == "HTTP_IF_NONE_MATCH" )
         {
-            HeaderItem h = {"If-None-Match", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("If-None-Match", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_ACCEPT") == 0 )
+        else if( name == "HTTP_ACCEPT" )
         {
-            HeaderItem h = {"Accept", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Accept", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_ACCEPT_ENCODING") == 0 )
+        else if( name == "HTTP_ACCEPT_ENCODING" )
         {
-            HeaderItem h = {"Accept-Encoding", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Accept-Encoding", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_ACCEPT_LANGUAGE") == 0 )
+        else if( name == "HTTP_ACCEPT_LANGUAGE" )
         {
-            HeaderItem h = {"Accept-Language", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Accept-Language", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_ACCEPT_CHARSET") == 0 )
+        else if( name == "HTTP_ACCEPT_CHARSET" )
         {
-            HeaderItem h = {"Accept-Charset", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("Accept-Charset", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_X_REQUESTED_WITH") == 0 )
+        else if( name == "HTTP_X_REQUESTED_WITH" )
         {
-            HeaderItem h = {"X-Requested-With", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("X-Requested-With", value);
             return;
         }
-        else if( strcmp(name.c_str(), "HTTP_USER_AGENT") == 0 )
+        else if( name == "HTTP_USER_AGENT" )
         {
-            HeaderItem h = {"User-Agent", value};
-            requestImpl.headers.push_back(h);
+            requestImpl.addHeader("User-Agent", value);
             return;
         }
         break;
     case 'R':
-        if( strcmp(name.c_str(), "REQUEST_METHOD") == 0 )
+        if( name == "REQUEST_METHOD" )
         {
             requestImpl.method = value;
             return;
         }
-        else if( strcmp(name.c_str(), "REQUEST_URI") == 0 )
+        else if( name == "REQUEST_URI" )
         {
             requestImpl.uri = value;
             return;
         }
         break;
     case 'Q':
-        if( strcmp(name.c_str(), "QUERY_STRING") == 0 )
+        if( name == "QUERY_STRING" )
         {
             return;
         }
@@ -693,7 +1219,7 @@ void FastCGIConnection<T>::processCgiHeader(const std::string &name, const std::
 }
 
 template<typename T>
-typename FastCGIConnection<T>::FcgiHeader FastCGIConnection<T>::makeHeader(FcgiMessageType type, uint16_t length) const
+typename FastCGIConnection<T>::FcgiHeader FastCGIConnection<T>::makeHeader(FcgiMessageType type, uint16_t requestId, uint16_t length)
 {
     FcgiHeader result;
 
@@ -3,16 +3,62 @@
  * License: MIT
  */
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/asio/io_service.hpp>
+#ifndef WIN32
+#include <hserv/listeners.h>
+#endif
+#include <hserv/impl/connectionpool.h>
 #include <hserv/impl/fastcgiconnection.h>
 
 namespace hserv {
 
 class FastCgiServerImpl {
 public:
+    virtual ~FastCgiServerImpl() {}
     virtual void run() = 0;
     virtual void stop() = 0;
+    virtual ConnectionPoolStats connectionPoolStats() const = 0;
+};
+
+// Accepted connections of the FastCGI servers, closed ones are reused.
+template<typename Connection>
+class FastCgiConnections
+{
+public:
+    FastCgiConnections(boost::asio::io_service &ioService,
+                       const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : ioService(ioService), callback(callback), pool(new ConnectionPool<Connection>(poolSize))
+    {
+    }
+
+    ~FastCgiConnections()
+    {
+        pool->close();
+    }
+
+    boost::shared_ptr<Connection> create()
+    {
+        Connection *connection = pool->take();
+
+        if( connection == NULL )
+            connection = new Connection(ioService, callback);
+
+        return pool->manage(connection);
+    }
+
+    ConnectionPoolStats stats() const
+    {
+        return pool->stats();
+    }
+
+private:
+    enum { poolSize = 256 };
+
+    boost::asio::io_service &ioService;
+    boost::function<void(const boost::shared_ptr<Context> &)> callback;
+    boost::shared_ptr< ConnectionPool<Connection> > pool;
 };
 
 class FastCgiNetworkServerImpl : public FastCgiServerImpl {
@@ -22,29 +68,62 @@ public:
     FastCgiNetworkServerImpl(boost::asio::io_service &ioService,
                              const std::string &address, int port,
                              const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-        : listenAddress(address), listenPort(port), ioService(ioService), acceptor(ioService),
-          callback(callback)
+        : listenAddress(address), listenPort(port), listenFd(-1), ioService(ioService),
+          acceptor(ioService), callback(callback), connections(ioService, callback)
     {
     }
 
+    // With an own io_service, run() blocks.
+    FastCgiNetworkServerImpl(const std::string &address, int port,
+                             const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenAddress(address), listenPort(port), listenFd(-1),
+          ownIoService(new boost::asio::io_service), ioService(*ownIoService),
+          acceptor(ioService), callback(callback), connections(ioService, callback)
+    {
+    }
+
+#ifndef WIN32
+    // Serve an open listening socket with an own io_service, the server owns the socket.
+    FastCgiNetworkServerImpl(int listenFd,
+                             const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenPort(0), listenFd(listenFd),
+          ownIoService(new boost::asio::io_service), ioService(*ownIoService),
+          acceptor(ioService), callback(callback), connections(ioService, callback)
+    {
+    }
+#endif
+
     void run()
     {
-        newConnection.reset(new ConnectionType(ioService, callback));
+        prepareConnection();
 
-        boost::asio::ip::tcp::resolver resolver(ioService);
-        boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+#ifndef WIN32
+        if( listenFd >= 0 )
+        {
+            acceptor.assign(Listeners::tcpProtocol(listenFd), listenFd);
+        }
+        else
+#endif
+        {
+            boost::asio::ip::tcp::resolver resolver(ioService);
+            boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
+            boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
 
-        endpoint.port(listenPort);
-        acceptor.open(endpoint.protocol());
+            endpoint.port(listenPort);
+            acceptor.open(endpoint.protocol());
 #ifndef WIN32
-        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
 #endif
-        acceptor.bind(endpoint);
-        acceptor.listen();
+            acceptor.bind(endpoint);
+            acceptor.listen();
+        }
+
         acceptor.async_accept(newConnection->getSocket(),
                               boost::bind(&FastCgiNetworkServerImpl::handleAccept, this,
                                           boost::asio::placeholders::error));
+
+        if( ownIoService )
+            ioService.run();
     }
 
     void stop()
@@ -52,13 +131,18 @@ public:
         ioService.post(boost::bind(&FastCgiNetworkServerImpl::handleStop, this));
     }
 
+    ConnectionPoolStats connectionPoolStats() const
+    {
+        return connections.stats();
+    }
+
 protected:
     void handleAccept(const boost::system::error_code &ec)
     {
         if( !ec )
         {
             newConnection->start();
-            newConnection.reset(new ConnectionType(ioService, callback));
+            prepareConnection();
             acceptor.async_accept(newConnection->getSocket(),
                                    boost::bind(&FastCgiNetworkServerImpl::handleAccept, this,
                                                boost::asio::placeholders::error));
@@ -71,9 +155,17 @@ protected:
         ioService.stop();
     }
 
+    void prepareConnection()
+    {
+        newConnection = connections.create();
+    }
+
 private:
     std::string listenAddress;
     int listenPort;
+    int listenFd;
+
+    boost::scoped_ptr<boost::asio::io_service> ownIoService;
 
     // The io_service used to perform asynchronous operations.
     boost::asio::io_service &ioService;
@@ -84,6 +176,8 @@ private:
     // The handler for all incoming requests.
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
 
+    FastCgiConnections<ConnectionType> connections;
+
     // The next connection to be accepted.
     boost::shared_ptr<ConnectionType> newConnection;
 };
@@ -92,16 +186,20 @@ class FastCgiStdioServerImpl : public FastCgiServerImpl {
 public:
     typedef FastCGIConnection<boost::asio::local::stream_protocol::socket> ConnectionType;
 
-    FastCgiStdioServerImpl(const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-        : ioService(), acceptor(ioService), callback(callback)
+    // The web server passes the listening socket as the standard input,
+    // an inherited Unix socket may be given instead.
+    explicit FastCgiStdioServerImpl(const boost::function<void(const boost::shared_ptr<Context> &)> &callback,
+                                    int listenFd = 0)
+        : listenFd(listenFd), ioService(), acceptor(ioService), callback(callback),
+          connections(ioService, callback)
     {
     }
 
     void run()
     {
-        newConnection.reset(new ConnectionType(ioService, callback));
+        prepareConnection();
 
-        acceptor.assign(boost::asio::local::stream_protocol(), 0);
+        acceptor.assign(boost::asio::local::stream_protocol(), listenFd);
         acceptor.listen();
         acceptor.async_accept(newConnection->getSocket(),
                               boost::bind(&FastCgiStdioServerImpl::handleAccept, this,
@@ -116,13 +214,18 @@ public:
         ioService.post(boost::bind(&FastCgiStdioServerImpl::handleStop, this));
     }
 
+    ConnectionPoolStats connectionPoolStats() const
+    {
+        return connections.stats();
+    }
+
 protected:
     void handleAccept(const boost::system::error_code &ec)
     {
         if( !ec )
         {
             newConnection->start();
-            newConnection.reset(new ConnectionType(ioService, callback));
+            prepareConnection();
             acceptor.async_accept(newConnection->getSocket(),
                                    boost::bind(&FastCgiStdioServerImpl::handleAccept, this,
                                                boost::asio::placeholders::error));
@@ -135,10 +238,17 @@ protected:
         ioService.stop();
     }
 
+    void prepareConnection()
+    {
+        newConnection = connections.create();
+    }
+
 private:
+    int listenFd;
     boost::asio::io_service ioService;
     boost::asio::local::stream_protocol::acceptor acceptor;
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
+    FastCgiConnections<ConnectionType> connections;
     boost::shared_ptr<ConnectionType> newConnection;
 };
 
@@ -149,13 +259,14 @@ public:
 
     FastCgiUnixSocketServerImpl(const std::string &endpoint,
                                 const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-        : ioService(), acceptor(ioService, boost::asio::local::stream_protocol::endpoint(endpoint)), callback(callback)
+        : ioService(), acceptor(ioService, boost::asio::local::stream_protocol::endpoint(endpoint)),
+          callback(callback), connections(ioService, callback)
     {
     }
 
     void run()
     {
-        newConnection.reset(new ConnectionType(ioService, callback));
+        prepareConnection();
 
         ::unlink( endpoint.c_str() );
         boost::asio::local::datagram_protocol::endpoint ep(endpoint);
@@ -172,13 +283,18 @@ public:
         ioService.post(boost::bind(&FastCgiUnixSocketServerImpl::handleStop, this));
     }
 
+    ConnectionPoolStats connectionPoolStats() const
+    {
+        return connections.stats();
+    }
+
 protected:
     void handleAccept(const boost::system::error_code &ec)
     {
         if( !ec )
         {
             newConnection->start();
-            newConnection.reset(new ConnectionType(ioService, callback));
+            prepareConnection();
             acceptor.async_accept(newConnection->getSocket(),
                                    boost::bind(&FastCgiUnixSocketServerImpl::handleAccept, this,
                                                boost::asio::placeholders::error));
@@ -191,11 +307,17 @@ protected:
         ioService.stop();
     }
 
+    void prepareConnection()
+    {
+        newConnection = connections.create();
+    }
+
 private:
     boost::asio::io_service ioService;
     boost::asio::local::stream_protocol::acceptor acceptor;
     std::string endpoint;
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
+    FastCgiConnections<ConnectionType> connections;
     boost::shared_ptr<ConnectionType> newConnection;
 };
 
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_HANDLERMEMORY_H
+#define HSERV_HANDLERMEMORY_H
+
+#include <cstddef>
+#include <new>
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/asio/handler_alloc_hook.hpp>
+#include <boost/asio/handler_continuation_hook.hpp>
+#include <boost/asio/handler_invoke_hook.hpp>
+
+namespace hserv {
+
+// Memory for a chain of asynchronous operations of a connection, like the
+// reads of the records, one operation of the chain is pending at a time.
+// asio recycles one block of up to 1 KB per thread, so with a read and a
+// write in flight, or with a larger operation, every operation would allocate.
+// Larger operations than Size fall back to operator new.
+template<size_t Size>
+class HandlerMemory : private boost::noncopyable
+{
+public:
+    HandlerMemory()
+        : inUse(false)
+    {
+    }
+
+    void *allocate(size_t size)
+    {
+        if( inUse == false && size <= sizeof(storage) )
+        {
+            inUse = true;
+            return &storage;
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void *ptr)
+    {
+        if( ptr == &storage )
+            inUse = false;
+        else
+            ::operator delete(ptr);
+    }
+
+private:
+    typename boost::aligned_storage<Size>::type storage;
+    bool inUse;
+};
+
+// The handler wrapper which allocates the operations from HandlerMemory.
+template<typename Memory, typename Handler>
+class MemoryHandler
+{
+public:
+    MemoryHandler(Memory &memory, const Handler &handler)
+        : memory(&memory), handler(handler)
+    {
+    }
+
+    void operator()()
+    {
+        handler();
+    }
+
+    template<typename Arg1>
+    void operator()(const Arg1 &arg1)
+    {
+        handler(arg1);
+    }
+
+    template<typename Arg1, typename Arg2>
+    void operator()(const Arg1 &arg1, const Arg2 &arg2)
+    {
+        handler(arg1, arg2);
+    }
+
+    friend void *asio_handler_allocate(size_t size, MemoryHandler *self)
+    {
+        return self->memory->allocate(size);
+    }
+
+    friend void asio_handler_deallocate(void *ptr, size_t, MemoryHandler *self)
+    {
+        self->memory->deallocate(ptr);
+    }
+
+    friend bool asio_handler_is_continuation(MemoryHandler *self)
+    {
+        using boost::asio::asio_handler_is_continuation;
+        return asio_handler_is_continuation(&self->handler);
+    }
+
+    template<typename Function>
+    friend void asio_handler_invoke(Function &function, MemoryHandler *self)
+    {
+        using boost::asio::asio_handler_invoke;
+        asio_handler_invoke(function, &self->handler);
+    }
+
+    template<typename Function>
+    friend void asio_handler_invoke(const Function &function, MemoryHandler *self)
+    {
+        using boost::asio::asio_handler_invoke;
+        asio_handler_invoke(function, &self->handler);
+    }
+
+private:
+    Memory *memory;
+    Handler handler;
+};
+
+template<typename Memory, typename Handler>
+inline MemoryHandler<Memory, Handler> makeMemoryHandler(Memory &memory, const Handler &handler)
+{
+    return MemoryHandler<Memory, Handler>(memory, handler);
+}
+
+} // namespace hserv
+
+#endif // HSERV_HANDLERMEMORY_H
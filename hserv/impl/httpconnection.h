@@ -6,16 +6,31 @@
 #ifndef HSERV_HTTPCONNECTION_H
 #define HSERV_HTTPCONNECTION_H
 
-#include <boost/array.hpp>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/mpl/bool.hpp>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <hserv/metrics.h>
 #include <hserv/response.h>
 #include <hserv/request.h>
+#include <hserv/requestlog.h>
+#include <hserv/serversettings.h>
+#include <hserv/impl/bufferlist.h>
+#include <hserv/impl/connectionlist.h>
+#include <hserv/impl/dateservice.h>
+#include <hserv/impl/loadlimiter.h>
 #include <hserv/impl/requestparser.h>
+#include <hserv/impl/timerwheel.h>
 #include <hserv/impl/connection.h>
 #include <hserv/context.h>
 
@@ -23,38 +38,86 @@ namespace hserv {
 
 template<typename T, typename CloseSocket, typename ShutdownSocket>
 class HttpConnection: public boost::enable_shared_from_this< HttpConnection<T,CloseSocket,ShutdownSocket> >,
-        public Connection
+        public Connection,
+        public ConnectionList< HttpConnection<T,CloseSocket,ShutdownSocket> >::Hook
 {
 public:
     typedef T Socket;
 
     HttpConnection(boost::asio::io_service &io_service, const boost::shared_ptr<T> &socket,
-                   boost::function<void(const boost::shared_ptr<Context> &)> callback)
-        : Connection(), io_service(io_service), firstChunk(true), closeConnection(false),
-          socket(socket), callback(callback), request(requestImpl)
+                   boost::function<void(const boost::shared_ptr<Context> &)> callback,
+                   const boost::shared_ptr<const ServerSettings> &settings,
+                   const boost::shared_ptr<LoadLimiter> &limiter)
+        : Connection(), io_service(io_service), settings(settings), limiter(limiter),
+          dateService(boost::asio::use_service<DateService>(io_service)),
+          timerWheel(boost::asio::use_service<TimerWheel>(io_service)),
+          timeout(boost::bind(&HttpConnection::handleTimeout, this)),
+          keepAliveWait(false), timedOut(false), open(false), rejectRequests(false), inFlight(false),
+          firstChunk(true), chunked(false), closeConnection(false),
+          bodyStreaming(false), bodyCompleted(false), bodyDelivered(false),
+          socket(socket), callback(callback), buffer(initialBufferSize), bufferSize(0),
+          fileOffset(0), fileRemaining(0), responseBytes(0), requestsServed(0), request(requestImpl)
     {
+        output.reserve(initialOutputSize);
+        context.reset( new Context(io_service, *this, request, response) );
     }
 
     ~HttpConnection()
     {
+        release();
+    }
+
+    // The server accepted a client: the connection is counted until it is
+    // recycled. The requests of a rejected connection get 503.
+    void accepted(bool reject)
+    {
+        open = true;
+        rejectRequests = reject;
+
+        if( settings->metrics )
+            settings->metrics->connectionAccepted();
     }
 
     virtual void start()
     {
         try
         {
-            requestImpl = RequestImpl();
+            // Drop the completed request, pipelined bytes are kept for the next one.
+            size_t consumed = requestParser.consumed();
+
+            if( consumed > 0 )
+            {
+                std::copy(buffer.begin() + consumed, buffer.begin() + bufferSize, buffer.begin());
+                bufferSize -= consumed;
+            }
+
+            // A pipelined request has started already.
+            if( bufferSize > 0 && timed() )
+                requestStart = TimerWheel::Clock::now();
+
+            requestImpl.reset();
             // FIXME - SSL
             // requestImpl.endpoint = socket->remote_endpoint();
-            response = Response();
-            context.reset( new Context(io_service, *this, request, response) );
+            requestParser.reset();
+            requestParser.setStreamBody(settings->streamRequestBody);
+            response.reset();
             firstChunk = true;
+            chunked = false;
+            bodyStreaming = false;
+            bodyCompleted = false;
+            bodyDelivered = false;
+            bodyHandler.clear();
+            responseBytes = 0;
+            handlerStart = writeStart = TimerWheel::Clock::time_point();
 
-            socket->async_read_some(boost::asio::buffer(buffer),
-                                    boost::bind(&HttpConnection::handleRead,
-                                                this->shared_from_this(),
-                                                boost::asio::placeholders::error,
-                                                boost::asio::placeholders::bytes_transferred));
+            // An idle keep-alive connection waits for the next request.
+            keepAliveWait = keepAliveWait && bufferSize == 0;
+            setTimeout(keepAliveWait ? settings->keepAliveTimeout : settings->headerTimeout);
+
+            if( bufferSize > 0 )
+                processInput();
+            else
+                readMore();
         }
         catch(std::exception &e)
         {
@@ -68,111 +131,487 @@ public:
         fnc(socket);
     }
 
-    virtual void writeResponse()
+    // The server is draining: an idle connection, a keep-alive one or a new
+    // one which has not sent anything yet, is closed now, the others after
+    // the current response.
+    void drain()
     {
-        typedef std::vector<boost::asio::const_buffer> Buffers;
-        Buffers buffers;
-        static const char crlf[] = {'\r', '\n'};
+        if( bufferSize == 0 && inFlight == false )
+        {
+            timeout.cancel();
+            stop();
+        }
+    }
+
+    // Limit the time of the TLS handshake, start() sets the next timeout.
+    void startHandshakeTimeout()
+    {
+        setTimeout(settings->headerTimeout);
+    }
 
-        if( firstChunk == true && requestImpl.versionMajor == 1 ) {
-            Buffers status = response.statusBuffers(requestImpl.versionMajor,
-                                                    requestImpl.versionMinor);
+    const boost::shared_ptr<T> &getSocket() const
+    {
+        return socket;
+    }
 
-            if( requestImpl.versionMajor == 1 && requestImpl.versionMinor == 0 &&
-                    requestImpl.keepAlive )
-            {
-                std::string connection = response.header("Connection");
+    // A pooled connection gets the socket of the next client.
+    void setSocket(const boost::shared_ptr<T> &newSocket)
+    {
+        socket = newSocket;
+    }
 
-                if( connection.empty() )
-                    response.addHeader("Connection", "Keep-Alive");
-                else
-                    closeConnection = strcasecmp(connection.c_str(), "close") == 0;
-            }
+    // Called by the connection pool: close the socket and drop the state of
+    // the last client. The buffers are kept unless they grew large.
+    void recycle()
+    {
+        try
+        {
+            CloseSocket fnc;
+            fnc(socket);
+        }
+        catch(std::exception &)
+        {
+        }
+
+        release();
+        timeout.cancel();
+        keepAliveWait = false;
+        timedOut = false;
+        requestImpl.reset();
+        requestParser.reset();
+        response.reset();
+        bufferSize = 0;
+        output.clear();
+        closeConnection = false;
+        bodyHandler.clear();
+        fileOffset = 0;
+        fileRemaining = 0;
+        requestsServed = 0;
 
-            Buffers headers = response.headerBuffers();
+        if( buffer.size() > initialBufferSize )
+            std::vector<char>(initialBufferSize).swap(buffer);
 
-            buffers.reserve( status.size() + headers.size() );
-            buffers.assign( status.begin(), status.end() );
-            buffers.insert( buffers.end(), headers.begin(), headers.end() );
-            buffers.push_back( boost::asio::buffer(crlf) );
+        if( output.capacity() > maxPendingOutput )
+        {
+            std::vector<char>().swap(output);
+            output.reserve(initialOutputSize);
+        }
+    }
 
-            firstChunk = false;
+    virtual void writeResponse()
+    {
+        bool withFile = response.fileLength() != 0;
+
+        finishRequest();
+        responseBytes += response.contentSize() + response.fileLength();
+
+        if( firstChunk == true )
+        {
+            responseStarted();
+            serializeHeaders(true);
         }
 
+        bool chunkData = serializeChunkSize(withFile);
         const std::vector<char> &content = response.content();
+        Buffers buffers;
+
+        // More requests are waiting in the buffer: keep the response and
+        // send it together with the next ones.
+        if( pipelined() && closeConnection == false && requestImpl.keepAlive == true &&
+                withFile == false &&
+                output.size() + content.size() + maxTailSize <= maxPendingOutput )
+        {
+            output.insert(output.end(), content.begin(), content.end());
+            tailBuffers(buffers, chunkData, true);
+
+            for(Buffers::const_iterator it = buffers.begin(); it != buffers.end(); ++it)
+            {
+                const char *ptr = boost::asio::buffer_cast<const char *>(*it);
+                output.insert(output.end(), ptr, ptr + boost::asio::buffer_size(*it));
+            }
 
+            completeRequest();
+            io_service.post(boost::bind(&HttpConnection::start, this->shared_from_this()));
+            return;
+        }
+
+        buffers.push_back( boost::asio::buffer(output) );
         buffers.push_back( boost::asio::buffer(content) );
 
+        if( withFile )
+        {
+            fileOffset = response.fileOffset();
+            fileRemaining = response.fileLength();
+
+            boost::asio::async_write(*socket.get(),
+                                     buffers,
+                                     WriteProgress(*this),
+                                     boost::bind(
+                                         &HttpConnection::handleFileWrite,
+                                         this->shared_from_this(),
+                                         boost::asio::placeholders::error,
+                                         boost::asio::placeholders::bytes_transferred) );
+            return;
+        }
+
+        tailBuffers(buffers, chunkData, true);
+
         boost::asio::async_write(*socket.get(),
                                  buffers,
+                                 WriteProgress(*this),
                                  boost::bind(
-                                     &HttpConnection::handleComplete,
+                                     &HttpConnection::handleWriteComplete,
                                      this->shared_from_this(),
-                                     boost::asio::placeholders::error) );
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred) );
     }
 
     virtual void writeResponsePartial(const boost::function<void()> &callback)
     {
-        typedef std::vector<boost::asio::const_buffer> Buffers;
+        if( firstChunk == true )
+        {
+            responseStarted();
+            serializeHeaders(false);
+        }
+
+        bool chunkData = serializeChunkSize(false);
         Buffers buffers;
+
+        responseBytes += response.contentSize();
+        buffers.push_back( boost::asio::buffer(output) );
+        buffers.push_back( boost::asio::buffer(response.content()) );
+        tailBuffers(buffers, chunkData, false);
+
+        boost::asio::async_write(*socket.get(),
+                                 buffers,
+                                 WriteProgress(*this),
+                                 boost::bind(
+                                     &HttpConnection::handlePartialComplete,
+                                     this->shared_from_this(),
+                                     callback,
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred) );
+    }
+
+    virtual void readBody(const BodyHandler &handler)
+    {
+        if( bodyStreaming == false )
+        {
+            // The whole body is in the buffer already.
+            boost::string_ref data = bodyDelivered ? boost::string_ref() : requestImpl.postData;
+
+            bodyDelivered = true;
+            io_service.post(boost::bind(&HttpConnection::invokeBodyHandler,
+                                        this->shared_from_this(),
+                                        handler, boost::system::error_code(), data));
+            return;
+        }
+
+        // The previous fragment is not used anymore, reuse its space.
+        bodyHandler = handler;
+        bufferSize = requestParser.discardBody(&buffer[0], bufferSize);
+        requestImpl.postData = boost::string_ref();
+
+        if( bodyCompleted )
+            deliverBody(boost::system::error_code());
+        else
+            processBody();
+    }
+
+protected:
+    // The output buffer, the content and the tail of a chunk.
+    typedef BufferList<3> Buffers;
+
+    enum {
+        // Up to this amount of pipelined responses is sent in one write.
+        maxPendingOutput = 65536,
+        // CRLF after the chunk data and the last chunk.
+        maxTailSize = 7
+    };
+
+    // Render the status line and the headers to the output buffer.
+    //
+    // The last chunk means the whole response is known, otherwise the response
+    // is streamed and without Content-Length uses chunked encoding (HTTP/1.1)
+    // or closing of the connection (HTTP/1.0).
+    void serializeHeaders(bool lastChunk)
+    {
         static const char crlf[] = {'\r', '\n'};
 
-        if( firstChunk == true && requestImpl.versionMajor == 1 ) {
-            Buffers status = response.statusBuffers(requestImpl.versionMajor,
-                                                    requestImpl.versionMinor);
+        firstChunk = false;
 
-            if( requestImpl.versionMajor == 1 && requestImpl.versionMinor == 0 &&
-                    requestImpl.keepAlive )
-            {
-                std::string connection = response.header("Connection");
+        if( requestImpl.versionMajor != 1 )
+            return;
 
-                if( connection.empty() )
-                    response.addHeader("Connection", "Keep-Alive");
-                else
-                    closeConnection = strcasecmp(connection.c_str(), "close") == 0;
+        if( bodyStreaming && bodyCompleted == false )
+        {
+            // The rest of the request body is not read, the connection can not be reused.
+            closeConnection = true;
+            response.addHeader("Connection", "close");
+        }
+        else if( limiter->draining() && requestImpl.keepAlive )
+        {
+            // The server is stopping, the client must not send more requests.
+            closeConnection = true;
+            response.addHeader("Connection", "close");
+        }
+
+        if( lastChunk == false && response.hasHeader("Content-Length") == false )
+        {
+            if( requestImpl.versionMinor == 0 )
+            {
+                closeConnection = true;
+            }
+            else
+            {
+                chunked = true;
+                response.addHeader("Transfer-Encoding", "chunked");
             }
+        }
+
+        if( requestImpl.versionMajor == 1 && requestImpl.versionMinor == 0 &&
+                requestImpl.keepAlive && closeConnection == false )
+        {
+            boost::string_ref connection = response.header("Connection");
+
+            if( connection.empty() )
+                response.addHeader("Connection", "Keep-Alive");
+            else
+                closeConnection = equalsIgnoreCase(connection, "close");
+        }
 
-            Buffers headers = response.headerBuffers();
+        response.serializeStatus(requestImpl.versionMajor, requestImpl.versionMinor, output);
 
-            buffers.reserve( status.size() + headers.size() );
-            buffers.assign( status.begin(), status.end() );
-            buffers.insert( buffers.end(), headers.begin(), headers.end() );
-            buffers.push_back( boost::asio::buffer(crlf) );
+        if( response.hasHeader("Date") == false )
+        {
+            size_t offset = output.size();
 
-            firstChunk = false;
+            output.resize(offset + DateService::dateHeaderSize);
+            dateService.copyDateHeader(&output[offset]);
         }
 
-        const std::vector<char> &content = response.content();
+        if( response.hasHeader("Server") == false )
+        {
+            const char *server = DateService::serverHeader();
+            output.insert(output.end(), server, server + DateService::serverHeaderSize());
+        }
 
-        buffers.push_back( boost::asio::buffer(content) );
+        response.serializeHeaders(output);
+        output.insert(output.end(), crlf, crlf + sizeof(crlf));
+    }
+
+    // In the chunked mode render the size of the chunk to the output buffer,
+    // the content and the file follow it. Returns true if the chunk is started.
+    bool serializeChunkSize(bool withFile)
+    {
+        size_t size = response.contentSize() + (withFile ? response.fileLength() : 0);
+
+        // the empty chunk is the last one, skip it
+        if( chunked == false || size == 0 )
+            return false;
+
+        char chunkHeader[20];
+        int headerSize = snprintf(chunkHeader, sizeof(chunkHeader), "%lx\r\n",
+                                  static_cast<unsigned long>(size));
+
+        output.insert(output.end(), chunkHeader, chunkHeader + headerSize);
+        return true;
+    }
+
+    // CRLF after the chunk data and the last chunk, if any.
+    void tailBuffers(Buffers &buffers, bool chunkData, bool lastChunk)
+    {
+        static const char tail[] = {'\r', '\n', '0', '\r', '\n', '\r', '\n'};
+
+        if( chunked == false )
+            return;
+
+        const char *begin = chunkData ? tail : tail + 2;
+        const char *end = lastChunk ? tail + sizeof(tail) : tail + 2;
+
+        buffers.push_back( boost::asio::buffer(begin, end - begin) );
+    }
+
+    // Send the file of the response, then complete the response.
+    // Plain TCP on Linux uses sendfile(), other sockets read the file to a buffer.
+#ifdef __linux__
+    void writeFile(boost::asio::ip::tcp::socket &sock)
+    {
+        // Other connections are served after this amount of data.
+        size_t quota = maxFileWriteSize;
+        boost::system::error_code ec;
 
+        if( sock.native_non_blocking() == false )
+            sock.native_non_blocking(true, ec);
 
+        while( fileRemaining != 0 && quota != 0 && !ec )
+        {
+            off_t offset = fileOffset;
+            ssize_t result = ::sendfile(sock.native_handle(), response.file()->fd(),
+                                        &offset, std::min(fileRemaining, quota));
+
+            if( result > 0 )
+            {
+                fileOffset = offset;
+                fileRemaining -= result;
+                quota -= result;
+                countSent(result);
+            }
+            else if( result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            {
+                break;
+            }
+            else if( result < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            else
+            {
+                // the file is truncated or a write error
+                ec = boost::system::error_code(result < 0 ? errno : EIO,
+                                               boost::system::system_category());
+            }
+        }
+
+        if( ec )
+            stop();
+        else if( fileRemaining == 0 )
+            fileComplete();
+        else
+        {
+            setTimeout(settings->writeTimeout);
+            sock.async_wait(boost::asio::ip::tcp::socket::wait_write,
+                            boost::bind(&HttpConnection::handleFileWrite,
+                                        this->shared_from_this(),
+                                        boost::asio::placeholders::error, 0));
+        }
+    }
+#endif
+
+    template<typename Sock>
+    void writeFile(Sock &)
+    {
+        fileBuffer.resize(std::min(fileRemaining, static_cast<size_t>(fileBufferSize)));
+
+        ssize_t result = response.file()->read(&fileBuffer[0], fileBuffer.size(), fileOffset);
+
+        if( result <= 0 )
+        {
+            stop();
+            return;
+        }
+
+        fileOffset += result;
+        fileRemaining -= result;
 
         boost::asio::async_write(*socket.get(),
-                                 buffers,
+                                 boost::asio::buffer(&fileBuffer[0], result),
+                                 WriteProgress(*this),
                                  boost::bind(
-                                     &HttpConnection::handlePartialComplete,
+                                     &HttpConnection::handleFileWrite,
                                      this->shared_from_this(),
-                                     callback,
-                                     boost::asio::placeholders::error) );
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred) );
     }
 
-protected:
+    // sendfile() counts its bytes, its waits pass zero.
+    void handleFileWrite(const boost::system::error_code &ec, size_t bytesTransferred)
+    {
+        countSent(bytesTransferred);
+
+        if( !ec )
+        {
+            if( fileRemaining != 0 )
+                writeFile(*socket.get());
+            else
+                fileComplete();
+        }
+        else if( ec != boost::asio::error::operation_aborted )
+        {
+            stop();
+        }
+    }
+
+    void fileComplete()
+    {
+        Buffers buffers;
+
+        std::vector<char>().swap(fileBuffer);
+        tailBuffers(buffers, true, true);
+
+        if( buffers.empty() )
+        {
+            handleComplete(boost::system::error_code());
+        }
+        else
+        {
+            boost::asio::async_write(*socket.get(),
+                                     buffers,
+                                     WriteProgress(*this),
+                                     boost::bind(
+                                         &HttpConnection::handleWriteComplete,
+                                         this->shared_from_this(),
+                                         boost::asio::placeholders::error,
+                                         boost::asio::placeholders::bytes_transferred) );
+        }
+    }
+
+    // The completion condition of the writes: the data is written in pieces
+    // and the timeout is restarted after each one, so it limits the time
+    // without progress, not the time of the whole write.
+    class WriteProgress
+    {
+    public:
+        explicit WriteProgress(HttpConnection &connection)
+            : connection(&connection)
+        {
+        }
+
+        size_t operator()(const boost::system::error_code &ec, size_t)
+        {
+            if( ec )
+                return 0;
+
+            connection->setTimeout(connection->settings->writeTimeout);
+            return maxWriteSize;
+        }
+
+    private:
+        HttpConnection *connection;
+    };
+
+    // The buffer contains bytes of the next request.
+    bool pipelined() const
+    {
+        return bufferSize > requestParser.consumed();
+    }
+
+    void handleWriteComplete(const boost::system::error_code &ec, size_t bytesTransferred)
+    {
+        countSent(bytesTransferred);
+        handleComplete(ec);
+    }
 
     // Handle completion of a write operation.
     void handleComplete(const boost::system::error_code &ec)
     {
         if( !ec )
         {
-            if( closeConnection == false && requestImpl.keepAlive == true )
+            output.clear();
+            completeRequest();
+
+            if( closeConnection == false && requestImpl.keepAlive == true &&
+                    limiter->draining() == false )
             {
-                requestParser = RequestParser();
+                keepAliveWait = true;
                 start();
 
                 return;
             }
             else
             {
+                timeout.cancel();
+
                 // Initiate graceful connection closure.
                 ShutdownSocket fnc;
                 fnc(socket);
@@ -185,10 +624,14 @@ protected:
     }
 
     void handlePartialComplete(const boost::function<void()> &callback,
-                               const boost::system::error_code &ec)
+                               const boost::system::error_code &ec, size_t bytesTransferred)
     {
+        countSent(bytesTransferred);
+
         if( !ec )
         {
+            timeout.cancel();
+            output.clear();
             response.setContent(std::vector<char>());
 
             if( callback )
@@ -200,57 +643,501 @@ protected:
         }
     }
 
+    // Read more data of the current request, the buffer grows if the request
+    // does not fit into it.
+    void readMore()
+    {
+        if( bufferSize == buffer.size() )
+            buffer.resize(buffer.size() * 2);
+
+        socket->async_read_some(boost::asio::buffer(&buffer[bufferSize],
+                                                    buffer.size() - bufferSize),
+                                boost::bind(&HttpConnection::handleRead,
+                                            this->shared_from_this(),
+                                            boost::asio::placeholders::error,
+                                            boost::asio::placeholders::bytes_transferred));
+    }
+
     // Handle completion of a read operation.
     void handleRead(const boost::system::error_code &ec,
                     std::size_t bytes_transferred)
     {
         if( !ec )
         {
-            RequestParser::ParseState state = requestParser.parse(
-                        requestImpl, buffer.data(), buffer.data() + bytes_transferred);
+            if( bufferSize == 0 && timed() )
+                requestStart = TimerWheel::Clock::now();
+
+            if( settings->metrics )
+                settings->metrics->received(bytes_transferred);
 
-            if( state ==  RequestParser::CompletedState )
+            bufferSize += bytes_transferred;
+
+            // The headers must be completed in time since their first byte.
+            if( keepAliveWait )
             {
-                assert( callback.empty() == false );
-                callback(context);
+                keepAliveWait = false;
+                setTimeout(settings->headerTimeout);
             }
-            else if( state ==  RequestParser::ErrorState )
+
+            processInput();
+        }
+        else if( ec != boost::asio::error::operation_aborted )
+        {
+            stop();
+        }
+    }
+
+    void processInput()
+    {
+        RequestParser::ParseState state = requestParser.parse(
+                    requestImpl, &buffer[0], bufferSize);
+
+        if( state != RequestParser::ErrorState && overLimits(state) )
+            return;
+
+        if( state ==  RequestParser::CompletedState )
+        {
+            if( startRequest() == false )
+                return;
+
+            timeout.cancel();
+            assert( callback.empty() == false );
+            callback(context);
+        }
+        else if( state == RequestParser::HeadersCompletedState )
+        {
+            if( startRequest() == false )
+                return;
+
+            // Reserve space for the body now: the buffer is not reallocated
+            // while the body is read, views of the request stay valid.
+            size_t bodyBegin = requestParser.consumed();
+
+            if( buffer.size() - bodyBegin < minBodyBufferSize )
             {
-                response = Response::makeResponse(Response::BadRequest);
-                writeResponse();
+                buffer.resize(bodyBegin + minBodyBufferSize);
+                requestParser.update(requestImpl, &buffer[0]);
             }
-            else
+
+            bodyStreaming = true;
+            timeout.cancel();
+            assert( callback.empty() == false );
+            callback(context);
+        }
+        else if( state ==  RequestParser::ErrorState )
+        {
+            if( settings->metrics )
+                settings->metrics->parseError();
+
+            closeConnection = true;
+            response = Response::makeResponse(Response::BadRequest);
+            writeResponse();
+        }
+        else if( output.empty() == false )
+        {
+            // Incompleted, do not delay the responses to pipelined requests
+            boost::asio::async_write(*socket.get(),
+                                     boost::asio::buffer(output),
+                                     WriteProgress(*this),
+                                     boost::bind(
+                                         &HttpConnection::handleFlush,
+                                         this->shared_from_this(),
+                                         boost::asio::placeholders::error,
+                                         boost::asio::placeholders::bytes_transferred) );
+        }
+        else
+        {
+            // Incompleted, a slow body is limited by the pauses
+            if( requestParser.inBody() )
+                setTimeout(settings->bodyTimeout);
+
+            readMore();
+        }
+    }
+
+    // The request line with the headers, or the body collected in memory, is
+    // too large: reply 431 or 413 and close the connection.
+    bool overLimits(RequestParser::ParseState state)
+    {
+        // the parser takes all bytes of incomplete headers
+        bool headersParsed = state != RequestParser::IncompletedState || requestParser.inBody();
+        size_t headersSize = headersParsed ? requestParser.headersSize() : bufferSize;
+        Response::StatusType status;
+
+        if( settings->maxHeaderSize != 0 && headersSize > settings->maxHeaderSize )
+            status = Response::RequestHeaderFieldsTooLarge;
+        else if( settings->maxBodySize != 0 && headersParsed &&
+                 state != RequestParser::HeadersCompletedState &&
+                 requestParser.bodySize() > settings->maxBodySize )
+            status = Response::PayloadTooLarge;
+        else
+            return false;
+
+        closeConnection = true;
+        response = Response::makeResponse(status);
+        writeResponse();
+        return true;
+    }
+
+    void handleFlush(const boost::system::error_code &ec, size_t bytesTransferred)
+    {
+        countSent(bytesTransferred);
+
+        if( !ec )
+        {
+            output.clear();
+            setTimeout(requestParser.inBody() ? settings->bodyTimeout : settings->headerTimeout);
+            readMore();
+        }
+        else if( ec != boost::asio::error::operation_aborted )
+        {
+            stop();
+        }
+    }
+
+    // Decode the next fragment of the streamed body, read more data if nothing is decoded.
+    void processBody()
+    {
+        RequestParser::ParseState state = requestParser.parseBody(
+                    requestImpl, &buffer[0], bufferSize);
+
+        if( state == RequestParser::ErrorState )
+        {
+            if( settings->metrics )
+                settings->metrics->parseError();
+
+            closeConnection = true;
+            requestImpl.postData = boost::string_ref();
+            deliverBody(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        }
+        else if( state == RequestParser::CompletedState )
+        {
+            bodyCompleted = true;
+            deliverBody(boost::system::error_code());
+        }
+        else if( requestImpl.postData.empty() == false )
+        {
+            deliverBody(boost::system::error_code());
+        }
+        else if( bufferSize == buffer.size() )
+        {
+            // The chunk size line or the trailer does not fit into the buffer.
+            closeConnection = true;
+            deliverBody(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        }
+        else
+        {
+            setTimeout(settings->bodyTimeout);
+            socket->async_read_some(boost::asio::buffer(&buffer[bufferSize],
+                                                        buffer.size() - bufferSize),
+                                    boost::bind(&HttpConnection::handleBodyRead,
+                                                this->shared_from_this(),
+                                                boost::asio::placeholders::error,
+                                                boost::asio::placeholders::bytes_transferred));
+        }
+    }
+
+    void handleBodyRead(const boost::system::error_code &ec,
+                        std::size_t bytes_transferred)
+    {
+        if( !ec )
+        {
+            timeout.cancel();
+            bufferSize += bytes_transferred;
+
+            if( settings->metrics )
+                settings->metrics->received(bytes_transferred);
+
+            processBody();
+        }
+        else if( ec != boost::asio::error::operation_aborted || timedOut )
+        {
+            closeConnection = true;
+            deliverBody(timedOut ? boost::system::errc::make_error_code(boost::system::errc::timed_out)
+                                 : ec);
+        }
+    }
+
+    // The handler is never called from readBody() directly.
+    void deliverBody(const boost::system::error_code &ec)
+    {
+        io_service.post(boost::bind(&HttpConnection::invokeBodyHandler,
+                                    this->shared_from_this(),
+                                    bodyHandler, ec, requestImpl.postData));
+        bodyHandler.clear();
+    }
+
+    // Count the request in the handlers, or answer it with 503 when the server
+    // is overloaded.
+    bool startRequest()
+    {
+        bool reused = requestsServed++ > 0;
+
+        if( settings->metrics )
+            settings->metrics->requestStarted(reused);
+
+        if( rejectRequests == false && limiter->requestStarted() )
+        {
+            inFlight = true;
+
+            if( timed() )
             {
-                // Incompleted
-                socket->async_read_some(boost::asio::buffer(buffer),
-                                        boost::bind(&HttpConnection::handleRead,
-                                            this->shared_from_this(),
-                                            boost::asio::placeholders::error,
-                                            boost::asio::placeholders::bytes_transferred));
+                handlerStart = TimerWheel::Clock::now();
+
+                if( settings->metrics )
+                    settings->metrics->record(ServerMetrics::ParsePhase,
+                                             nanoseconds(handlerStart - requestStart));
             }
+
+            return true;
         }
-        else if( ec != boost::asio::error::operation_aborted )
+
+        size_t dateOffset = 0;
+        size_t contentSize = 0;
+        const std::vector<char> &reply = serviceUnavailable(dateOffset, contentSize);
+        size_t offset = output.size();
+
+        output.insert(output.end(), reply.begin(), reply.end());
+        dateService.copyDateHeader(&output[offset + dateOffset]);
+        closeConnection = true;
+
+        // for the access log
+        response.setStatus(Response::ServiceUnavailable);
+        responseBytes = contentSize;
+
+        boost::asio::async_write(*socket.get(),
+                                 boost::asio::buffer(output),
+                                 WriteProgress(*this),
+                                 boost::bind(
+                                     &HttpConnection::handleWriteComplete,
+                                     this->shared_from_this(),
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred) );
+        return false;
+    }
+
+    void finishRequest()
+    {
+        if( inFlight )
+        {
+            inFlight = false;
+            limiter->requestFinished();
+        }
+    }
+
+    // The connection and its request are not counted anymore.
+    void release()
+    {
+        this->unlink();
+        finishRequest();
+
+        if( open )
+        {
+            open = false;
+            limiter->connectionClosed();
+
+            if( settings->metrics )
+                settings->metrics->connectionClosed();
+        }
+    }
+
+    // Serialized once, only the "Date" header is updated.
+    static const std::vector<char> &serviceUnavailable(size_t &dateOffset, size_t &contentSize)
+    {
+        struct Reply {
+            Reply()
+            {
+                Response response = Response::makeResponse(Response::ServiceUnavailable);
+
+                response.addHeader("Connection", "close");
+                response.serializeStatus(1, 1, data);
+                dateOffset = data.size();
+                data.resize(data.size() + DateService::dateHeaderSize);
+                data.insert(data.end(), DateService::serverHeader(),
+                            DateService::serverHeader() + DateService::serverHeaderSize());
+                response.serializeHeaders(data);
+                data.push_back('\r');
+                data.push_back('\n');
+                data.insert(data.end(), response.content().begin(), response.content().end());
+                contentSize = response.contentSize();
+            }
+
+            std::vector<char> data;
+            size_t dateOffset;
+            size_t contentSize;
+        };
+
+        static const Reply reply;
+
+        dateOffset = reply.dateOffset;
+        contentSize = reply.contentSize;
+        return reply.data;
+    }
+
+    // The access log or the metrics need the times of the request phases.
+    bool timed() const
+    {
+        return settings->accessLog || settings->metrics;
+    }
+
+    static boost::uint64_t nanoseconds(TimerWheel::Clock::duration duration)
+    {
+        return boost::asio::chrono::duration_cast<boost::asio::chrono::nanoseconds>(
+                    duration).count();
+    }
+
+    void countSent(size_t bytes)
+    {
+        if( settings->metrics )
+            settings->metrics->sent(bytes);
+    }
+
+    // The handler has started the response, or the request is answered
+    // without calling it.
+    void responseStarted()
+    {
+        if( timed() == false )
+            return;
+
+        writeStart = TimerWheel::Clock::now();
+
+        if( settings->metrics && handlerStart != TimerWheel::Clock::time_point() )
+            settings->metrics->record(ServerMetrics::HandlerPhase,
+                                     nanoseconds(writeStart - handlerStart));
+    }
+
+    // The response is sent (or queued after a pipelined one): update the
+    // metrics and write it to the access log.
+    void completeRequest()
+    {
+        if( settings->metrics )
+        {
+            settings->metrics->responseCompleted(response.status());
+
+            if( writeStart != TimerWheel::Clock::time_point() )
+                settings->metrics->record(ServerMetrics::WritePhase,
+                                         nanoseconds(TimerWheel::Clock::now() - writeStart));
+        }
+
+        if( !settings->accessLog )
+            return;
+
+        char date[DateService::dateSize];
+        RequestLog::Entry entry;
+
+        dateService.copyDate(date);
+        entry.date = date;
+        entry.method = requestImpl.method;
+        entry.uri = requestImpl.uri;
+        entry.versionMajor = requestImpl.versionMajor;
+        entry.versionMinor = requestImpl.versionMinor;
+        entry.status = response.status();
+        entry.bytes = responseBytes;
+        entry.latencyUs = nanoseconds(TimerWheel::Clock::now() - requestStart) / 1000;
+
+        settings->accessLog->log(entry);
+    }
+
+    // Close the connection if nothing happens in time, zero cancels the timeout.
+    void setTimeout(unsigned int seconds)
+    {
+        if( seconds != 0 )
+            timerWheel.schedule(timeout, seconds * 1000);
+        else
+            timeout.cancel();
+    }
+
+    // The pending operations are aborted.
+    void handleTimeout()
+    {
+        timedOut = true;
+
+        try
         {
             stop();
         }
+        catch(std::exception &)
+        {
+        }
+    }
+
+    // Keeps the connection alive until the handler is called.
+    void invokeBodyHandler(const BodyHandler &handler, const boost::system::error_code &ec,
+                           const boost::string_ref &data)
+    {
+        handler(ec, data);
     }
 
     boost::asio::io_service &io_service;
 
+    // Shared with the server: the io_service may destroy the connection
+    // after the server.
+    boost::shared_ptr<const ServerSettings> settings;
+
+    // Connections and requests of the server.
+    boost::shared_ptr<LoadLimiter> limiter;
+
+    // Formats the default headers once per second.
+    DateService &dateService;
+
     // The parser for the incoming request.
     RequestParser requestParser;
 
+    // Timeouts of all connections of the io_service.
+    TimerWheel &timerWheel;
+    TimerWheel::Entry timeout;
+    // The response is sent, the next request is not started yet.
+    bool keepAliveWait;
+    bool timedOut;
+    // Counted by the limiter.
+    bool open;
+    bool rejectRequests;
+    bool inFlight;
+
     bool firstChunk;
+    bool chunked;
     bool closeConnection;
 
+    // The request body is read by the handler in fragments.
+    bool bodyStreaming;
+    bool bodyCompleted;
+    // The whole body is passed to the handler (not streamed mode).
+    bool bodyDelivered;
+    BodyHandler bodyHandler;
+
     // Socket for the connection.
     boost::shared_ptr<Socket> socket;
 
     // The handler used to process the incoming request.
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
 
-    // Buffer for incoming data.
-    boost::array<char, 8192> buffer;
+    enum { initialBufferSize = 8192, minBodyBufferSize = 8192, initialOutputSize = 1024 };
+
+    // Buffer for incoming data, the request refers to it.
+    std::vector<char> buffer;
+    size_t bufferSize;
+
+    // Responses to pipelined requests waiting to be sent, then the headers of
+    // the current response. The capacity is kept, so it does not allocate memory.
+    std::vector<char> output;
+
+    enum { fileBufferSize = 65536, maxFileWriteSize = 1024 * 1024, maxWriteSize = 65536 };
+
+    // The part of the response file to be sent.
+    off_t fileOffset;
+    size_t fileRemaining;
+    // Used when the file is sent without sendfile().
+    std::vector<char> fileBuffer;
+
+    // For the access log and the metrics: the first byte of the request was
+    // received, the handler was called, the response was started; the size of
+    // the response body sent so far.
+    TimerWheel::Clock::time_point requestStart;
+    TimerWheel::Clock::time_point handlerStart;
+    TimerWheel::Clock::time_point writeStart;
+    boost::uint64_t responseBytes;
+    // Requests started on this connection
+    size_t requestsServed;
 
     // The incoming request.
     RequestImpl requestImpl;
@@ -7,11 +7,24 @@
 #define HSERV_HTTPSERVERIMPL_H
 
 #include <string>
+#include <vector>
 #include <boost/function.hpp>
+#include <boost/mem_fn.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
-
+#ifndef WIN32
+#include <hserv/listeners.h>
+#endif
+#include <hserv/serversettings.h>
+#include <hserv/impl/connectionlist.h>
+#include <hserv/impl/connectionpool.h>
 #include <hserv/impl/httpconnection.h>
+#include <hserv/impl/loadlimiter.h>
+#include <hserv/impl/ioservicepool.h>
 
 namespace hserv {
 
@@ -22,11 +35,66 @@ public:
     HttpServerImpl(boost::asio::io_service &ioService,
                    const std::string &address, int port,
                    const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-        : listenAddress(address), listenPort(port),
-          ioService(ioService), acceptor(ioService), callback(callback)
-    {}
+        : listenAddress(address), listenPort(port), listenFd(-1),
+          callback(callback), settings(new ServerSettings), nextWorker(0),
+          limiter(new LoadLimiter)
+    {
+        workers.push_back(boost::shared_ptr<Worker>(new Worker(ioService)));
+    }
 
-    ~HttpServerImpl() {}
+#ifndef WIN32
+    // Serve an open listening socket, the server owns it.
+    HttpServerImpl(boost::asio::io_service &ioService, int listenFd,
+                   const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenPort(0), listenFd(listenFd),
+          callback(callback), settings(new ServerSettings), nextWorker(0),
+          limiter(new LoadLimiter)
+    {
+        workers.push_back(boost::shared_ptr<Worker>(new Worker(ioService)));
+    }
+#endif
+
+    // Thread pool mode: one io_service, acceptor and connection set per thread.
+    HttpServerImpl(size_t threads,
+                   const std::string &address, int port,
+                   const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenAddress(address), listenPort(port), listenFd(-1),
+          callback(callback), settings(new ServerSettings), pool(new IoServicePool(threads)),
+          nextWorker(0), limiter(new LoadLimiter)
+    {
+        for(size_t i = 0; i < pool->size(); ++i)
+            workers.push_back(boost::shared_ptr<Worker>(new Worker(pool->ioService(i))));
+    }
+
+#ifndef WIN32
+    // Thread pool mode with an open listening socket: one acceptor spreads
+    // the connections over the threads.
+    HttpServerImpl(size_t threads, int listenFd,
+                   const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenPort(0), listenFd(listenFd),
+          callback(callback), settings(new ServerSettings), pool(new IoServicePool(threads)),
+          nextWorker(0), limiter(new LoadLimiter)
+    {
+        for(size_t i = 0; i < pool->size(); ++i)
+            workers.push_back(boost::shared_ptr<Worker>(new Worker(pool->ioService(i))));
+    }
+#endif
+
+    ~HttpServerImpl()
+    {
+        limiter->detach();
+
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            if( workers[i]->connections )
+                workers[i]->connections->close();
+        }
+    }
+
+    ServerSettings &serverSettings()
+    {
+        return *settings;
+    }
 
     typedef boost::asio::ip::tcp::socket TcpSocket;
 
@@ -48,71 +116,321 @@ public:
     };
 
     typedef HttpConnection<TcpSocket, CloseSocket, ShutdownSocket> ConnectionType;
+    typedef ConnectionPool<ConnectionType> ConnectionPoolType;
+
+    // Sum of the pools of all io_services.
+    ConnectionPoolStats connectionPoolStats() const
+    {
+        ConnectionPoolStats result;
+
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            if( workers[i]->connections )
+            {
+                ConnectionPoolStats stats = workers[i]->connections->stats();
+
+                result.hits += stats.hits;
+                result.misses += stats.misses;
+                result.idle += stats.idle;
+            }
+        }
+
+        return result;
+    }
 
+    // Start listening. In the thread pool mode blocks until the server is stopped.
     void run()
     {
-        newSocket.reset( new boost::asio::ip::tcp::socket(ioService) );
-        newConnection.reset( new ConnectionType(ioService, newSocket, callback));
+        boost::asio::ip::tcp::endpoint endpoint;
+
+        if( listenFd < 0 )
+        {
+            boost::asio::ip::tcp::resolver resolver(workers[0]->ioService);
+            boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
+
+            endpoint = *resolver.resolve(query);
+            endpoint.port(listenPort);
+        }
 
-        boost::asio::ip::tcp::resolver resolver(ioService);
-        boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+        limiter->setLimits(settings->maxConnections, settings->maxRequestsInFlight);
+        limiter->setResumeHandler(boost::bind(&HttpServerImpl::resumeAccept, this));
+
+        // Connections are accepted for any io_service, create all pools first.
+        for(size_t i = 0; i < workers.size(); ++i)
+            workers[i]->connections.reset(new ConnectionPoolType(settings->connectionPoolSize));
+
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            Worker &worker = *workers[i];
+
+            if( i > 0 && acceptorPerWorker() == false )
+                break;
 
-        endpoint.port(listenPort);
-        acceptor.open(endpoint.protocol());
 #ifndef WIN32
-        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            if( listenFd >= 0 )
+            {
+                worker.acceptor.assign(Listeners::tcpProtocol(listenFd), listenFd);
+            }
+            else
 #endif
-        acceptor.bind(endpoint);
-        acceptor.listen();
-        acceptor.async_accept(*newSocket.get(),
-                              boost::bind(&HttpServerImpl::handleAccept, this,
-                                          boost::asio::placeholders::error));
+            {
+                worker.acceptor.open(endpoint.protocol());
+#ifndef WIN32
+                worker.acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#endif
+#ifdef SO_REUSEPORT
+                if( workers.size() > 1 )
+                    worker.acceptor.set_option(ReusePort(true));
+#endif
+                worker.acceptor.bind(endpoint);
+                worker.acceptor.listen();
+            }
+
+            startAccept(worker);
+        }
+
+        if( pool )
+            pool->run();
     }
 
     void stop()
     {
-        ioService.post(boost::bind(&HttpServerImpl::handleStop, this));
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            Worker &worker = *workers[i];
+            worker.ioService.post(boost::bind(&HttpServerImpl::handleStop, this, &worker));
+        }
+    }
+
+    // Stop accepting, close the idle connections and the others after their
+    // current responses, then stop the server. After `timeoutSeconds` (zero
+    // means no limit) the remaining connections are dropped. The handler is
+    // called by a thread of the server right before it is stopped.
+    void drain(unsigned int timeoutSeconds, const boost::function<void()> &handler)
+    {
+        if( limiter->draining() )
+            return;
+
+        drainHandler = handler;
+        drainTimer.reset(new boost::asio::steady_timer(workers[0]->ioService));
+
+        if( timeoutSeconds > 0 )
+        {
+            drainTimer->expires_from_now(boost::asio::chrono::seconds(timeoutSeconds));
+            drainTimer->async_wait(boost::bind(&HttpServerImpl::handleDrainTimeout, this,
+                                               boost::asio::placeholders::error));
+        }
+
+        // the next responses close their connections
+        limiter->drain(boost::bind(&HttpServerImpl::drained, this));
+
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            Worker &worker = *workers[i];
+            worker.ioService.post(boost::bind(&HttpServerImpl::handleDrain, this, &worker));
+        }
     }
 
 protected:
-    void handleAccept(const boost::system::error_code &ec)
+#ifdef SO_REUSEPORT
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePort;
+#endif
+
+    // Per-thread state: every io_service has its own acceptor.
+    struct Worker
+    {
+        explicit Worker(boost::asio::io_service &ioService)
+            : ioService(ioService), acceptor(ioService), newConnectionOwner(this), paused(false)
+        {
+        }
+
+        boost::asio::io_service &ioService;
+        boost::asio::ip::tcp::acceptor acceptor;
+        Worker *newConnectionOwner;
+        // Accepting waits for a free connection slot.
+        bool paused;
+        boost::shared_ptr<ConnectionType> newConnection;
+        boost::shared_ptr<TcpSocket> newSocket;
+        // Connections of this io_service
+        boost::shared_ptr<ConnectionPoolType> connections;
+        // Started connections of this io_service
+        ConnectionList<ConnectionType> active;
+    };
+
+    static bool reusePortSupported()
+    {
+#ifdef SO_REUSEPORT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Every io_service binds its own socket, otherwise one acceptor spreads
+    // the connections over the io_services.
+    bool acceptorPerWorker() const
+    {
+        return reusePortSupported() && listenFd < 0;
+    }
+
+    void startAccept(Worker &worker)
+    {
+        // Without SO_REUSEPORT the only acceptor spreads connections over the pool.
+        Worker &owner = acceptorPerWorker() ? worker
+                                            : *workers[nextWorker++ % workers.size()];
+
+        worker.newConnectionOwner = &owner;
+
+        // A pooled connection keeps its closed socket, it is used again.
+        ConnectionType *connection = owner.connections->take();
+
+        if( connection )
+        {
+            worker.newSocket = connection->getSocket();
+        }
+        else
+        {
+            worker.newSocket.reset( new TcpSocket(owner.ioService) );
+            connection = new ConnectionType(owner.ioService, worker.newSocket, callback,
+                                            settings, limiter);
+        }
+
+        worker.newConnection = owner.connections->manage(connection);
+
+        worker.acceptor.async_accept(*worker.newSocket.get(),
+                                     boost::bind(&HttpServerImpl::handleAccept, this, &worker,
+                                                 boost::asio::placeholders::error));
+    }
+
+    void handleAccept(Worker *worker, const boost::system::error_code &ec)
     {
         if( !ec )
         {
             // Disable Nagle algorithm
             boost::asio::ip::tcp::no_delay option(true);
-            newSocket->set_option(option);
+            worker->newSocket->set_option(option);
+
+            size_t connections = limiter->connectionOpened();
+            bool overloaded = settings->maxConnections != 0 && connections > settings->maxConnections;
+
+            // the acceptor does not hold the connection, it is released by its owner
+            boost::shared_ptr<ConnectionType> connection;
+
+            connection.swap(worker->newConnection);
+            connection->accepted(overloaded && settings->shedOverload);
 
             // start work
-            newConnection->start();
+            if( worker->newConnectionOwner == worker )
+                startConnection(worker, connection);
+            else
+                worker->newConnectionOwner->ioService.post(
+                            boost::bind(&HttpServerImpl::startConnection, this,
+                                        worker->newConnectionOwner, connection));
 
             // prepare next request
-            newSocket.reset( new boost::asio::ip::tcp::socket(ioService) );
-            newConnection.reset( new ConnectionType(ioService, newSocket, callback));
+            if( settings->shedOverload || limiter->connectionsSaturated() == false )
+                startAccept(*worker);
+            else
+                pauseAccept(*worker);
+        }
+    }
 
-            acceptor.async_accept(*newSocket.get(),
-                                   boost::bind(&HttpServerImpl::handleAccept, this,
-                                               boost::asio::placeholders::error));
+    void startConnection(Worker *owner, const boost::shared_ptr<ConnectionType> &connection)
+    {
+        owner->active.add(*connection);
+        connection->start();
+    }
+
+    // The pending connections wait in the listen queue of the socket.
+    void pauseAccept(Worker &worker)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(pauseMutex);
+            worker.paused = true;
         }
+
+        // a connection might be closed meanwhile
+        if( limiter->connectionsSaturated() == false )
+            resumeAccept();
     }
 
-    void handleStop()
+    // Called by any thread when a connection slot is free.
+    void resumeAccept()
     {
-        acceptor.close();
-        ioService.stop();
+        boost::lock_guard<boost::mutex> lock(pauseMutex);
+
+        for(size_t i = 0; i < workers.size(); ++i)
+        {
+            Worker &worker = *workers[i];
+
+            if( worker.paused )
+            {
+                worker.paused = false;
+                worker.ioService.post(boost::bind(&HttpServerImpl::handleResume, this, &worker));
+            }
+        }
+    }
+
+    void handleResume(Worker *worker)
+    {
+        if( worker->acceptor.is_open() )
+            startAccept(*worker);
+    }
+
+    void handleStop(Worker *worker)
+    {
+        boost::system::error_code ignored_ec;
+        worker->acceptor.close(ignored_ec);
+        worker->ioService.stop();
+    }
+
+    void handleDrain(Worker *worker)
+    {
+        boost::system::error_code ignored_ec;
+        worker->acceptor.close(ignored_ec);
+        worker->active.forEach(boost::mem_fn(&ConnectionType::drain));
+    }
+
+    // Called by any thread when the last connection is closed.
+    void drained()
+    {
+        workers[0]->ioService.post(boost::bind(&HttpServerImpl::finishDrain, this));
+    }
+
+    void handleDrainTimeout(const boost::system::error_code &ec)
+    {
+        if( !ec )
+            finishDrain();
+    }
+
+    void finishDrain()
+    {
+        if( !drainTimer )
+            return;
+
+        drainTimer.reset();
+
+        if( drainHandler )
+            drainHandler();
+
+        stop();
     }
 
 private:
     std::string listenAddress;
     int listenPort;
+    int listenFd;
 
-    boost::asio::io_service &ioService;
-    boost::asio::ip::tcp::acceptor acceptor;
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
-    boost::shared_ptr<ConnectionType> newConnection;
-    boost::shared_ptr<TcpSocket> newSocket;
-
+    // Shared with the connections, they may outlive the server.
+    boost::shared_ptr<ServerSettings> settings;
+    boost::scoped_ptr<IoServicePool> pool;
+    std::vector< boost::shared_ptr<Worker> > workers;
+    size_t nextWorker;
+    boost::shared_ptr<LoadLimiter> limiter;
+    boost::mutex pauseMutex;
+    boost::scoped_ptr<boost::asio::steady_timer> drainTimer;
+    boost::function<void()> drainHandler;
 };
 
 } // namespace hserv
@@ -8,11 +8,23 @@
 
 #include <string>
 #include <boost/function.hpp>
+#include <boost/mem_fn.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio/ssl/context.hpp>
 #include <boost/asio/ssl/stream.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
+#ifndef WIN32
+#include <hserv/listeners.h>
+#endif
+#include <hserv/serversettings.h>
+#include <hserv/impl/connectionlist.h>
+#include <hserv/impl/connectionpool.h>
 #include <hserv/impl/httpconnection.h>
+#include <hserv/impl/loadlimiter.h>
 
 namespace hserv {
 
@@ -24,11 +36,34 @@ public:
                              boost::asio::ssl::context &context,
                              const std::string &address, int port,
                              const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
-        : listenAddress(address), listenPort(port), ioService(ioService), context(context),
-          acceptor(ioService), callback(callback)
+        : listenAddress(address), listenPort(port), listenFd(-1), ioService(ioService),
+          context(context), acceptor(ioService), callback(callback), settings(new ServerSettings),
+          paused(false), limiter(new LoadLimiter)
     {}
 
-    ~HttpsServerImpl() {}
+#ifndef WIN32
+    // Serve an open listening socket, the server owns it.
+    HttpsServerImpl(boost::asio::io_service &ioService,
+                    boost::asio::ssl::context &context, int listenFd,
+                    const boost::function<void(const boost::shared_ptr<Context> &)> &callback)
+        : listenPort(0), listenFd(listenFd), ioService(ioService),
+          context(context), acceptor(ioService), callback(callback), settings(new ServerSettings),
+          paused(false), limiter(new LoadLimiter)
+    {}
+#endif
+
+    ~HttpsServerImpl()
+    {
+        limiter->detach();
+
+        if( connections )
+            connections->close();
+    }
+
+    ServerSettings &serverSettings()
+    {
+        return *settings;
+    }
 
     typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> SslSocket;
 
@@ -51,26 +86,41 @@ public:
     };
 
     typedef HttpConnection<SslSocket, CloseSocket, ShutdownSocket> ConnectionType;
+    typedef ConnectionPool<ConnectionType> ConnectionPoolType;
+
+    ConnectionPoolStats connectionPoolStats() const
+    {
+        return connections ? connections->stats() : ConnectionPoolStats();
+    }
 
     void run()
     {
-        newSocket.reset( new SslSocket(ioService, context) );
-        newConnection.reset( new ConnectionType(ioService, newSocket, callback));
+        connections.reset(new ConnectionPoolType(settings->connectionPoolSize));
+        limiter->setLimits(settings->maxConnections, settings->maxRequestsInFlight);
+        limiter->setResumeHandler(boost::bind(&HttpsServerImpl::resumeAccept, this));
 
-        boost::asio::ip::tcp::resolver resolver(ioService);
-        boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+#ifndef WIN32
+        if( listenFd >= 0 )
+        {
+            acceptor.assign(Listeners::tcpProtocol(listenFd), listenFd);
+        }
+        else
+#endif
+        {
+            boost::asio::ip::tcp::resolver resolver(ioService);
+            boost::asio::ip::tcp::resolver::query query(listenAddress, std::string() );
+            boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
 
-        endpoint.port(listenPort);
-        acceptor.open(endpoint.protocol());
+            endpoint.port(listenPort);
+            acceptor.open(endpoint.protocol());
 #ifndef WIN32
-        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
 #endif
-        acceptor.bind(endpoint);
-        acceptor.listen();
-        acceptor.async_accept(newSocket->lowest_layer(),
-                              boost::bind(&HttpsServerImpl::handleAccept, this,
-                                          boost::asio::placeholders::error));
+            acceptor.bind(endpoint);
+            acceptor.listen();
+        }
+
+        startAccept();
     }
 
     void stop()
@@ -78,6 +128,30 @@ public:
         ioService.post(boost::bind(&HttpsServerImpl::handleStop, this));
     }
 
+    // Stop accepting, close the idle connections and the others after their
+    // current responses, then stop the server. After `timeoutSeconds` (zero
+    // means no limit) the remaining connections are dropped. The handler is
+    // called by the thread of the server right before it is stopped.
+    void drain(unsigned int timeoutSeconds, const boost::function<void()> &handler)
+    {
+        if( limiter->draining() )
+            return;
+
+        drainHandler = handler;
+        drainTimer.reset(new boost::asio::steady_timer(ioService));
+
+        if( timeoutSeconds > 0 )
+        {
+            drainTimer->expires_from_now(boost::asio::chrono::seconds(timeoutSeconds));
+            drainTimer->async_wait(boost::bind(&HttpsServerImpl::handleDrainTimeout, this,
+                                               boost::asio::placeholders::error));
+        }
+
+        // the next responses close their connections
+        limiter->drain(boost::bind(&HttpsServerImpl::drained, this));
+        ioService.post(boost::bind(&HttpsServerImpl::handleDrain, this));
+    }
+
 protected:
     void handleAccept(const boost::system::error_code &ec)
     {
@@ -87,24 +161,120 @@ protected:
             boost::asio::ip::tcp::no_delay option(true);
             newSocket->lowest_layer().set_option(option);
 
+            size_t count = limiter->connectionOpened();
+            bool overloaded = settings->maxConnections != 0 && count > settings->maxConnections;
+
+            newConnection->accepted(overloaded && settings->shedOverload);
+            newConnection->startHandshakeTimeout();
+            active.add(*newConnection);
+
             newSocket->async_handshake(boost::asio::ssl::stream_base::server,
                                        boost::bind(&HttpsServerImpl::handleHandshake, this,
                                                    newConnection, boost::asio::placeholders::error));
 
-            newSocket.reset( new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(ioService, context) );
-            newConnection.reset( new ConnectionType(ioService, newSocket, callback));
-            acceptor.async_accept(newSocket->lowest_layer(),
-                                   boost::bind(&HttpsServerImpl::handleAccept, this,
-                                               boost::asio::placeholders::error));
+            if( settings->shedOverload || limiter->connectionsSaturated() == false )
+                startAccept();
+            else
+                pauseAccept();
         }
     }
 
+    void startAccept()
+    {
+        prepareConnection();
+        acceptor.async_accept(newSocket->lowest_layer(),
+                              boost::bind(&HttpsServerImpl::handleAccept, this,
+                                          boost::asio::placeholders::error));
+    }
+
+    // The pending connections wait in the listen queue of the socket.
+    void pauseAccept()
+    {
+        // the accepted connection must not be held while waiting
+        newConnection.reset();
+        newSocket.reset();
+
+        {
+            boost::lock_guard<boost::mutex> lock(pauseMutex);
+            paused = true;
+        }
+
+        // a connection might be closed meanwhile
+        if( limiter->connectionsSaturated() == false )
+            resumeAccept();
+    }
+
+    // Called when a connection slot is free.
+    void resumeAccept()
+    {
+        boost::lock_guard<boost::mutex> lock(pauseMutex);
+
+        if( paused )
+        {
+            paused = false;
+            ioService.post(boost::bind(&HttpsServerImpl::handleResume, this));
+        }
+    }
+
+    void handleResume()
+    {
+        if( acceptor.is_open() )
+            startAccept();
+    }
+
+    // The TLS state can not be reused, a pooled connection gets a new stream.
+    void prepareConnection()
+    {
+        ConnectionType *connection = connections->take();
+
+        newSocket.reset( new SslSocket(ioService, context) );
+
+        if( connection )
+            connection->setSocket(newSocket);
+        else
+            connection = new ConnectionType(ioService, newSocket, callback, settings, limiter);
+
+        newConnection = connections->manage(connection);
+    }
+
     void handleStop()
     {
         acceptor.close();
         ioService.stop();
     }
 
+    void handleDrain()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor.close(ignored_ec);
+        active.forEach(boost::mem_fn(&ConnectionType::drain));
+    }
+
+    // Called when the last connection is closed.
+    void drained()
+    {
+        ioService.post(boost::bind(&HttpsServerImpl::finishDrain, this));
+    }
+
+    void handleDrainTimeout(const boost::system::error_code &ec)
+    {
+        if( !ec )
+            finishDrain();
+    }
+
+    void finishDrain()
+    {
+        if( !drainTimer )
+            return;
+
+        drainTimer.reset();
+
+        if( drainHandler )
+            drainHandler();
+
+        stop();
+    }
+
     void handleHandshake(const boost::shared_ptr<ConnectionType> &connection,
                          const boost::system::error_code &ec)
     {
@@ -115,13 +285,23 @@ protected:
 private:
     std::string listenAddress;
     int listenPort;
+    int listenFd;
 
     boost::asio::io_service &ioService;
     boost::asio::ssl::context &context;
     boost::asio::ip::tcp::acceptor acceptor;
     boost::function<void(const boost::shared_ptr<Context> &)> callback;
+    // Shared with the connections, they may outlive the server.
+    boost::shared_ptr<ServerSettings> settings;
+    boost::shared_ptr<ConnectionPoolType> connections;
     boost::shared_ptr<ConnectionType> newConnection;
     boost::shared_ptr<SslSocket> newSocket;
+    bool paused;
+    boost::mutex pauseMutex;
+    boost::shared_ptr<LoadLimiter> limiter;
+    ConnectionList<ConnectionType> active;
+    boost::scoped_ptr<boost::asio::steady_timer> drainTimer;
+    boost::function<void()> drainHandler;
 };
 
 } // namespace hserv
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_IOSERVICEPOOL_H
+#define HSERV_IOSERVICEPOOL_H
+
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace hserv {
+
+// A pool of io_service objects, each one is run by its own thread.
+class IoServicePool : private boost::noncopyable
+{
+public:
+    // Zero pool size means one io_service per hardware thread.
+    explicit IoServicePool(size_t poolSize)
+    {
+        if( poolSize == 0 )
+            poolSize = boost::thread::hardware_concurrency();
+
+        if( poolSize == 0 )
+            poolSize = 1;
+
+        for(size_t i = 0; i < poolSize; ++i)
+        {
+            boost::shared_ptr<boost::asio::io_service> ioService(new boost::asio::io_service(1));
+            boost::shared_ptr<boost::asio::io_service::work> ioWork(
+                        new boost::asio::io_service::work(*ioService));
+
+            ioServices.push_back(ioService);
+            work.push_back(ioWork);
+        }
+    }
+
+    size_t size() const
+    {
+        return ioServices.size();
+    }
+
+    boost::asio::io_service &ioService(size_t index)
+    {
+        return *ioServices[index];
+    }
+
+    // Run all io_service objects and wait until all of them are stopped.
+    void run()
+    {
+        boost::thread_group threads;
+
+        for(size_t i = 1; i < ioServices.size(); ++i)
+        {
+            threads.create_thread(boost::bind(&IoServicePool::runOne, ioServices[i]));
+        }
+
+        runOne(ioServices[0]);
+        threads.join_all();
+    }
+
+    void stop()
+    {
+        for(size_t i = 0; i < ioServices.size(); ++i)
+            ioServices[i]->stop();
+    }
+
+private:
+    static void runOne(const boost::shared_ptr<boost::asio::io_service> &ioService)
+    {
+        ioService->run();
+    }
+
+    std::vector< boost::shared_ptr<boost::asio::io_service> > ioServices;
+    std::vector< boost::shared_ptr<boost::asio::io_service::work> > work;
+};
+
+} // namespace hserv
+
+#endif // HSERV_IOSERVICEPOOL_H
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_LOADLIMITER_H
+#define HSERV_LOADLIMITER_H
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace hserv {
+
+// Open connections and requests in the handlers of a server, shared by
+// the threads of the server and its connections. A zero limit means no limit.
+class LoadLimiter : private boost::noncopyable
+{
+public:
+    LoadLimiter()
+        : maxConnections(0), maxRequests(0), connections(0), requests(0),
+          drainStarted(false), drainFinished(false)
+    {
+    }
+
+    void setLimits(size_t maxConnections, size_t maxRequests)
+    {
+        this->maxConnections = maxConnections;
+        this->maxRequests = maxRequests;
+    }
+
+    // Called when the number of connections drops below the limit.
+    void setResumeHandler(const boost::function<void()> &handler)
+    {
+        resume = handler;
+    }
+
+    // Returns the number of connections including the new one.
+    size_t connectionOpened()
+    {
+        return ++connections;
+    }
+
+    void connectionClosed()
+    {
+        size_t before = connections--;
+
+        if( before == maxConnections && resume )
+            resume();
+
+        if( before == 1 && drainStarted )
+            finishDrain();
+    }
+
+    bool connectionsSaturated() const
+    {
+        return maxConnections != 0 && connections.load() >= maxConnections;
+    }
+
+    // False if the request must be rejected, then it is not counted.
+    bool requestStarted()
+    {
+        size_t count = ++requests;
+
+        if( maxRequests != 0 && count > maxRequests )
+        {
+            --requests;
+            return false;
+        }
+
+        return true;
+    }
+
+    void requestFinished()
+    {
+        --requests;
+    }
+
+    // No more keep-alive. The handler is called once, by the thread closing
+    // the last connection or by this one if there are no connections.
+    void drain(const boost::function<void()> &handler)
+    {
+        drained = handler;
+        drainStarted = true;
+
+        if( connections.load() == 0 )
+            finishDrain();
+    }
+
+    bool draining() const
+    {
+        return drainStarted.load(boost::memory_order_relaxed);
+    }
+
+    // The server is destroyed, the connections left in its io_services must
+    // not call it.
+    void detach()
+    {
+        resume.clear();
+        drained.clear();
+    }
+
+    size_t connectionCount() const
+    {
+        return connections.load();
+    }
+
+    size_t requestCount() const
+    {
+        return requests.load();
+    }
+
+private:
+    void finishDrain()
+    {
+        if( drainFinished.exchange(true) == false && drained )
+            drained();
+    }
+
+    size_t maxConnections;
+    size_t maxRequests;
+    boost::atomic<size_t> connections;
+    boost::atomic<size_t> requests;
+    boost::function<void()> resume;
+    boost::function<void()> drained;
+    boost::atomic<bool> drainStarted;
+    boost::atomic<bool> drainFinished;
+};
+
+} // namespace hserv
+
+#endif // HSERV_LOADLIMITER_H
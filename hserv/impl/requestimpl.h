@@ -6,22 +6,64 @@
 #ifndef HSERV_REQUESTIMPL_H
 #define HSERV_REQUESTIMPL_H
 
-#include <string>
+#include <algorithm>
 #include <vector>
-#include <boost/algorithm/string.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <hserv/header.h>
+#include <hserv/knownheaders.h>
 
 namespace hserv {
 
+// All strings are views into a buffer owned by the connection,
+// they are valid until the response is completed.
 struct RequestImpl {
-    std::string method;
-    std::string uri;
+    RequestImpl()
+        : versionMajor(0), versionMinor(0), keepAlive(false)
+    {
+        clearKnownHeaders();
+    }
+
+    // Forget the previous request but keep allocated memory.
+    void reset()
+    {
+        method.clear();
+        uri.clear();
+        versionMajor = 0;
+        versionMinor = 0;
+        headers.clear();
+        clearKnownHeaders();
+        postData.clear();
+        endpoint = boost::asio::ip::tcp::endpoint();
+        keepAlive = false;
+    }
+
+    // Append the header, a well known one is also put to the table.
+    void addHeader(const boost::string_ref &name, const boost::string_ref &value)
+    {
+        KnownHeaders::Id id = KnownHeaders::find(name);
+        HeaderItem h = {name, value};
+
+        if( id != KnownHeaders::Unknown && knownHeaders[id] < 0 )
+            knownHeaders[id] = static_cast<int>(headers.size());
+
+        headers.push_back(h);
+    }
+
+    void clearKnownHeaders()
+    {
+        std::fill(knownHeaders, knownHeaders + KnownHeaders::Count, -1);
+    }
+
+    boost::string_ref method;
+    boost::string_ref uri;
     int versionMajor;
     int versionMinor;
     std::vector<HeaderItem> headers;
-    std::vector<char> postData;
+    // Index of the first header of each well known name or -1
+    int knownHeaders[KnownHeaders::Count];
+    boost::string_ref postData;
     boost::asio::ip::tcp::endpoint endpoint;
     bool keepAlive;
 };
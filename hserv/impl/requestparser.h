@@ -6,44 +6,174 @@
 #ifndef LIBAHTTP_REQUESTPARSER_H
 #define LIBAHTTP_REQUESTPARSER_H
 
-#include <boost/logic/tribool.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
 
-#include <hserv/request.h>
+#include <hserv/header.h>
+#include <hserv/knownheaders.h>
+#include <hserv/impl/charscanner.h>
+#include <hserv/impl/requestimpl.h>
 
 namespace hserv {
 
 // Parser for incoming requests.
+//
+// The parser does not copy anything: it remembers offsets of the request parts
+// in the connection buffer and turns them into views when the request is completed.
+// The buffer may be reallocated between parse() calls, but must keep its content.
+//
+// A chunked body is decoded in place: chunk data is moved over the chunk framing,
+// so the body is a single range of the buffer as well.
 class RequestParser
 {
 public:
     RequestParser()
-        : state(MethodStart), postSize(0)
+        : state(MethodStart), pos(0), postSize(0), chunkedBody(false), contentLength(false),
+          transferEncoding(false), streamBody(false)
     {
+        std::fill(knownHeaders, knownHeaders + KnownHeaders::Count, -1);
     }
 
     enum ParseState {
         CompletedState,
         IncompletedState,
-        ErrorState
+        ErrorState,
+        // The headers are parsed, the body is read by parseBody()
+        HeadersCompletedState
     };
 
-    ParseState parse(RequestImpl &req, const char *begin, const char *end)
+    // Stop after the headers of a request with a body instead of collecting
+    // the whole body in the buffer.
+    void setStreamBody(bool value)
     {
-        return consume(req, begin, end);
+        streamBody = value;
+    }
+
+    // Parse the first `size` bytes of the buffer. Bytes consumed by
+    // the previous calls are not parsed again.
+    ParseState parse(RequestImpl &req, char *buffer, size_t size)
+    {
+        ParseState result = consume(req, buffer, size);
+
+        if( result == CompletedState )
+            complete(req, buffer);
+
+        return result;
+    }
+
+    // Continue the body after HeadersCompletedState. The request body view
+    // is set to the decoded data collected since the last discardBody() call.
+    ParseState parseBody(RequestImpl &req, char *buffer, size_t size)
+    {
+        ParseState result = consume(req, buffer, size);
+
+        complete(req, buffer);
+
+        return result;
+    }
+
+    // Drop the decoded body data: the unparsed bytes are moved to the
+    // beginning of the body. Returns the new size of the buffer content.
+    size_t discardBody(char *buffer, size_t size)
+    {
+        std::copy(buffer + pos, buffer + size, buffer + postData.begin);
+
+        size -= pos - postData.begin;
+        pos = postData.begin;
+        postData.end = postData.begin;
+
+        return size;
+    }
+
+    // Update views of the request after reallocation of the buffer.
+    void update(RequestImpl &req, const char *buffer)
+    {
+        complete(req, buffer);
+    }
+
+    // Number of bytes of the buffer which belong to the request.
+    size_t consumed() const
+    {
+        return pos;
+    }
+
+    // The size of the request line with the headers, after they are parsed.
+    size_t headersSize() const
+    {
+        return postData.begin;
+    }
+
+    // The received part of the body with the announced rest, a chunked body
+    // is counted with its framing.
+    size_t bodySize() const
+    {
+        return pos - postData.begin + (state == Post ? postSize : 0);
+    }
+
+    // The headers are parsed, the body is expected.
+    bool inBody() const
+    {
+        return state >= Post;
+    }
+
+    // Prepare to parse the next request, keep allocated memory.
+    void reset()
+    {
+        state = MethodStart;
+        pos = 0;
+        postSize = 0;
+        chunkedBody = false;
+        contentLength = false;
+        transferEncoding = false;
+        method = Range();
+        uri = Range();
+        headers.clear();
+        std::fill(knownHeaders, knownHeaders + KnownHeaders::Count, -1);
+        postData = Range();
     }
 
 private:
-    static bool checkIfConnection(const HeaderItem &item)
+    struct Range {
+        Range() : begin(0), end(0) {}
+
+        boost::string_ref toString(const char *buffer) const
+        {
+            return boost::string_ref(buffer + begin, end - begin);
+        }
+
+        size_t begin;
+        size_t end;
+    };
+
+    struct HeaderRange {
+        Range name;
+        Range value;
+        KnownHeaders::Id id;
+    };
+
+    void complete(RequestImpl &req, const char *buffer)
     {
-        return strcasecmp(item.name.c_str(), "Connection") == 0;
+        req.method = method.toString(buffer);
+        req.uri = uri.toString(buffer);
+        req.postData = postData.toString(buffer);
+        req.headers.resize(headers.size());
+
+        for(size_t i = 0; i < headers.size(); ++i)
+        {
+            req.headers[i].name = headers[i].name.toString(buffer);
+            req.headers[i].value = headers[i].value.toString(buffer);
+        }
+
+        std::copy(knownHeaders, knownHeaders + KnownHeaders::Count, req.knownHeaders);
     }
 
-    ParseState consume(RequestImpl &req, const char *begin, const char *end)
+    ParseState consume(RequestImpl &req, char *buffer, size_t size)
     {
-        while( begin != end )
+        while( pos != size )
         {
-            char input = *begin++;
+            char input = buffer[pos++];
 
             switch (state)
             {
@@ -55,12 +185,14 @@ private:
                 else
                 {
                     state = Method;
-                    req.method.push_back(input);
+                    method.begin = pos - 1;
+                    pos = skip(CharScanner::TokenChars, buffer, pos, size);
                     continue;
                 }
             case Method:
                 if (input == ' ')
                 {
+                    method.end = pos - 1;
                     state = UriStart;
                     continue;
                 }
@@ -70,7 +202,7 @@ private:
                 }
                 else
                 {
-                    req.method.push_back(input);
+                    pos = skip(CharScanner::TokenChars, buffer, pos, size);
                     continue;
                 }
             case UriStart:
@@ -81,17 +213,20 @@ private:
                 else
                 {
                     state = Uri;
-                    req.uri.push_back(input);
+                    uri.begin = pos - 1;
+                    pos = skip(CharScanner::UriChars, buffer, pos, size);
                     continue;
                 }
             case Uri:
                 if (input == ' ')
                 {
+                    uri.end = pos - 1;
                     state = HttpVersion_h;
                     continue;
                 }
                 else if (input == '\r')
                 {
+                    uri.end = pos - 1;
                     req.versionMajor = 0;
                     req.versionMinor = 9;
 
@@ -103,7 +238,7 @@ private:
                 }
                 else
                 {
-                    req.uri.push_back(input);
+                    pos = skip(CharScanner::UriChars, buffer, pos, size);
                     continue;
                 }
             case HttpVersion_h:
@@ -226,7 +361,7 @@ private:
                     state = ExpectingNewline_3;
                     continue;
                 }
-                else if (!req.headers.empty() && (input == ' ' || input == '\t'))
+                else if (!headers.empty() && (input == ' ' || input == '\t'))
                 {
                     state = HeaderLws;
                     continue;
@@ -237,11 +372,10 @@ private:
                 }
                 else
                 {
-                    req.headers.push_back(HeaderItem());
-                    req.headers.back().name.reserve(16);
-                    req.headers.back().value.reserve(16);
-                    req.headers.back().name.push_back(input);
+                    headers.push_back(HeaderRange());
+                    headers.back().name.begin = pos - 1;
                     state = HeaderName;
+                    pos = skip(CharScanner::TokenChars, buffer, pos, size);
                     continue;
                 }
             case HeaderLws:
@@ -260,13 +394,24 @@ private:
                 }
                 else
                 {
+                    // Replace the folding with spaces to keep the value contiguous.
+                    Range &value = headers.back().value;
+                    std::fill(buffer + value.end, buffer + pos - 1, ' ');
                     state = HeaderValue;
-                    req.headers.back().value.push_back(input);
+                    pos = skip(CharScanner::HeaderValueChars, buffer, pos, size);
                     continue;
                 }
             case HeaderName:
                 if (input == ':')
                 {
+                    HeaderRange &h = headers.back();
+                    h.name.end = pos - 1;
+                    h.id = KnownHeaders::find(h.name.toString(buffer));
+
+                    // the first one wins, as in a lookup by name
+                    if( h.id != KnownHeaders::Unknown && knownHeaders[h.id] < 0 )
+                        knownHeaders[h.id] = static_cast<int>(headers.size() - 1);
+
                     state = SpaceBeforeHeaderValue;
                     continue;
                 }
@@ -276,13 +421,16 @@ private:
                 }
                 else
                 {
-                    req.headers.back().name.push_back(input);
+                    pos = skip(CharScanner::TokenChars, buffer, pos, size);
                     continue;
                 }
             case SpaceBeforeHeaderValue:
                 if (input == ' ')
                 {
+                    headers.back().value.begin = pos;
+                    headers.back().value.end = pos;
                     state = HeaderValue;
+                    pos = skip(CharScanner::HeaderValueChars, buffer, pos, size);
                     continue;
                 }
                 else
@@ -292,15 +440,29 @@ private:
             case HeaderValue:
                 if (input == '\r')
                 {
-                    if( req.method == "POST" )
+                    HeaderRange &h = headers.back();
+                    h.value.end = pos - 1;
+
+                    if( h.id == KnownHeaders::ContentLength )
+                    {
+                        // repeated values must be the same
+                        size_t size;
+
+                        if( parseSize(trimRight(h.value.toString(buffer)), size) == false ||
+                                (contentLength && size != postSize) )
+                            return ErrorState;
+
+                        postSize = size;
+                        contentLength = true;
+                    }
+                    else if( h.id == KnownHeaders::TransferEncoding )
                     {
-                        HeaderItem &h = req.headers.back();
+                        // chunked must be the last coding applied
+                        boost::string_ref value = trimRight(h.value.toString(buffer));
 
-                        if( strcasecmp(h.name.c_str(), "Content-Length") == 0 )
-                        {
-                            postSize = atoi(h.value.c_str());
-                            req.postData.reserve( postSize );
-                        }
+                        transferEncoding = true;
+                        chunkedBody = value.size() >= 7 &&
+                                equalsIgnoreCase(value.substr(value.size() - 7), "chunked");
                     }
                     state = ExpectingNewline_2;
                     continue;
@@ -311,7 +473,7 @@ private:
                 }
                 else
                 {
-                    req.headers.back().value.push_back(input);
+                    pos = skip(CharScanner::HeaderValueChars, buffer, pos, size);
                     continue;
                 }
             case ExpectingNewline_2:
@@ -325,13 +487,14 @@ private:
                     return ErrorState;
                 }
             case ExpectingNewline_3: {
-                std::vector<HeaderItem>::iterator it = std::find_if(req.headers.begin(),
-                                                                    req.headers.end(),
-                                                                    checkIfConnection);
+                if( input != '\n' )
+                    return ErrorState;
 
-                if( it != req.headers.end() )
+                int connection = knownHeaders[KnownHeaders::Connection];
+
+                if( connection >= 0 )
                 {
-                    if( strcasecmp(it->value.c_str(), "Keep-Alive") == 0 )
+                    if( equalsIgnoreCase(headers[connection].value.toString(buffer), "Keep-Alive") )
                         req.keepAlive = true;
                 }
                 else
@@ -340,26 +503,168 @@ private:
                         req.keepAlive = true;
                 }
 
-                if( postSize == 0 )
+                // The framing of the body must be unambiguous (RFC 7230 3.3.3),
+                // otherwise the next request on the connection could be smuggled.
+                if( transferEncoding && (contentLength || chunkedBody == false) )
+                    return ErrorState;
+
+                postData.begin = pos;
+                postData.end = pos;
+
+                if( chunkedBody )
+                    state = ChunkSizeStart;
+                else if( postSize != 0 )
+                    state = Post;
+                else
+                    return CompletedState;
+
+                if( streamBody )
+                    return HeadersCompletedState;
+
+                continue;
+            }
+            case Post:
+                // The whole body is taken at once, not byte by byte.
+                --pos;
+                if( size - pos >= postSize )
+                {
+                    pos += postSize;
+                    postData.end = pos;
+                    postSize = 0;
+                    return CompletedState;
+                }
+                else
+                {
+                    postSize -= size - pos;
+                    pos = size;
+                    postData.end = pos;
+                    continue;
+                }
+            case ChunkSizeStart:
+                if( isHexDigit(input) )
+                {
+                    postSize = hexValue(input);
+                    state = ChunkSize;
+                    continue;
+                }
+                else
                 {
-                    if( input == '\n')
-                        return CompletedState;
-                    else
+                    return ErrorState;
+                }
+            case ChunkSize:
+                if( isHexDigit(input) )
+                {
+                    if( postSize > (static_cast<size_t>(-1) >> 4) )
                         return ErrorState;
+
+                    postSize = postSize * 16 + hexValue(input);
+                    continue;
+                }
+                else if( input == ';' || input == ' ' || input == '\t' )
+                {
+                    state = ChunkExtension;
+                    continue;
+                }
+                else if( input == '\r' )
+                {
+                    state = ChunkSizeNewline;
+                    continue;
                 }
                 else
                 {
-                    state = Post;
+                    return ErrorState;
+                }
+            case ChunkExtension:
+                // Extensions are ignored
+                if( input == '\r' )
+                {
+                    state = ChunkSizeNewline;
                     continue;
                 }
-            }
-            case Post:
-                --postSize;
-                req.postData.push_back( input );
+                else if( isControl(input) && input != '\t' )
+                {
+                    return ErrorState;
+                }
+                else
+                {
+                    continue;
+                }
+            case ChunkSizeNewline:
+                if( input != '\n' )
+                    return ErrorState;
+
+                state = postSize == 0 ? TrailerLineStart : ChunkData;
+                continue;
+            case ChunkData: {
+                // Move the available part of the chunk next to the previous one.
+                --pos;
+                size_t count = std::min(size - pos, postSize);
+
+                if( postData.end != pos )
+                    std::copy(buffer + pos, buffer + pos + count, buffer + postData.end);
+
+                pos += count;
+                postData.end += count;
+                postSize -= count;
+
                 if( postSize == 0 )
-                    return CompletedState;
+                    state = ChunkDataCr;
+
+                continue;
+            }
+            case ChunkDataCr:
+                if( input != '\r' )
+                    return ErrorState;
+
+                state = ChunkDataNewline;
+                continue;
+            case ChunkDataNewline:
+                if( input != '\n' )
+                    return ErrorState;
+
+                state = ChunkSizeStart;
+                continue;
+            case TrailerLineStart:
+                // Trailer fields are skipped
+                if( input == '\r' )
+                {
+                    state = TrailerEnd;
+                    continue;
+                }
+                else if( isControl(input) )
+                {
+                    return ErrorState;
+                }
+                else
+                {
+                    state = TrailerLine;
+                    continue;
+                }
+            case TrailerLine:
+                if( input == '\r' )
+                {
+                    state = TrailerNewline;
+                    continue;
+                }
+                else if( isControl(input) && input != '\t' )
+                {
+                    return ErrorState;
+                }
                 else
+                {
                     continue;
+                }
+            case TrailerNewline:
+                if( input != '\n' )
+                    return ErrorState;
+
+                state = TrailerLineStart;
+                continue;
+            case TrailerEnd:
+                if( input != '\n' )
+                    return ErrorState;
+
+                return CompletedState;
             default:
                 return ErrorState;
             }
@@ -368,6 +673,12 @@ private:
         return IncompletedState;
     }
 
+    // Skip ordinary characters in bulk, the next delimiter is checked by the state machine.
+    static inline size_t skip(CharScanner::CharClass cls, const char *buffer, size_t pos, size_t size)
+    {
+        return CharScanner::skip(cls, buffer + pos, buffer + size) - buffer;
+    }
+
     // Check if a byte is an HTTP character.
     static inline bool isChar(int c)
     {
@@ -401,6 +712,55 @@ private:
         return c >= '0' && c <= '9';
     }
 
+    // Check if a byte is a hexadecimal digit.
+    static inline bool isHexDigit(int c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+
+    static boost::string_ref trimRight(boost::string_ref value)
+    {
+        while( value.empty() == false &&
+               (value[value.size() - 1] == ' ' || value[value.size() - 1] == '\t') )
+            value.remove_suffix(1);
+
+        return value;
+    }
+
+    // Decimal digits only, false if the value is empty, invalid or too large.
+    static bool parseSize(const boost::string_ref &value, size_t &result)
+    {
+        if( value.empty() )
+            return false;
+
+        result = 0;
+
+        for(size_t i = 0; i < value.size(); ++i)
+        {
+            if( value[i] < '0' || value[i] > '9' )
+                return false;
+
+            size_t digit = value[i] - '0';
+
+            if( result > (static_cast<size_t>(-1) - digit) / 10 )
+                return false;
+
+            result = result * 10 + digit;
+        }
+
+        return true;
+    }
+
+    static inline size_t hexValue(int c)
+    {
+        if( c >= 'a' )
+            return c - 'a' + 10;
+        else if( c >= 'A' )
+            return c - 'A' + 10;
+        else
+            return c - '0';
+    }
+
     // The current state of the parser.
     enum State
     {
@@ -425,10 +785,35 @@ private:
         HeaderValue,
         ExpectingNewline_2,
         ExpectingNewline_3,
-        Post
+        Post,
+        ChunkSizeStart,
+        ChunkSize,
+        ChunkExtension,
+        ChunkSizeNewline,
+        ChunkData,
+        ChunkDataCr,
+        ChunkDataNewline,
+        TrailerLineStart,
+        TrailerLine,
+        TrailerNewline,
+        TrailerEnd
     } state;
 
+    size_t pos;
+    // Remaining size of the body or of the current chunk.
     size_t postSize;
+    bool chunkedBody;
+    // Content-Length and Transfer-Encoding headers are seen
+    bool contentLength;
+    bool transferEncoding;
+    bool streamBody;
+
+    Range method;
+    Range uri;
+    std::vector<HeaderRange> headers;
+    // Index of the first header of each well known name or -1
+    int knownHeaders[KnownHeaders::Count];
+    Range postData;
 };
 
 } // namespace hserv
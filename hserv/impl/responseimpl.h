@@ -11,14 +11,17 @@ namespace hserv {
 template<typename Tag>
 struct ResponseImpl
 {
-    struct CaseInsensitive : public std::binary_function<std::string, std::string, bool> {
-        bool operator() (const std::string &left, const std::string &right) const {
-            return strcasecmp(left.c_str(), right.c_str()) < 0;
-        }
-    };
+    ResponseImpl()
+        : fileOffset(0), fileLength(0), status(0)
+    {
+    }
 
-    std::map<std::string,std::string, CaseInsensitive> headers;
+    HeaderMap headers;
     std::vector<char> content;
+    // The file is sent after the content.
+    boost::shared_ptr<FileHandle> file;
+    off_t fileOffset;
+    size_t fileLength;
     int status;
 
     static boost::asio::const_buffer httpVersionToBuffer(int major, int minor)
@@ -73,6 +76,10 @@ struct ResponseImpl
             "404 Not Found\r\n";
         static const std::string methodNotAllowed =
             "405 Method Not Allowed\r\n";
+        static const std::string payloadTooLarge =
+            "413 Payload Too Large\r\n";
+        static const std::string requestHeaderFieldsTooLarge =
+            "431 Request Header Fields Too Large\r\n";
         static const std::string internalServerError =
             "500 Internal Server Error\r\n";
         static const std::string notImplemented =
@@ -118,6 +125,10 @@ struct ResponseImpl
             return boost::asio::buffer(notFound);
         case Tag::MethodNotAllowed:
             return boost::asio::buffer(methodNotAllowed);
+        case Tag::PayloadTooLarge:
+            return boost::asio::buffer(payloadTooLarge);
+        case Tag::RequestHeaderFieldsTooLarge:
+            return boost::asio::buffer(requestHeaderFieldsTooLarge);
         case Tag::InternalServerError:
             return boost::asio::buffer(internalServerError);
         case Tag::NotImplemented:
@@ -206,6 +217,16 @@ struct ResponseImpl
             "<head><title>Method Not Allowed</title></head>"
             "<body><h1>405 Method Not Allowed</h1></body>"
             "</html>";
+        const char payloadTooLarge[] =
+            "<html>"
+            "<head><title>Payload Too Large</title></head>"
+            "<body><h1>413 Payload Too Large</h1></body>"
+            "</html>";
+        const char requestHeaderFieldsTooLarge[] =
+            "<html>"
+            "<head><title>Request Header Fields Too Large</title></head>"
+            "<body><h1>431 Request Header Fields Too Large</h1></body>"
+            "</html>";
         const char internalServerError[] =
             "<html>"
             "<head><title>Internal Server Error</title></head>"
@@ -264,6 +285,10 @@ struct ResponseImpl
             return notFound;
         case Tag::MethodNotAllowed:
             return methodNotAllowed;
+        case Tag::PayloadTooLarge:
+            return payloadTooLarge;
+        case Tag::RequestHeaderFieldsTooLarge:
+            return requestHeaderFieldsTooLarge;
         case Tag::InternalServerError:
             return internalServerError;
         case Tag::NotImplemented:
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_SMALLVECTOR_H
+#define HSERV_SMALLVECTOR_H
+
+#include <algorithm>
+#include <cstddef>
+
+namespace hserv {
+
+// A vector of trivially copyable elements which keeps the first N of them inline,
+// the heap is used only when it grows beyond that. The memory is kept by clear()
+// and by assignment.
+template<typename T, size_t N>
+class SmallVector
+{
+public:
+    SmallVector()
+        : ptr(inlineData), count(0), capacity(N)
+    {
+    }
+
+    SmallVector(const SmallVector &other)
+        : ptr(inlineData), count(0), capacity(N)
+    {
+        append(other.ptr, other.count);
+    }
+
+    ~SmallVector()
+    {
+        if( ptr != inlineData )
+            delete[] ptr;
+    }
+
+    SmallVector &operator=(const SmallVector &other)
+    {
+        if( this != &other )
+        {
+            count = 0;
+            append(other.ptr, other.count);
+        }
+
+        return *this;
+    }
+
+    void append(const T *data, size_t size)
+    {
+        if( data >= ptr && data < ptr + count )
+        {
+            // the data is a part of this vector
+            size_t offset = data - ptr;
+
+            reserve(count + size);
+            data = ptr + offset;
+        }
+        else
+        {
+            reserve(count + size);
+        }
+
+        std::copy(data, data + size, ptr + count);
+        count += size;
+    }
+
+    void push_back(const T &value)
+    {
+        append(&value, 1);
+    }
+
+    void erase(size_t index)
+    {
+        std::copy(ptr + index + 1, ptr + count, ptr + index);
+        --count;
+    }
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    void reserve(size_t size)
+    {
+        if( size <= capacity )
+            return;
+
+        size_t newCapacity = std::max(size, capacity * 2);
+        T *newPtr = new T[newCapacity];
+
+        std::copy(ptr, ptr + count, newPtr);
+
+        if( ptr != inlineData )
+            delete[] ptr;
+
+        ptr = newPtr;
+        capacity = newCapacity;
+    }
+
+    T &operator[](size_t index)
+    {
+        return ptr[index];
+    }
+
+    const T &operator[](size_t index) const
+    {
+        return ptr[index];
+    }
+
+    const T *data() const
+    {
+        return ptr;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+private:
+    T inlineData[N];
+    T *ptr;
+    size_t count;
+    size_t capacity;
+};
+
+} // namespace hserv
+
+#endif // HSERV_SMALLVECTOR_H
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_TIMERWHEEL_H
+#define HSERV_TIMERWHEEL_H
+
+#include <cassert>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace hserv {
+
+// Timeouts of the connections of an io_service: one timer of the io_service
+// ticks while any timeout is scheduled, instead of a timer per connection.
+//
+// A hierarchical wheel of 100 ms ticks: the first level has a slot for each
+// of the next 256 ticks, every next level has 64 slots, each of them covers
+// a whole turn of the previous level. Scheduling and cancelling are O(1),
+// entries are moved down to the first level when their turn comes.
+//
+// Not thread safe: the io_service must be run by one thread, as the servers
+// do in the thread pool mode. Debug builds assert that while any timeout is
+// scheduled the wheel is used by one thread only.
+template<typename Tag>
+class BasicTimerWheel : public boost::asio::io_service::service
+{
+    struct Link
+    {
+        Link() : prev(this), next(this) {}
+
+        bool linked() const
+        {
+            return next != this;
+        }
+
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+
+        void pushBack(Link *link)
+        {
+            link->prev = prev;
+            link->next = this;
+            prev->next = link;
+            prev = link;
+        }
+
+        Link *prev;
+        Link *next;
+    };
+
+public:
+    static boost::asio::io_service::id id;
+
+    typedef boost::asio::steady_timer::clock_type Clock;
+
+    // A timeout owned by a connection, it is cancelled by the destructor.
+    class Entry : private Link, private boost::noncopyable
+    {
+    public:
+        explicit Entry(const boost::function<void()> &handler)
+            : handler(handler), wheel(NULL), expires(0)
+        {
+        }
+
+        ~Entry()
+        {
+            cancel();
+        }
+
+        bool scheduled() const
+        {
+            return this->linked();
+        }
+
+        void cancel()
+        {
+            if( this->linked() )
+            {
+                wheel->checkThread();
+                this->unlink();
+                --wheel->count;
+            }
+        }
+
+    private:
+        friend class BasicTimerWheel;
+
+        boost::function<void()> handler;
+        BasicTimerWheel *wheel;
+        boost::uint64_t expires;
+    };
+
+    enum { tickMs = 100 };
+
+    explicit BasicTimerWheel(boost::asio::io_service &ioService)
+        : boost::asio::io_service::service(ioService), timer(ioService),
+          origin(Clock::now()), current(0), count(0), running(false)
+    {
+    }
+
+    // Call the handler of the entry after the timeout, a scheduled entry
+    // is moved. The timeout is rounded up to the tick.
+    void schedule(Entry &entry, unsigned int timeoutMs)
+    {
+        checkThread();
+        entry.cancel();
+
+        if( running == false )
+            current = now();
+
+        boost::uint64_t ticks = (timeoutMs + tickMs - 1) / tickMs;
+
+        entry.wheel = this;
+        entry.expires = now() + (ticks ? ticks : 1);
+        insert(&entry);
+        ++count;
+
+        if( running == false )
+            startTimer();
+    }
+
+    // Number of scheduled entries
+    size_t size() const
+    {
+        return count;
+    }
+
+private:
+    enum {
+        level0Bits = 8,
+        levelBits = 6,
+        level0Size = 1 << level0Bits,
+        levelSize = 1 << levelBits,
+        levels = 3
+    };
+
+    // Boost.Asio 1.66 and newer
+    virtual void shutdown()
+    {
+        cancel();
+    }
+
+    // Older Boost.Asio
+    virtual void shutdown_service()
+    {
+        cancel();
+    }
+
+    // Forget the entries, their owners are destroyed with the io_service.
+    void cancel()
+    {
+        boost::system::error_code ignored_ec;
+        timer.cancel(ignored_ec);
+        running = false;
+        owner = boost::thread::id();
+
+        for(int i = 0; i < level0Size; ++i)
+            clear(level0[i]);
+
+        for(int level = 0; level < levels; ++level)
+        {
+            for(int i = 0; i < levelSize; ++i)
+                clear(upper[level][i]);
+        }
+
+        count = 0;
+    }
+
+    static void clear(Link &list)
+    {
+        while( list.linked() )
+            list.next->unlink();
+    }
+
+    boost::uint64_t now() const
+    {
+        return boost::asio::chrono::duration_cast<boost::asio::chrono::milliseconds>(
+                    Clock::now() - origin).count() / tickMs;
+    }
+
+    static size_t index(boost::uint64_t tick, int level)
+    {
+        return (tick >> (level0Bits + level * levelBits)) & (levelSize - 1);
+    }
+
+    void insert(Entry *entry)
+    {
+        boost::uint64_t delta = entry->expires - current;
+
+        if( delta < level0Size )
+        {
+            level0[entry->expires & (level0Size - 1)].pushBack(entry);
+            return;
+        }
+
+        for(int level = 0; level < levels; ++level)
+        {
+            boost::uint64_t range = boost::uint64_t(1) << (level0Bits + (level + 1) * levelBits);
+
+            if( delta < range || level == levels - 1 )
+            {
+                // beyond the wheel the timeout is shortened to its range
+                if( delta >= range )
+                    entry->expires = current + range - 1;
+
+                upper[level][index(entry->expires, level)].pushBack(entry);
+                return;
+            }
+        }
+    }
+
+    // Distribute the entries of the slot to the lower levels.
+    void cascade(Link &list)
+    {
+        Link pending;
+
+        while( list.linked() )
+        {
+            Link *link = list.next;
+
+            link->unlink();
+            pending.pushBack(link);
+        }
+
+        while( pending.linked() )
+        {
+            Entry *entry = static_cast<Entry *>(pending.next);
+
+            entry->unlink();
+            insert(entry);
+        }
+    }
+
+    void advance(boost::uint64_t until)
+    {
+        while( current < until && count > 0 )
+        {
+            ++current;
+
+            size_t slot = current & (level0Size - 1);
+
+            for(int level = 0; slot == 0 && level < levels; ++level)
+            {
+                slot = index(current, level);
+                cascade(upper[level][slot]);
+            }
+
+            // Handlers may schedule or cancel any entry, so the expired
+            // ones are taken from the wheel first.
+            Link expired;
+            Link &list = level0[current & (level0Size - 1)];
+
+            while( list.linked() )
+            {
+                Link *link = list.next;
+
+                link->unlink();
+                expired.pushBack(link);
+            }
+
+            while( expired.linked() )
+            {
+                Entry *entry = static_cast<Entry *>(expired.next);
+
+                entry->unlink();
+                --count;
+                entry->handler();
+            }
+        }
+
+        if( current < until )
+            current = until;
+    }
+
+    void startTimer()
+    {
+        running = true;
+        timer.expires_at(origin + boost::asio::chrono::milliseconds((current + 1) * tickMs));
+        timer.async_wait(boost::bind(&BasicTimerWheel::handleTimer, this,
+                                     boost::asio::placeholders::error));
+    }
+
+    void handleTimer(const boost::system::error_code &ec)
+    {
+        if( ec )
+            return;
+
+        checkThread();
+        advance(now());
+
+        if( count > 0 )
+        {
+            startTimer();
+        }
+        else
+        {
+            // idle, the io_service may be run by another thread now
+            running = false;
+            owner = boost::thread::id();
+        }
+    }
+
+    void checkThread()
+    {
+#ifndef NDEBUG
+        boost::thread::id self = boost::this_thread::get_id();
+
+        if( owner == boost::thread::id() )
+            owner = self;
+
+        assert( owner == self );
+#endif
+    }
+
+    boost::asio::steady_timer timer;
+    const Clock::time_point origin;
+    // The last processed tick
+    boost::uint64_t current;
+    size_t count;
+    bool running;
+    // The thread using the wheel while it is running
+    boost::thread::id owner;
+
+    Link level0[level0Size];
+    Link upper[levels][levelSize];
+};
+
+template<typename Tag>
+boost::asio::io_service::id BasicTimerWheel<Tag>::id;
+
+typedef BasicTimerWheel<void> TimerWheel;
+
+} // namespace hserv
+
+#endif // HSERV_TIMERWHEEL_H
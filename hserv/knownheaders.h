@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_KNOWNHEADERS_H
+#define HSERV_KNOWNHEADERS_H
+
+#include <cassert>
+#include <boost/utility/string_ref.hpp>
+
+#include <hserv/header.h>
+
+namespace hserv {
+
+// Request headers recognized while parsing. A request keeps a table indexed
+// by Id, so these headers are found without comparing names.
+struct KnownHeaders
+{
+    enum Id {
+        Host,
+        Connection,
+        ContentLength,
+        ContentType,
+        TransferEncoding,
+        Accept,
+        AcceptEncoding,
+        AcceptLanguage,
+        AcceptCharset,
+        UserAgent,
+        Cookie,
+        Authorization,
+        IfNoneMatch,
+        IfModifiedSince,
+        IfMatch,
+        Range,
+        Expect,
+        Upgrade,
+        Referer,
+        CacheControl,
+        KeepAlive,
+        Origin,
+        XForwardedFor,
+        XRequestedWith,
+        Pragma,
+
+        Count,
+        Unknown = Count
+    };
+
+    static boost::string_ref name(Id id)
+    {
+        static const boost::string_ref names[Count] = {
+            "Host",
+            "Connection",
+            "Content-Length",
+            "Content-Type",
+            "Transfer-Encoding",
+            "Accept",
+            "Accept-Encoding",
+            "Accept-Language",
+            "Accept-Charset",
+            "User-Agent",
+            "Cookie",
+            "Authorization",
+            "If-None-Match",
+            "If-Modified-Since",
+            "If-Match",
+            "Range",
+            "Expect",
+            "Upgrade",
+            "Referer",
+            "Cache-Control",
+            "Keep-Alive",
+            "Origin",
+            "X-Forwarded-For",
+            "X-Requested-With",
+            "Pragma"
+        };
+
+        return id < Count ? names[id] : boost::string_ref();
+    }
+
+    // Classify the header name, one comparison at most.
+    static Id find(const boost::string_ref &name)
+    {
+        if( name.empty() )
+            return Unknown;
+
+        Id id = static_cast<Id>(table().slots[hash(name)]);
+
+        if( id != Unknown && equalsIgnoreCase(KnownHeaders::name(id), name) )
+            return id;
+        else
+            return Unknown;
+    }
+
+private:
+    enum { tableSize = 64 };
+
+    // The length, the first and the last letters give distinct values
+    // for all the names above.
+    static unsigned int hash(const boost::string_ref &name)
+    {
+        unsigned int first = static_cast<unsigned char>(name[0]) | 0x20;
+        unsigned int last = static_cast<unsigned char>(name[name.size() - 1]) | 0x20;
+
+        return (name.size() + first * 4 + last * 24) & (tableSize - 1);
+    }
+
+    struct Table {
+        Table()
+        {
+            for(int i = 0; i < tableSize; ++i)
+                slots[i] = Unknown;
+
+            for(int i = 0; i < Count; ++i)
+            {
+                unsigned int h = hash(name(static_cast<Id>(i)));
+
+                assert( slots[h] == Unknown );
+                slots[h] = static_cast<unsigned char>(i);
+            }
+        }
+
+        unsigned char slots[tableSize];
+    };
+
+    static const Table &table()
+    {
+        static const Table instance;
+        return instance;
+    }
+};
+
+} // namespace hserv
+
+#endif // HSERV_KNOWNHEADERS_H
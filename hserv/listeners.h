@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_LISTENERS_H
+#define HSERV_LISTENERS_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/placeholders.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace hserv {
+
+// Listening sockets which outlive a process. The servers can be constructed
+// from an open socket, so a new version of the program takes over the port
+// while the old one finishes its requests, no connection is refused meanwhile.
+//
+// The sockets come from systemd socket activation, from the parent process
+// or from the running program over a Unix socket, see ListenerHandoff.
+// POSIX only.
+struct Listeners
+{
+    enum {
+        // The first descriptor passed by systemd
+        systemdFirstFd = 3,
+        // Sockets in one handoff
+        maxListeners = 64
+    };
+
+    // Open a listening TCP socket. The descriptor is inherited by the child
+    // processes, the server constructed from it takes its ownership.
+    static int listen(const std::string &address, int port)
+    {
+        boost::asio::io_service ioService;
+        boost::asio::ip::tcp::resolver resolver(ioService);
+        boost::asio::ip::tcp::resolver::query query(address, std::string() );
+        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+        boost::asio::ip::tcp::acceptor acceptor(ioService);
+
+        endpoint.port(port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+
+        int fd = ::dup(acceptor.native_handle());
+
+        if( fd < 0 )
+            throw boost::system::system_error(errno, boost::system::system_category(), "dup");
+
+        return fd;
+    }
+
+    // Sockets of systemd socket activation (LISTEN_PID, LISTEN_FDS), the variables
+    // are removed from the environment.
+    static std::vector<int> fromSystemd()
+    {
+        std::vector<int> fds;
+        const char *pid = ::getenv("LISTEN_PID");
+        const char *count = ::getenv("LISTEN_FDS");
+
+        if( pid != NULL && count != NULL && std::strtol(pid, NULL, 10) == ::getpid() )
+        {
+            long n = std::strtol(count, NULL, 10);
+
+            for(long i = 0; i < n; ++i)
+            {
+                int fd = systemdFirstFd + static_cast<int>(i);
+
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                fds.push_back(fd);
+            }
+        }
+
+        ::unsetenv("LISTEN_PID");
+        ::unsetenv("LISTEN_FDS");
+        ::unsetenv("LISTEN_FDNAMES");
+
+        return fds;
+    }
+
+    // Take the sockets of the running program which waits at `path` with
+    // ListenerHandoff. Empty if nobody waits, then the program opens its own.
+    static std::vector<int> receive(const std::string &path)
+    {
+        std::vector<int> fds;
+        sockaddr_un addr;
+
+        if( path.size() >= sizeof(addr.sun_path) )
+            return fds;
+
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.data(), path.size());
+
+        int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if( sock < 0 )
+            return fds;
+
+        if( ::connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 )
+            fds = receiveDescriptors(sock);
+
+        ::close(sock);
+        return fds;
+    }
+
+    // The protocol of an open TCP socket, for acceptor::assign().
+    static boost::asio::ip::tcp tcpProtocol(int fd)
+    {
+        sockaddr_storage addr;
+        socklen_t size = sizeof(addr);
+
+        if( ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &size) == 0 &&
+                addr.ss_family == AF_INET6 )
+            return boost::asio::ip::tcp::v6();
+        else
+            return boost::asio::ip::tcp::v4();
+    }
+
+    static bool isUnixSocket(int fd)
+    {
+        sockaddr_storage addr;
+        socklen_t size = sizeof(addr);
+
+        return ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &size) == 0 &&
+                addr.ss_family == AF_UNIX;
+    }
+
+private:
+    friend class ListenerHandoff;
+
+    // The process at the other end of a Unix socket runs as the same user.
+    static bool peerIsOwner(int sock)
+    {
+#ifdef SO_PEERCRED
+        ucred cred;
+        socklen_t size = sizeof(cred);
+
+        return ::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0 &&
+                cred.uid == ::getuid();
+#else
+        uid_t uid;
+        gid_t gid;
+
+        return ::getpeereid(sock, &uid, &gid) == 0 && uid == ::getuid();
+#endif
+    }
+
+    // One message: the number of sockets and the sockets as SCM_RIGHTS.
+    static bool sendDescriptors(int sock, const std::vector<int> &fds)
+    {
+        if( fds.empty() || fds.size() > static_cast<size_t>(maxListeners) )
+        {
+            errno = EINVAL;
+            return false;
+        }
+
+        boost::uint32_t count = static_cast<boost::uint32_t>(fds.size());
+        char control[CMSG_SPACE(maxListeners * sizeof(int))];
+        iovec iov = { &count, sizeof(count) };
+        msghdr msg;
+
+        std::memset(&msg, 0, sizeof(msg));
+        std::memset(control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fds[0], fds.size() * sizeof(int));
+
+        return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(count));
+    }
+
+    static std::vector<int> receiveDescriptors(int sock)
+    {
+        std::vector<int> fds;
+        boost::uint32_t count = 0;
+        char control[CMSG_SPACE(maxListeners * sizeof(int))];
+        iovec iov = { &count, sizeof(count) };
+        msghdr msg;
+
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if( ::recvmsg(sock, &msg, 0) != static_cast<ssize_t>(sizeof(count)) )
+            return fds;
+
+        for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len > CMSG_LEN(0) )
+            {
+                size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+                fds.resize(n);
+                std::memcpy(&fds[0], CMSG_DATA(cmsg), n * sizeof(int));
+            }
+        }
+
+        if( fds.size() != count || (msg.msg_flags & MSG_CTRUNC) )
+        {
+            for(size_t i = 0; i < fds.size(); ++i)
+                ::close(fds[i]);
+
+            fds.clear();
+        }
+
+        return fds;
+    }
+};
+
+// Waits at a Unix socket for the next version of the program, which calls
+// Listeners::receive(), and passes the listening sockets to it. Then the
+// handler is called, usually it drains the servers of this process: both
+// programs accept connections from the same sockets until the drain.
+// Only the processes of the same user get the sockets.
+class ListenerHandoff : private boost::noncopyable
+{
+public:
+    ListenerHandoff(boost::asio::io_service &ioService, const std::string &path,
+                    const std::vector<int> &fds, const boost::function<void()> &handler)
+        : path(path), fds(fds), handler(handler), acceptor(ioService), socket(ioService)
+    {
+    }
+
+    void start()
+    {
+        ::unlink(path.c_str());
+
+        acceptor.open(boost::asio::local::stream_protocol());
+
+        // The socket is created with 0600, it is never reachable by other users.
+        boost::system::error_code ec;
+        mode_t mask = ::umask(S_IRWXG | S_IRWXO | S_IXUSR);
+
+        acceptor.bind(boost::asio::local::stream_protocol::endpoint(path), ec);
+        ::umask(mask);
+
+        if( ec )
+            throw boost::system::system_error(ec, path);
+
+        acceptor.listen();
+        acceptor.async_accept(socket, boost::bind(&ListenerHandoff::handleAccept, this,
+                                                  boost::asio::placeholders::error));
+    }
+
+    // The path is left, the next program binds it again.
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor.close(ignored_ec);
+    }
+
+private:
+    void handleAccept(const boost::system::error_code &ec)
+    {
+        if( ec )
+            return;
+
+        int sock = socket.native_handle();
+        bool sent = false;
+        int error = EPERM;
+        boost::system::error_code ignored_ec;
+
+        if( Listeners::peerIsOwner(sock) )
+        {
+            sent = Listeners::sendDescriptors(sock, fds);
+            error = errno;
+        }
+
+        socket.close(ignored_ec);
+
+        if( sent )
+        {
+            stop();
+
+            if( handler )
+                handler();
+        }
+        else
+        {
+            std::cerr << "ListenerHandoff: " << std::strerror(error) << std::endl;
+            acceptor.async_accept(socket, boost::bind(&ListenerHandoff::handleAccept, this,
+                                                      boost::asio::placeholders::error));
+        }
+    }
+
+    std::string path;
+    std::vector<int> fds;
+    boost::function<void()> handler;
+    boost::asio::local::stream_protocol::acceptor acceptor;
+    boost::asio::local::stream_protocol::socket socket;
+};
+
+} // namespace hserv
+
+#endif // HSERV_LISTENERS_H
@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_METRICS_H
+#define HSERV_METRICS_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <hserv/response.h>
+
+namespace hserv {
+
+// Latencies in nanoseconds, HDR-style: 16 linear sub-buckets in every power
+// of two, so a value is stored with at most 6.25% error. Values above 2^44 ns
+// (about 4.9 hours) are counted in the last bucket.
+class LatencyHistogram
+{
+public:
+    enum {
+        subBucketBits = 4,
+        subBucketCount = 1 << subBucketBits,
+        maxValueBits = 44,
+        bucketCount = (maxValueBits - subBucketBits + 1) * subBucketCount
+    };
+
+    LatencyHistogram()
+        : counts(bucketCount), count(0), sum(0)
+    {
+    }
+
+    static size_t bucketIndex(boost::uint64_t value)
+    {
+        if( value < subBucketCount )
+            return static_cast<size_t>(value);
+
+        if( value >> maxValueBits )
+            return bucketCount - 1;
+
+        int msb = log2(value);
+        int shift = msb - subBucketBits;
+
+        return (msb - subBucketBits + 1) * subBucketCount +
+                static_cast<size_t>(value >> shift) - subBucketCount;
+    }
+
+    // The largest value of the bucket.
+    static boost::uint64_t bucketUpperBound(size_t index)
+    {
+        if( index < 2 * subBucketCount )
+            return index;
+
+        int shift = static_cast<int>(index / subBucketCount) - 1;
+        boost::uint64_t mantissa = subBucketCount + index % subBucketCount;
+
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    void add(const LatencyHistogram &other)
+    {
+        for(size_t i = 0; i < counts.size(); ++i)
+            counts[i] += other.counts[i];
+
+        count += other.count;
+        sum += other.sum;
+    }
+
+    // The value below which the given fraction (0..1) of the values is, the
+    // upper bound of its bucket. Zero if the histogram is empty.
+    boost::uint64_t percentile(double fraction) const
+    {
+        boost::uint64_t rank = static_cast<boost::uint64_t>(fraction * count + 0.5);
+        boost::uint64_t seen = 0;
+
+        if( rank == 0 )
+            rank = 1;
+
+        for(size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+
+            if( seen >= rank )
+                return bucketUpperBound(i);
+        }
+
+        return 0;
+    }
+
+    std::vector<boost::uint64_t> counts;
+    boost::uint64_t count;
+    // Total of the values
+    boost::uint64_t sum;
+
+private:
+    static int log2(boost::uint64_t value)
+    {
+        int result = 0;
+
+        for(int bits = 32; bits > 0; bits /= 2)
+        {
+            if( value >> bits )
+            {
+                value >>= bits;
+                result += bits;
+            }
+        }
+
+        return result;
+    }
+};
+
+// Counters and latency histograms of a server, set them to
+// ServerSettings::metrics. The same object may be shared by several servers.
+//
+// Each thread updates its own shard without atomic read-modify-write
+// operations, a snapshot sums the shards. The object is thread safe.
+class ServerMetrics : private boost::noncopyable
+{
+public:
+    // Phases of a request:
+    //  - parse: from the first byte of the request to the call of the handler,
+    //  - handler: until the handler starts the response,
+    //  - write: until the response is sent.
+    enum Phase { ParsePhase, HandlerPhase, WritePhase, phaseCount };
+
+    struct Snapshot
+    {
+        Snapshot()
+            : accepted(0), closed(0), active(0), requests(0), keepAliveReused(0),
+              parseErrors(0), bytesIn(0), bytesOut(0)
+        {
+            for(int i = 0; i < statusClasses; ++i)
+                responses[i] = 0;
+        }
+
+        enum { statusClasses = 5 };
+
+        boost::uint64_t accepted;
+        boost::uint64_t closed;
+        // Open connections
+        boost::uint64_t active;
+        boost::uint64_t requests;
+        // Requests after the first one on their connections
+        boost::uint64_t keepAliveReused;
+        boost::uint64_t parseErrors;
+        boost::uint64_t bytesIn;
+        boost::uint64_t bytesOut;
+        // Completed responses by the class of the status: 1xx ... 5xx
+        boost::uint64_t responses[statusClasses];
+
+        LatencyHistogram phases[phaseCount];
+    };
+
+    ServerMetrics()
+        : current(&ServerMetrics::keepShard)
+    {
+    }
+
+    ~ServerMetrics()
+    {
+        for(size_t i = 0; i < shards.size(); ++i)
+            delete shards[i];
+    }
+
+    void connectionAccepted()
+    {
+        increment(shard().accepted);
+    }
+
+    void connectionClosed()
+    {
+        increment(shard().closed);
+    }
+
+    void requestStarted(bool reused)
+    {
+        Shard &local = shard();
+
+        increment(local.requests);
+
+        if( reused )
+            increment(local.keepAliveReused);
+    }
+
+    void parseError()
+    {
+        increment(shard().parseErrors);
+    }
+
+    void received(size_t bytes)
+    {
+        increment(shard().bytesIn, bytes);
+    }
+
+    void sent(size_t bytes)
+    {
+        increment(shard().bytesOut, bytes);
+    }
+
+    void responseCompleted(int status)
+    {
+        int statusClass = status / 100 - 1;
+
+        if( statusClass >= 0 && statusClass < Snapshot::statusClasses )
+            increment(shard().responses[statusClass]);
+    }
+
+    void record(Phase phase, boost::uint64_t nanoseconds)
+    {
+        Histogram &histogram = shard().phases[phase];
+
+        increment(histogram.counts[LatencyHistogram::bucketIndex(nanoseconds)]);
+        increment(histogram.count);
+        increment(histogram.sum, nanoseconds);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot result;
+        boost::mutex::scoped_lock lock(mutex);
+
+        for(size_t i = 0; i < shards.size(); ++i)
+        {
+            const Shard &shard = *shards[i];
+
+            result.accepted += shard.accepted.load(boost::memory_order_relaxed);
+            result.closed += shard.closed.load(boost::memory_order_relaxed);
+            result.requests += shard.requests.load(boost::memory_order_relaxed);
+            result.keepAliveReused += shard.keepAliveReused.load(boost::memory_order_relaxed);
+            result.parseErrors += shard.parseErrors.load(boost::memory_order_relaxed);
+            result.bytesIn += shard.bytesIn.load(boost::memory_order_relaxed);
+            result.bytesOut += shard.bytesOut.load(boost::memory_order_relaxed);
+
+            for(int j = 0; j < Snapshot::statusClasses; ++j)
+                result.responses[j] += shard.responses[j].load(boost::memory_order_relaxed);
+
+            for(int phase = 0; phase < phaseCount; ++phase)
+            {
+                const Histogram &from = shard.phases[phase];
+                LatencyHistogram &to = result.phases[phase];
+
+                for(size_t j = 0; j < LatencyHistogram::bucketCount; ++j)
+                    to.counts[j] += from.counts[j].load(boost::memory_order_relaxed);
+
+                to.count += from.count.load(boost::memory_order_relaxed);
+                to.sum += from.sum.load(boost::memory_order_relaxed);
+            }
+        }
+
+        // the shards are not read at once
+        result.active = result.accepted > result.closed ? result.accepted - result.closed : 0;
+        return result;
+    }
+
+    // The snapshot in the Prometheus text format.
+    std::string prometheus() const
+    {
+        static const char *phaseNames[phaseCount] = { "parse", "handler", "write" };
+        // seconds
+        static const double bounds[] = {
+            0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+            0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+        };
+
+        Snapshot s = snapshot();
+        std::string out;
+
+        out.reserve(8192);
+        counter(out, "hserv_connections_accepted_total", "Accepted connections.", s.accepted);
+        out += "# HELP hserv_connections_active Open connections.\n"
+               "# TYPE hserv_connections_active gauge\n";
+        sample(out, "hserv_connections_active", s.active);
+        counter(out, "hserv_requests_total", "Started requests.", s.requests);
+        counter(out, "hserv_keepalive_requests_total",
+                "Requests on reused connections.", s.keepAliveReused);
+        counter(out, "hserv_parse_errors_total", "Malformed requests.", s.parseErrors);
+        counter(out, "hserv_received_bytes_total", "Bytes read from the clients.", s.bytesIn);
+        counter(out, "hserv_sent_bytes_total", "Bytes written to the clients.", s.bytesOut);
+
+        out += "# HELP hserv_responses_total Completed responses by status class.\n"
+               "# TYPE hserv_responses_total counter\n";
+
+        for(int i = 0; i < Snapshot::statusClasses; ++i)
+        {
+            char name[64];
+
+            snprintf(name, sizeof(name), "hserv_responses_total{code=\"%dxx\"}", i + 1);
+            sample(out, name, s.responses[i]);
+        }
+
+        out += "# HELP hserv_request_phase_seconds Latency of the request phases.\n"
+               "# TYPE hserv_request_phase_seconds histogram\n";
+
+        for(int phase = 0; phase < phaseCount; ++phase)
+        {
+            const LatencyHistogram &histogram = s.phases[phase];
+            boost::uint64_t cumulative = 0;
+            size_t bucket = 0;
+            char name[128];
+
+            for(size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i)
+            {
+                // buckets entirely below the bound, values are rounded to them
+                boost::uint64_t limit = static_cast<boost::uint64_t>(bounds[i] * 1e9);
+
+                while( bucket < LatencyHistogram::bucketCount &&
+                       LatencyHistogram::bucketUpperBound(bucket) <= limit )
+                    cumulative += histogram.counts[bucket++];
+
+                snprintf(name, sizeof(name),
+                         "hserv_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"}",
+                         phaseNames[phase], bounds[i]);
+                sample(out, name, cumulative);
+            }
+
+            snprintf(name, sizeof(name),
+                     "hserv_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"}",
+                     phaseNames[phase]);
+            sample(out, name, histogram.count);
+
+            snprintf(name, sizeof(name), "hserv_request_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+                     phaseNames[phase], histogram.sum / 1e9);
+            out += name;
+
+            snprintf(name, sizeof(name), "hserv_request_phase_seconds_count{phase=\"%s\"}",
+                     phaseNames[phase]);
+            sample(out, name, histogram.count);
+        }
+
+        return out;
+    }
+
+    // Answer with prometheus(), for a "/metrics" route of the handler.
+    void serve(Response &response) const
+    {
+        std::string text = prometheus();
+
+        response.setStatus(Response::Ok);
+        response.addHeader("Content-Type", "text/plain; version=0.0.4");
+        response.setContent(std::vector<char>(text.begin(), text.end()));
+    }
+
+private:
+    typedef boost::atomic<boost::uint64_t> Counter;
+
+    struct Histogram
+    {
+        Histogram()
+            : count(0), sum(0)
+        {
+            for(size_t i = 0; i < LatencyHistogram::bucketCount; ++i)
+                counts[i].store(0, boost::memory_order_relaxed);
+        }
+
+        Counter counts[LatencyHistogram::bucketCount];
+        Counter count;
+        Counter sum;
+    };
+
+    enum { cacheLineSize = 64 };
+
+    // Written by its thread only, the padding keeps the shards of the threads
+    // on their own cache lines.
+    struct Shard : private boost::noncopyable
+    {
+        Shard()
+            : accepted(0), closed(0), requests(0), keepAliveReused(0),
+              parseErrors(0), bytesIn(0), bytesOut(0)
+        {
+            for(int i = 0; i < Snapshot::statusClasses; ++i)
+                responses[i].store(0, boost::memory_order_relaxed);
+        }
+
+        char padding0[cacheLineSize];
+        Counter accepted;
+        Counter closed;
+        Counter requests;
+        Counter keepAliveReused;
+        Counter parseErrors;
+        Counter bytesIn;
+        Counter bytesOut;
+        Counter responses[Snapshot::statusClasses];
+        Histogram phases[phaseCount];
+        char padding1[cacheLineSize];
+    };
+
+    // A single writer, the readers see either value.
+    static void increment(Counter &counter, boost::uint64_t value = 1)
+    {
+        counter.store(counter.load(boost::memory_order_relaxed) + value,
+                      boost::memory_order_relaxed);
+    }
+
+    static void counter(std::string &out, const char *name, const char *help,
+                        boost::uint64_t value)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += " counter\n";
+        sample(out, name, value);
+    }
+
+    static void sample(std::string &out, const char *name, boost::uint64_t value)
+    {
+        char buffer[32];
+
+        snprintf(buffer, sizeof(buffer), " %llu\n", static_cast<unsigned long long>(value));
+        out += name;
+        out += buffer;
+    }
+
+    // The shards outlive their threads, the counts are kept.
+    static void keepShard(Shard *)
+    {
+    }
+
+    Shard &shard()
+    {
+        Shard *local = current.get();
+
+        if( local == NULL )
+        {
+            local = new Shard;
+
+            boost::mutex::scoped_lock lock(mutex);
+            shards.push_back(local);
+            current.reset(local);
+        }
+
+        return *local;
+    }
+
+    boost::thread_specific_ptr<Shard> current;
+    mutable boost::mutex mutex;
+    std::vector<Shard *> shards;
+};
+
+} // namespace hserv
+
+#endif // HSERV_METRICS_H
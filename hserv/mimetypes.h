@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_MIMETYPES_H
+#define HSERV_MIMETYPES_H
+
+#include <cctype>
+#include <string>
+#include <boost/unordered_map.hpp>
+#include <boost/utility/string_ref.hpp>
+
+namespace hserv {
+
+// MIME types by the file extension.
+class MimeTypes
+{
+public:
+    // The type of the file by its last extension, case insensitive.
+    static const char *find(const boost::string_ref &fileName)
+    {
+        static const Map &map = instance();
+
+        size_t dot = fileName.rfind('.');
+        size_t slash = fileName.rfind('/');
+
+        if( dot != boost::string_ref::npos &&
+                (slash == boost::string_ref::npos || dot > slash) &&
+                fileName.size() - dot <= static_cast<size_t>(maxExtensionSize) )
+        {
+            char ext[maxExtensionSize];
+            size_t size = fileName.size() - dot;
+
+            for(size_t i = 0; i < size; ++i)
+                ext[i] = static_cast<char>(tolower(static_cast<unsigned char>(fileName[dot + i])));
+
+            Map::const_iterator it = map.find(std::string(ext, size));
+
+            if( it != map.end() )
+                return it->second;
+        }
+
+        return defaultType();
+    }
+
+    static const char *defaultType()
+    {
+        return "application/octet-stream";
+    }
+
+private:
+    typedef boost::unordered_map<std::string, const char *> Map;
+
+    // Longer extensions are not in the table, the key fits into the small string buffer.
+    enum { maxExtensionSize = 15 };
+
+    static const Map &instance()
+    {
+        struct Entry {
+            const char *ext;
+            const char *mime;
+        };
+
+        static const Entry table[] = {
+            { ".html",    "text/html" },
+            { ".htm",     "text/html" },
+            { ".js",      "text/javascript" },
+            { ".gif",     "image/gif" },
+            { ".jpeg",    "image/jpeg" },
+            { ".jpg",     "image/jpeg" },
+            { ".jpe",     "image/jpeg" },
+            { ".png",     "image/png" },
+            { ".mp3",     "audio/mpeg" },
+            { ".css",     "text/css" },
+            { ".txt",     "text/plain" },
+            { ".swf",     "application/x-shockwave-flash" },
+            { ".dcr",     "application/x-director" },
+            { ".pac",     "application/x-ns-proxy-autoconfig" },
+            { ".pa",      "application/x-ns-proxy-autoconfig" },
+            { ".tar",     "multipart/x-tar" },
+            { ".gtar",    "multipart/x-gtar" },
+            { ".tar.Z",   "multipart/x-tar" },
+            { ".tar.gz",  "multipart/x-tar" },
+            { ".taz",     "multipart/x-tar" },
+            { ".tgz",     "multipart/x-tar" },
+            { ".tar.z",   "multipart/x-tar" },
+            { ".Z",       "application/x-compress" },
+            { ".gz",      "application/x-gzip" },
+            { ".z",       "unknown" },
+            { ".bz2",     "application/x-bzip2" },
+            { ".ogg",     "application/x-ogg" },
+            { ".xbel",    "text/xml" },
+            { ".xml",     "text/xml" },
+            { ".xsl",     "text/xml" },
+            { ".hqx",     "application/mac-binhex40" },
+            { ".cpt",     "application/mac-compactpro" },
+            { ".doc",     "application/msword" },
+            { ".bin",     "application/octet-stream" },
+            { ".dms",     "application/octet-stream" },
+            { ".lha",     "application/octet-stream" },
+            { ".lzh",     "application/octet-stream" },
+            { ".exe",     "application/octet-stream" },
+            { ".class",   "application/octet-stream" },
+            { ".oda",     "application/oda" },
+            { ".pdf",     "application/pdf" },
+            { ".ai",      "application/postscript" },
+            { ".eps",     "application/postscript" },
+            { ".ps",      "application/postscript" },
+            { ".ppt",     "application/powerpoint" },
+            { ".rtf",     "application/rtf" },
+            { ".bcpio",   "application/x-bcpio" },
+            { ".torrent", "application/x-bittorrent" },
+            { ".vcd",     "application/x-cdlink" },
+            { ".cpio",    "application/x-cpio" },
+            { ".csh",     "application/x-csh" },
+            { ".dir",     "application/x-director" },
+            { ".dxr",     "application/x-director" },
+            { ".dvi",     "application/x-dvi" },
+            { ".hdf",     "application/x-hdf" },
+            { ".cgi",     "application/x-httpd-cgi" },
+            { ".skp",     "application/x-koan" },
+            { ".skd",     "application/x-koan" },
+            { ".skt",     "application/x-koan" },
+            { ".skm",     "application/x-koan" },
+            { ".latex",   "application/x-latex" },
+            { ".mif",     "application/x-mif" },
+            { ".nc",      "application/x-netcdf" },
+            { ".cdf",     "application/x-netcdf" },
+            { ".patch",   "application/x-patch" },
+            { ".sh",      "application/x-sh" },
+            { ".shar",    "application/x-shar" },
+            { ".sit",     "application/x-stuffit" },
+            { ".sv4cpio", "application/x-sv4cpio" },
+            { ".sv4crc",  "application/x-sv4crc" },
+            { ".tar",     "application/x-tar" },
+            { ".tcl",     "application/x-tcl" },
+            { ".tex",     "application/x-tex" },
+            { ".texinfo", "application/x-texinfo" },
+            { ".texi",    "application/x-texinfo" },
+            { ".t",       "application/x-troff" },
+            { ".tr",      "application/x-troff" },
+            { ".roff",    "application/x-troff" },
+            { ".man",     "application/x-troff-man" },
+            { ".me",      "application/x-troff-me" },
+            { ".ms",      "application/x-troff-ms" },
+            { ".ustar",   "application/x-ustar" },
+            { ".src",     "application/x-wais-source" },
+            { ".zip",     "application/zip" },
+            { ".au",      "audio/basic" },
+            { ".snd",     "audio/basic" },
+            { ".mpga",    "audio/mpeg" },
+            { ".mp2",     "audio/mpeg" },
+            { ".aif",     "audio/x-aiff" },
+            { ".aiff",    "audio/x-aiff" },
+            { ".aifc",    "audio/x-aiff" },
+            { ".ram",     "audio/x-pn-realaudio" },
+            { ".rpm",     "audio/x-pn-realaudio-plugin" },
+            { ".ra",      "audio/x-realaudio" },
+            { ".wav",     "audio/x-wav" },
+            { ".pdb",     "chemical/x-pdb" },
+            { ".xyz",     "chemical/x-pdb" },
+            { ".ief",     "image/ief" },
+            { ".tiff",    "image/tiff" },
+            { ".tif",     "image/tiff" },
+            { ".ras",     "image/x-cmu-raster" },
+            { ".pnm",     "image/x-portable-anymap" },
+            { ".pbm",     "image/x-portable-bitmap" },
+            { ".pgm",     "image/x-portable-graymap" },
+            { ".ppm",     "image/x-portable-pixmap" },
+            { ".rgb",     "image/x-rgb" },
+            { ".xbm",     "image/x-xbitmap" },
+            { ".xpm",     "image/x-xpixmap" },
+            { ".xwd",     "image/x-xwindowdump" },
+            { ".ico",     "image/x-icon" },
+            { ".rtx",     "text/richtext" },
+            { ".tsv",     "text/tab-separated-values" },
+            { ".etx",     "text/x-setext" },
+            { ".sgml",    "text/x-sgml" },
+            { ".sgm",     "text/x-sgml" },
+            { ".mpeg",    "video/mpeg" },
+            { ".mpg",     "video/mpeg" },
+            { ".mpe",     "video/mpeg" },
+            { ".qt",      "video/quicktime" },
+            { ".mov",     "video/quicktime" },
+            { ".avi",     "video/x-msvideo" },
+            { ".movie",   "video/x-sgi-movie" },
+            { ".ice",     "x-conference/x-cooltalk" },
+            { ".wrl",     "x-world/x-vrml" },
+            { ".vrml",    "x-world/x-vrml" },
+        };
+
+        static Map map;
+
+        // The first entry of an extension wins.
+        for(size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i)
+        {
+            std::string ext = table[i].ext;
+
+            for(size_t j = 0; j < ext.size(); ++j)
+                ext[j] = static_cast<char>(tolower(static_cast<unsigned char>(ext[j])));
+
+            map.insert(Map::value_type(ext, table[i].mime));
+        }
+
+        return map;
+    }
+};
+
+} // namespace hserv
+
+#endif // HSERV_MIMETYPES_H
@@ -6,27 +6,30 @@
 #ifndef HSERV_REQUEST_H
 #define HSERV_REQUEST_H
 
-#include <string>
 #include <vector>
-#include <boost/algorithm/string.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <hserv/header.h>
+#include <hserv/knownheaders.h>
 #include <hserv/impl/requestimpl.h>
 
 namespace hserv {
 
+// The request does not own its data: all strings are views into the connection
+// buffer and stay valid until the response is completed. Use to_string() to keep
+// a copy for longer.
 class Request : private boost::noncopyable
 {
 public:
     Request(const RequestImpl &req) : impl(req) {}
 
-    std::string method() const {
+    boost::string_ref method() const {
         return impl.method;
     }
 
-    std::string uri() const {
+    boost::string_ref uri() const {
         return impl.uri;
     }
 
@@ -42,11 +45,11 @@ public:
         return impl.keepAlive;
     }
 
-    std::vector<char> postData() const {
+    boost::string_ref postData() const {
         return impl.postData;
     }
 
-    std::vector<HeaderItem> headers() const {
+    const std::vector<HeaderItem> &headers() const {
         return impl.headers;
     }
 
@@ -54,39 +57,47 @@ public:
         return impl.endpoint;
     }
 
-    bool hasHeader(const char *s) {
-        std::vector<HeaderItem>::const_iterator it = impl.headers.begin(), end = impl.headers.end();
-
-        for(; it != end; ++it)
-        {
-            if( strcasecmp(it->name.c_str(), s) == 0 )
-                return true;
-        }
+    bool hasHeader(KnownHeaders::Id id) const {
+        return id < KnownHeaders::Count && impl.knownHeaders[id] >= 0;
+    }
 
-        return false;
+    boost::string_ref headerValue(KnownHeaders::Id id) const {
+        if( hasHeader(id) )
+            return impl.headers[impl.knownHeaders[id]].value;
+        else
+            return boost::string_ref();
     }
 
-    std::string headerValue(const char *s) const {
-        std::vector<HeaderItem>::const_iterator it = impl.headers.begin(), end = impl.headers.end();
+    bool hasHeader(const boost::string_ref &s) const {
+        return findHeader(s) >= 0;
+    }
 
-        for(; it != end; ++it)
-        {
-            if( strcasecmp(it->name.c_str(), s) == 0 )
-                return it->value;
-        }
+    boost::string_ref headerValue(const boost::string_ref &s) const {
+        int index = findHeader(s);
 
-        return std::string();
+        if( index >= 0 )
+            return impl.headers[index].value;
+        else
+            return boost::string_ref();
     }
 
-    bool hasHeader(const std::string &s) {
-        return hasHeader(s.c_str());
-    }
+private:
+    // Well known names are taken from the table, others are searched for.
+    int findHeader(const boost::string_ref &s) const {
+        KnownHeaders::Id id = KnownHeaders::find(s);
 
-    std::string headerValue(const std::string &s) const {
-        return headerValue(s.c_str());
+        if( id != KnownHeaders::Unknown )
+            return impl.knownHeaders[id];
+
+        for(size_t i = 0; i < impl.headers.size(); ++i)
+        {
+            if( equalsIgnoreCase(impl.headers[i].name, s) )
+                return static_cast<int>(i);
+        }
+
+        return -1;
     }
 
-private:
     const RequestImpl &impl;
 };
 
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_REQUESTLOG_H
+#define HSERV_REQUESTLOG_H
+
+#include <cstddef>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+namespace hserv {
+
+// The log the servers write a record per response to, set it to
+// ServerSettings::accessLog. See AccessLog in hserv/accesslog.h.
+//
+// log() is called by the io threads of the servers, it must be thread safe
+// and should not block.
+class RequestLog
+{
+public:
+    // One response, the strings are valid during the call only.
+    struct Entry
+    {
+        Entry()
+            : date(NULL), versionMajor(1), versionMinor(1), status(0), bytes(0), latencyUs(0)
+        {
+        }
+
+        // "Sun, 06 Nov 1994 08:49:37 GMT", dateSize bytes
+        const char *date;
+        boost::string_ref method;
+        boost::string_ref uri;
+        int versionMajor;
+        int versionMinor;
+        int status;
+        boost::uint64_t bytes;
+        boost::uint64_t latencyUs;
+    };
+
+    enum {
+        dateSize = 29
+    };
+
+    virtual ~RequestLog()
+    {
+    }
+
+    virtual void log(const Entry &entry) = 0;
+};
+
+} // namespace hserv
+
+#endif // HSERV_REQUESTLOG_H
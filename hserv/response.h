@@ -15,6 +15,8 @@
 #include <boost/lexical_cast.hpp>
 
 #include <hserv/header.h>
+#include <hserv/headermap.h>
+#include <hserv/filehandle.h>
 #include <hserv/impl/responseimpl.h>
 
 namespace hserv {
@@ -22,29 +24,22 @@ namespace hserv {
 class Response
 {
 public:
+    // The "Date" and "Server" headers are added by the connection,
+    // unless they are set explicitly.
     Response()
     {
-        // Date header value
-
-        char buff[64] = {0};
-        static const char format[] = "%a, %d %b %Y %H:%M:%S GMT"; // rfc 1123
-        struct tm tm;
-
-        time_t now = time(0);
-#ifdef _MSC_VER
-        tm = *gmtime( &now );
-#else
-        gmtime_r( &now, &tm );
-#endif
-        strftime(buff, sizeof(buff) - 1, format, &tm);
-
-        static const std::string date = "Date";
-        static const std::string server = "Server";
-        static const std::string hserv = "hserv";
-
-        addHeader(date, buff);
-        addHeader(server, hserv);
+        setStatus( Ok );
+    }
 
+    // Forget the previous response but keep allocated memory,
+    // connections reuse one response for all requests.
+    void reset()
+    {
+        impl.headers.clear();
+        impl.content.clear();
+        impl.file.reset();
+        impl.fileOffset = 0;
+        impl.fileLength = 0;
         setStatus( Ok );
     }
 
@@ -67,6 +62,8 @@ public:
         Forbidden = 403,
         NotFound = 404,
         MethodNotAllowed = 405,
+        PayloadTooLarge = 413,
+        RequestHeaderFieldsTooLarge = 431,
         InternalServerError = 500,
         NotImplemented = 501,
         BadGateway = 502,
@@ -84,27 +81,31 @@ public:
         return static_cast<StatusType>(impl.status);
     }
 
-    std::map<std::string, std::string> headers() const
+    const HeaderMap &headers() const
     {
-        return std::map<std::string, std::string>(
-                    impl.headers.begin(),
-                    impl.headers.end());
+        return impl.headers;
     }
 
-    std::string header(const std::string &name) const
+    // The value is valid until the headers are changed.
+    boost::string_ref header(const boost::string_ref &name) const
     {
-        std::map<std::string,std::string, ResponseImpl<Response>::CaseInsensitive>::const_iterator
-                it = impl.headers.find(name);
+        return impl.headers.get(name);
+    }
 
-        if( it == impl.headers.end() )
-            return std::string();
-        else
-            return it->second;
+    bool hasHeader(const boost::string_ref &name) const
+    {
+        return impl.headers.contains(name);
+    }
+
+    // Add the header or replace its value.
+    void addHeader(const boost::string_ref &name, const boost::string_ref &value)
+    {
+        impl.headers.set(name, value);
     }
 
-    void addHeader(const std::string &name, const std::string &value)
+    void removeHeader(const boost::string_ref &name)
     {
-        impl.headers[name] = value;
+        impl.headers.remove(name);
     }
 
     const std::vector<char> &content() const
@@ -153,6 +154,52 @@ public:
         return impl.content.size();
     }
 
+    // Send a part of the file after the content when the response is done, the
+    // file data does not pass through the user space where sendfile() is available.
+    // The default length means up to the end of the file.
+    void setFile(const boost::shared_ptr<FileHandle> &file, off_t offset = 0,
+                 size_t length = static_cast<size_t>(-1))
+    {
+        impl.file = file;
+        impl.fileOffset = offset;
+        impl.fileLength = 0;
+
+        if( file && length == static_cast<size_t>(-1) )
+        {
+            if( file->size() > static_cast<size_t>(offset) )
+                impl.fileLength = file->size() - offset;
+        }
+        else if( file )
+        {
+            impl.fileLength = length;
+        }
+    }
+
+    // Returns false if the file can not be opened.
+    bool setFile(const std::string &path, off_t offset = 0,
+                 size_t length = static_cast<size_t>(-1))
+    {
+        boost::shared_ptr<FileHandle> file = FileHandle::open(path);
+
+        setFile(file, offset, length);
+        return file.get() != NULL;
+    }
+
+    const boost::shared_ptr<FileHandle> &file() const
+    {
+        return impl.file;
+    }
+
+    off_t fileOffset() const
+    {
+        return impl.fileOffset;
+    }
+
+    size_t fileLength() const
+    {
+        return impl.fileLength;
+    }
+
     std::vector<boost::asio::const_buffer> statusBuffers(int versionMajor,
                                                          int versionMinor) const
     {
@@ -165,6 +212,31 @@ public:
         return buffers;
     }
 
+    // Append the status line to the buffer.
+    void serializeStatus(int versionMajor, int versionMinor, std::vector<char> &out) const
+    {
+        append(out, ResponseImpl<Response>::httpVersionToBuffer(versionMajor, versionMinor));
+        append(out, ResponseImpl<Response>::httpStatusToBuffer(status()));
+    }
+
+    // Append "name: value\r\n" lines of the headers to the buffer.
+    void serializeHeaders(std::vector<char> &out) const
+    {
+        static const char name_value_separator[] = { ':', ' ' };
+        static const char crlf[] = { '\r', '\n' };
+
+        for(size_t i = 0; i < impl.headers.size(); ++i)
+        {
+            boost::string_ref name = impl.headers.name(i);
+            boost::string_ref value = impl.headers.value(i);
+
+            out.insert(out.end(), name.begin(), name.end());
+            out.insert(out.end(), name_value_separator, name_value_separator + sizeof(name_value_separator));
+            out.insert(out.end(), value.begin(), value.end());
+            out.insert(out.end(), crlf, crlf + sizeof(crlf));
+        }
+    }
+
     static boost::asio::const_buffer statusBuffer(StatusType status)
     {
         return ResponseImpl<Response>::httpStatusToBuffer(status);
@@ -179,14 +251,14 @@ public:
 
         buffers.reserve( 4 * impl.headers.size() + 1);
 
-        std::map<std::string, std::string, ResponseImpl<Response>::CaseInsensitive>::const_iterator
-                it = impl.headers.begin(), end = impl.headers.end();
-
-        for(; it != end; ++it)
+        for(size_t i = 0; i < impl.headers.size(); ++i)
         {
-            buffers.push_back(boost::asio::buffer(it->first));
+            boost::string_ref name = impl.headers.name(i);
+            boost::string_ref value = impl.headers.value(i);
+
+            buffers.push_back(boost::asio::buffer(name.data(), name.size()));
             buffers.push_back(boost::asio::buffer(name_value_separator));
-            buffers.push_back(boost::asio::buffer(it->second));
+            buffers.push_back(boost::asio::buffer(value.data(), value.size()));
             buffers.push_back(boost::asio::buffer(crlf));
         }
 
@@ -201,14 +273,20 @@ public:
         resp.impl.status = status;
         resp.impl.content.assign( s.begin(), s.end() );
 
-        resp.impl.headers["Content-Type"] = "text/html; charset=utf-8";
-        resp.impl.headers["Content-Length"] =
-                boost::lexical_cast<std::string>(resp.impl.content.size());
+        resp.impl.headers.set("Content-Type", "text/html; charset=utf-8");
+        resp.impl.headers.set("Content-Length",
+                              boost::lexical_cast<std::string>(resp.impl.content.size()));
 
         return resp;
     }
 
 private:
+    static void append(std::vector<char> &out, const boost::asio::const_buffer &buffer)
+    {
+        const char *ptr = boost::asio::buffer_cast<const char *>(buffer);
+        out.insert(out.end(), ptr, ptr + boost::asio::buffer_size(buffer));
+    }
+
     ResponseImpl<Response> impl;
 };
 
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_SERVERSETTINGS_H
+#define HSERV_SERVERSETTINGS_H
+
+#include <cstddef>
+#include <boost/shared_ptr.hpp>
+
+namespace hserv {
+
+class RequestLog;
+class ServerMetrics;
+
+// Tunables of the server, change them before run().
+struct ServerSettings
+{
+    ServerSettings()
+        : streamRequestBody(false), maxHeaderSize(65536), maxBodySize(16 * 1024 * 1024),
+          connectionPoolSize(256),
+          keepAliveTimeout(15), headerTimeout(30), bodyTimeout(30), writeTimeout(30),
+          maxConnections(0), maxRequestsInFlight(0), shedOverload(false)
+    {
+    }
+
+    // Call the handler as soon as the request headers are received, the body
+    // is read in fragments with Context::asyncReadBody(). Otherwise the body
+    // is collected in memory before the handler is called.
+    bool streamRequestBody;
+
+    // Limits of a request in bytes, zero means no limit. The request line with
+    // the headers above maxHeaderSize gets "431 Request Header Fields Too Large",
+    // a body above maxBodySize "413 Payload Too Large", then the connection is
+    // closed. A streamed body is not collected in memory and not limited.
+    size_t maxHeaderSize;
+    size_t maxBodySize;
+
+    // Closed connections kept with their buffers for the next clients,
+    // per io_service. Zero disables pooling.
+    size_t connectionPoolSize;
+
+    // Timeouts in seconds, zero disables a timeout. The connection is closed
+    // when the client
+    //  - does not start the next request on a keep-alive connection,
+    //  - does not complete the request headers since their first byte,
+    //  - pauses sending of the body,
+    //  - does not accept the response data.
+    // There is no timeout while the handler processes the request.
+    unsigned int keepAliveTimeout;
+    unsigned int headerTimeout;
+    unsigned int bodyTimeout;
+    unsigned int writeTimeout;
+
+    // Accepting is paused while the server has maxConnections open connections,
+    // the clients wait in the listen queue. Every thread with its own acceptor
+    // may take one connection more before it is paused. Zero means no limit.
+    size_t maxConnections;
+
+    // Requests above this number in the handlers get "503 Service Unavailable"
+    // and their connections are closed. Zero means no limit.
+    size_t maxRequestsInFlight;
+
+    // Keep accepting above maxConnections, but answer the requests of the
+    // excess connections with 503 and close them instead of letting the
+    // clients wait in the listen queue.
+    bool shedOverload;
+
+    // A line per response is written to the log, usually an AccessLog of
+    // hserv/accesslog.h. Null disables logging.
+    boost::shared_ptr<RequestLog> accessLog;
+
+    // Counters and latency histograms, see hserv/metrics.h. Null disables them.
+    boost::shared_ptr<ServerMetrics> metrics;
+};
+
+} // namespace hserv
+
+#endif // HSERV_SERVERSETTINGS_H
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#ifndef HSERV_STATICFILES_H
+#define HSERV_STATICFILES_H
+
+#include <cerrno>
+#include <ctime>
+#include <list>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include <hserv/filehandle.h>
+#include <hserv/mimetypes.h>
+#include <hserv/request.h>
+#include <hserv/response.h>
+
+namespace hserv {
+
+// Serves files of a directory. Open descriptors, sizes, MIME types and header
+// values of recently used files are kept in a bounded LRU cache, so a cached file
+// is served without file system calls except the transfer itself.
+//
+// On Linux the cache is invalidated by inotify events, which are read by a background
+// thread. A directory is watched while any cached file refers to it. Elsewhere a
+// cached file is checked with stat() on every request.
+//
+// The object is thread safe and may be shared by the threads of the server.
+class StaticFiles : private boost::noncopyable
+{
+public:
+    explicit StaticFiles(const std::string &root, size_t capacity = 1024)
+        : root(root), capacity(capacity), generation(0), inotifyFd(-1)
+    {
+        if( this->root.empty() )
+            this->root = ".";
+
+        while( this->root.size() > 1 && this->root[this->root.size() - 1] == '/' )
+            this->root.erase(this->root.size() - 1);
+
+#ifdef __linux__
+        wakeupPipe[0] = wakeupPipe[1] = -1;
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if( inotifyFd >= 0 && pipe(wakeupPipe) == 0 )
+        {
+            watcher.reset(new boost::thread(boost::bind(&StaticFiles::watch, this)));
+        }
+        else if( inotifyFd >= 0 )
+        {
+            ::close(inotifyFd);
+            inotifyFd = -1;
+        }
+#endif
+    }
+
+    ~StaticFiles()
+    {
+#ifdef __linux__
+        if( watcher )
+        {
+            char c = 0;
+
+            while( write(wakeupPipe[1], &c, 1) < 0 && errno == EINTR )
+                ;
+
+            watcher->join();
+
+            ::close(wakeupPipe[0]);
+            ::close(wakeupPipe[1]);
+            ::close(inotifyFd);
+        }
+#endif
+    }
+
+    // Set up the response to send the file of the uri. Returns false if there is
+    // no such file, the response is not changed then.
+    bool serve(const boost::string_ref &uri, Response &response)
+    {
+        boost::string_ref path = uri.substr(0, uri.find('?'));
+
+        if( path.empty() || path[0] != '/' || path.find("/..") != boost::string_ref::npos )
+            return false;
+
+        boost::shared_ptr<Entry> entry = find(path);
+
+        if( !entry )
+            return false;
+
+        static const std::string contentType = "Content-Type";
+        static const std::string lastModified = "Last-Modified";
+
+        response.setStatus(Response::Ok);
+        response.addHeader(contentType, entry->mimeType);
+        response.addHeader(lastModified, entry->lastModified);
+        response.setFile(entry->file, 0, entry->size);
+
+        return true;
+    }
+
+    bool serve(const Request &request, Response &response)
+    {
+        return serve(request.uri(), response);
+    }
+
+    size_t size() const
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return lru.size();
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string path;
+        // The inotify watch of the directory, the changes of the file are
+        // reported by it, or -1.
+        int wd;
+        boost::shared_ptr<FileHandle> file;
+        size_t size;
+        time_t mtime;
+        std::string mimeType;
+        std::string lastModified;
+    };
+
+    typedef std::list< boost::shared_ptr<Entry> > Lru;
+    typedef boost::unordered_map<std::string, Lru::iterator> Index;
+
+    boost::shared_ptr<Entry> find(const boost::string_ref &uri)
+    {
+        std::string key(uri.begin(), uri.end());
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            Index::iterator it = index.find(key);
+
+            if( it != index.end() && valid(**it->second) )
+            {
+                // move to the front, the least recently used entry is the last one
+                lru.splice(lru.begin(), lru, it->second);
+                return *it->second;
+            }
+        }
+
+        size_t loadGeneration = currentGeneration();
+        boost::shared_ptr<Entry> entry = load(key);
+
+        if( entry )
+            insert(entry, loadGeneration);
+
+        return entry;
+    }
+
+    // Open the file of the uri, directories are served by their index.html.
+    boost::shared_ptr<Entry> load(const std::string &key)
+    {
+        boost::shared_ptr<Entry> entry(new Entry);
+
+        entry->key = key;
+        entry->path = root + key;
+
+        if( entry->path[entry->path.size() - 1] == '/' )
+        {
+            entry->path += "index.html";
+        }
+        else
+        {
+            struct stat st;
+
+            if( stat(entry->path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) )
+                entry->path += "/index.html";
+        }
+
+        // Watch before opening, so a change after the open is not missed.
+        entry->wd = watchDirectory(entry->path.substr(0, entry->path.rfind('/')));
+
+        entry->file = FileHandle::open(entry->path);
+
+        struct stat st;
+
+        if( !entry->file || fstat(entry->file->fd(), &st) != 0 )
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            unwatch(entry->wd);
+            return boost::shared_ptr<Entry>();
+        }
+
+        entry->size = static_cast<size_t>(st.st_size);
+        entry->mtime = st.st_mtime;
+        entry->mimeType = MimeTypes::find(entry->path);
+        entry->lastModified = httpDate(st.st_mtime);
+
+        return entry;
+    }
+
+    size_t currentGeneration() const
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return generation;
+    }
+
+    // The entry is not cached if something is changed while it was loaded.
+    void insert(const boost::shared_ptr<Entry> &entry, size_t loadGeneration)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+
+        if( generation != loadGeneration )
+        {
+            unwatch(entry->wd);
+            return;
+        }
+
+        Index::iterator it = index.find(entry->key);
+
+        if( it != index.end() )
+            erase(it->second);
+
+        lru.push_front(entry);
+        index[entry->key] = lru.begin();
+
+        while( lru.size() > capacity )
+            erase(--lru.end());
+    }
+
+    // Remove the entry from the cache, the mutex is locked.
+    Lru::iterator erase(Lru::iterator entry)
+    {
+        unwatch((*entry)->wd);
+        index.erase((*entry)->key);
+        return lru.erase(entry);
+    }
+
+    // Without inotify the file is checked on every request.
+    bool valid(const Entry &entry) const
+    {
+        if( entry.wd >= 0 )
+            return true;
+
+        struct stat st;
+
+        return stat(entry.path.c_str(), &st) == 0 &&
+                static_cast<size_t>(st.st_size) == entry.size && st.st_mtime == entry.mtime;
+    }
+
+    static std::string httpDate(time_t time)
+    {
+        char buff[64] = {0};
+        static const char format[] = "%a, %d %b %Y %H:%M:%S GMT"; // rfc 1123
+        struct tm tm;
+
+        gmtime_r( &time, &tm );
+        strftime(buff, sizeof(buff) - 1, format, &tm);
+
+        return buff;
+    }
+
+#ifdef __linux__
+    // A watched directory, the entries loaded and cached from it are counted.
+    struct Watch {
+        std::string directory;
+        size_t entries;
+    };
+
+    // Returns the watch descriptor for the new entry or -1, the entry
+    // must release it with unwatch().
+    int watchDirectory(const std::string &directory)
+    {
+        if( inotifyFd < 0 )
+            return -1;
+
+        boost::mutex::scoped_lock lock(mutex);
+        boost::unordered_map<std::string, int>::iterator it = watchedDirectories.find(directory);
+
+        if( it != watchedDirectories.end() )
+        {
+            ++watches[it->second].entries;
+            return it->second;
+        }
+
+        int wd = inotify_add_watch(inotifyFd, directory.c_str(),
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                   IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_DELETE_SELF | IN_MOVE_SELF);
+
+        if( wd < 0 )
+            return -1;
+
+        Watch &watch = watches[wd];
+
+        watch.directory = directory;
+        watch.entries = 1;
+        watchedDirectories.insert(std::make_pair(directory, wd));
+
+        return wd;
+    }
+
+    // The entry of the watch is released, the mutex is locked. The directory
+    // is not watched any more when no entry refers to it.
+    void unwatch(int wd)
+    {
+        boost::unordered_map<int, Watch>::iterator it = watches.find(wd);
+
+        // the directory may be removed already
+        if( it == watches.end() || --it->second.entries > 0 )
+            return;
+
+        inotify_rm_watch(inotifyFd, wd);
+        watchedDirectories.erase(it->second.directory);
+        watches.erase(it);
+    }
+
+    // The inotify thread.
+    void watch()
+    {
+        char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+        pollfd fds[2];
+
+        fds[0].fd = inotifyFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wakeupPipe[0];
+        fds[1].events = POLLIN;
+
+        for(;;)
+        {
+            if( poll(fds, 2, -1) < 0 )
+            {
+                if( errno == EINTR )
+                    continue;
+                else
+                    return;
+            }
+
+            if( fds[1].revents != 0 )
+                return;
+
+            ssize_t size = read(inotifyFd, buffer, sizeof(buffer));
+
+            for(ssize_t offset = 0; offset < size;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+
+                handleEvent(*event);
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    void handleEvent(const inotify_event &event)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::unordered_map<int, Watch>::iterator it = watches.find(event.wd);
+
+        if( it == watches.end() )
+            return;
+
+        ++generation;
+
+        // A file of the directory or the directory itself is changed.
+        std::string prefix = it->second.directory + "/";
+        std::string path = event.len != 0 ? prefix + event.name : std::string();
+
+        // The kernel removed the watch, the directory is gone.
+        if( event.mask & IN_IGNORED )
+        {
+            watchedDirectories.erase(it->second.directory);
+            watches.erase(it);
+        }
+
+        // The entries release their watches, which may be removed.
+        for(Lru::iterator entry = lru.begin(); entry != lru.end();)
+        {
+            const std::string &p = (*entry)->path;
+            bool changed = path.empty() ? p.compare(0, prefix.size(), prefix) == 0
+                                        : p == path || p.compare(0, path.size() + 1, path + "/") == 0;
+
+            if( changed )
+                entry = erase(entry);
+            else
+                ++entry;
+        }
+    }
+#else
+    int watchDirectory(const std::string &)
+    {
+        return -1;
+    }
+
+    void unwatch(int)
+    {
+    }
+#endif
+
+    std::string root;
+    size_t capacity;
+
+    mutable boost::mutex mutex;
+    Lru lru;
+    Index index;
+    // Incremented on every change of the watched files.
+    size_t generation;
+
+    int inotifyFd;
+#ifdef __linux__
+    // Wakes up the inotify thread on destruction.
+    int wakeupPipe[2];
+    boost::unordered_map<int, Watch> watches;
+    boost::unordered_map<std::string, int> watchedDirectories;
+    boost::scoped_ptr<boost::thread> watcher;
+#endif
+};
+
+} // namespace hserv
+
+#endif // HSERV_STATICFILES_H
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: MIT
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <hserv/staticfiles.h>
+
+using namespace hserv;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if( !(condition) ) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+            ++failures; \
+        } \
+    } while( false )
+
+static void writeFile(const std::string &path, const std::string &content)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    file << content;
+}
+
+// The size of the file the response sends, zero if the file is not served.
+static size_t servedSize(StaticFiles &files, const std::string &uri)
+{
+    Response response;
+
+    if( files.serve(uri, response) == false )
+        return 0;
+
+    return response.fileLength();
+}
+
+// The cache is invalidated asynchronously on Linux.
+static bool waitServedSize(StaticFiles &files, const std::string &uri, size_t size)
+{
+    for(int i = 0; i < 200; ++i)
+    {
+        if( servedSize(files, uri) == size )
+            return true;
+
+        usleep(10000);
+    }
+
+    return false;
+}
+
+#ifdef __linux__
+// The number of inotify watches of the process.
+static int inotifyWatches()
+{
+    int count = 0;
+    DIR *dir = opendir("/proc/self/fd");
+
+    if( dir == NULL )
+        return -1;
+
+    while( dirent *entry = readdir(dir) )
+    {
+        std::string fd = std::string("/proc/self/fd/") + entry->d_name;
+        char link[64] = {0};
+
+        if( readlink(fd.c_str(), link, sizeof(link) - 1) < 0 ||
+                std::strcmp(link, "anon_inode:inotify") != 0 )
+            continue;
+
+        std::ifstream info((std::string("/proc/self/fdinfo/") + entry->d_name).c_str());
+        std::string line;
+
+        while( std::getline(info, line) )
+        {
+            if( line.compare(0, 11, "inotify wd:") == 0 )
+                ++count;
+        }
+    }
+
+    closedir(dir);
+    return count;
+}
+#endif
+
+static void testModifiedFile(const std::string &root)
+{
+    writeFile(root + "/a.txt", "one");
+
+    StaticFiles files(root);
+
+    CHECK( servedSize(files, "/a.txt") == 3 );
+    CHECK( files.size() == 1 );
+
+    // a new size and mtime, either is noticed
+    writeFile(root + "/a.txt", "modified");
+    CHECK( waitServedSize(files, "/a.txt", 8) );
+
+    ::unlink((root + "/a.txt").c_str());
+    CHECK( waitServedSize(files, "/a.txt", 0) );
+}
+
+static void testEvictedWatches(const std::string &root)
+{
+    ::mkdir((root + "/x").c_str(), 0700);
+    ::mkdir((root + "/y").c_str(), 0700);
+    writeFile(root + "/x/1.txt", "1");
+    writeFile(root + "/y/22.txt", "22");
+
+    StaticFiles files(root, 1);
+
+    CHECK( servedSize(files, "/x/1.txt") == 1 );
+    CHECK( servedSize(files, "/y/22.txt") == 2 );
+    CHECK( files.size() == 1 );
+
+#ifdef __linux__
+    // /x/1.txt is evicted, its directory is not watched any more
+    CHECK( inotifyWatches() == 1 );
+#endif
+
+    // the evicted file is loaded again and its changes are noticed
+    CHECK( servedSize(files, "/x/1.txt") == 1 );
+    writeFile(root + "/x/1.txt", "111");
+    CHECK( waitServedSize(files, "/x/1.txt", 3) );
+
+    ::unlink((root + "/x/1.txt").c_str());
+    ::unlink((root + "/y/22.txt").c_str());
+    ::rmdir((root + "/x").c_str());
+    ::rmdir((root + "/y").c_str());
+}
+
+int main()
+{
+    char root[] = "/tmp/hserv-staticfiles-XXXXXX";
+
+    if( mkdtemp(root) == NULL )
+    {
+        std::perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    testModifiedFile(root);
+    testEvictedWatches(root);
+
+    ::rmdir(root);
+
+    if( failures != 0 )
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}